@@ -0,0 +1,202 @@
+#include "array.h"
+#include "context.h"
+
+#include <stdlib.h>
+
+/*
+** Bulk operations work through SIMD lanes on x86-64: SSE2, which every
+** x86-64 machine has, or AVX when the compiler is targeting it. Elements
+** left over after the last full set of lanes, and everything on other
+** machines, go through a plain loop.
+*/
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define ARRAY_SIMD
+
+#if defined(__AVX__) && defined(BT_USE_DOUBLE)
+typedef __m256d Lanes;
+#define LANES 4
+#define lzero() _mm256_setzero_pd()
+#define lset(n) _mm256_set1_pd(n)
+#define lload(p) _mm256_loadu_pd(p)
+#define lstore(p, v) _mm256_storeu_pd(p, v)
+#define ladd(a, b) _mm256_add_pd(a, b)
+#define lmul(a, b) _mm256_mul_pd(a, b)
+#elif defined(__AVX__)
+typedef __m256 Lanes;
+#define LANES 8
+#define lzero() _mm256_setzero_ps()
+#define lset(n) _mm256_set1_ps(n)
+#define lload(p) _mm256_loadu_ps(p)
+#define lstore(p, v) _mm256_storeu_ps(p, v)
+#define ladd(a, b) _mm256_add_ps(a, b)
+#define lmul(a, b) _mm256_mul_ps(a, b)
+#elif defined(BT_USE_DOUBLE)
+typedef __m128d Lanes;
+#define LANES 2
+#define lzero() _mm_setzero_pd()
+#define lset(n) _mm_set1_pd(n)
+#define lload(p) _mm_loadu_pd(p)
+#define lstore(p, v) _mm_storeu_pd(p, v)
+#define ladd(a, b) _mm_add_pd(a, b)
+#define lmul(a, b) _mm_mul_pd(a, b)
+#else
+typedef __m128 Lanes;
+#define LANES 4
+#define lzero() _mm_setzero_ps()
+#define lset(n) _mm_set1_ps(n)
+#define lload(p) _mm_loadu_ps(p)
+#define lstore(p, v) _mm_storeu_ps(p, v)
+#define ladd(a, b) _mm_add_ps(a, b)
+#define lmul(a, b) _mm_mul_ps(a, b)
+#endif
+
+/* Adds up the lanes of [v] */
+static BT_NUMBER lsum(Lanes v)
+{
+    BT_NUMBER lanes[LANES];
+    lstore(lanes, v);
+    BT_NUMBER total = 0;
+    for (int i = 0; i != LANES; ++i) {
+        total += lanes[i];
+    }
+    return total;
+}
+#endif
+
+/* GC finalizer for arrays, the elements are a block of their own */
+static void finalizearray(bt_Context* bt, void* obj)
+{
+    Array* a = obj;
+    ctx_free(bt, a->data, a->capacity * sizeof(BT_NUMBER));
+}
+
+/* Arrays only hold numbers, so there's nothing to traverse */
+static const GCType arraytype = { NULL, finalizearray, 0 };
+
+/*
+** Creates an array [length] numbers long, with its first [count] elements
+** taken from [elements] and the rest 0. Returns NULL without allocating
+** anything if [length] isn't a number from [count] to ARRAY_MAX, or one of
+** the elements isn't a number.
+*/
+Array* array_new(bt_Context* bt, bt_Value* length, bt_Value* elements, int count)
+{
+    if (!isnumber(*length) || !(tonumber(*length) >= count && tonumber(*length) <= ARRAY_MAX)) {
+        return NULL;
+    }
+    for (int i = 0; i != count; ++i) {
+        if (!isnumber(elements[i])) {
+            return NULL;
+        }
+    }
+    Array* a = ctx_gcalloc(bt, sizeof(Array), &arraytype);
+    a->length = a->capacity = (int)tonumber(*length);
+    a->data = NULL;
+    if (a->capacity != 0) {
+        a->data = ctx_alloc(bt, a->capacity * sizeof(BT_NUMBER));
+        for (int i = 0; i != a->length; ++i) {
+            a->data[i] = i < count ? tonumber(elements[i]) : 0;
+        }
+    }
+    return a;
+}
+
+/*
+** Sets element [idx] of an array to [vl], appending it if [idx] is the length.
+** Returns 0 without changing anything if [vl] isn't a number or [idx]
+** isn't a number from 0 to the length.
+*/
+int array_set(bt_Context* bt, Array* a, bt_Value* idx, bt_Value* vl)
+{
+    if (!isnumbers(*idx, *vl) || !(tonumber(*idx) >= 0 && tonumber(*idx) <= a->length)) {
+        return 0;
+    }
+    int i = (int)tonumber(*idx);
+    if (i == a->length) {
+        if (a->length == a->capacity) {
+            if (a->capacity == ARRAY_MAX) {
+                return 0;
+            }
+            int capacity = a->capacity < 4 ? 4 : a->capacity < ARRAY_MAX / 2 ? a->capacity * 2 : ARRAY_MAX;
+            a->data = a->data == NULL ? ctx_alloc(bt, capacity * sizeof(BT_NUMBER))
+                : ctx_realloc(bt, a->data, a->capacity * sizeof(BT_NUMBER), capacity * sizeof(BT_NUMBER));
+            a->capacity = capacity;
+        }
+        ++a->length;
+    }
+    a->data[i] = tonumber(*vl);
+    return 1;
+}
+
+/*
+** Adds up [n] numbers.
+** Each lane keeps a total of its own, and they're only added together at
+** the end, so the last bits can differ from adding the numbers in order.
+*/
+BT_NUMBER array_sum(const BT_NUMBER* x, int n)
+{
+    BT_NUMBER total = 0;
+    int i = 0;
+#ifdef ARRAY_SIMD
+    // Two sets of totals, so an add doesn't have to wait for the one before it
+    Lanes s0 = lzero(), s1 = lzero();
+    for (; i + 2 * LANES <= n; i += 2 * LANES) {
+        s0 = ladd(s0, lload(x + i));
+        s1 = ladd(s1, lload(x + i + LANES));
+    }
+    total = lsum(ladd(s0, s1));
+#endif
+    for (; i < n; ++i) {
+        total += x[i];
+    }
+    return total;
+}
+
+/* Dot product of [n] numbers from [x] and [y], added up like array_sum */
+BT_NUMBER array_dot(const BT_NUMBER* x, const BT_NUMBER* y, int n)
+{
+    BT_NUMBER total = 0;
+    int i = 0;
+#ifdef ARRAY_SIMD
+    Lanes s0 = lzero(), s1 = lzero();
+    for (; i + 2 * LANES <= n; i += 2 * LANES) {
+        s0 = ladd(s0, lmul(lload(x + i), lload(y + i)));
+        s1 = ladd(s1, lmul(lload(x + i + LANES), lload(y + i + LANES)));
+    }
+    total = lsum(ladd(s0, s1));
+#endif
+    for (; i < n; ++i) {
+        total += x[i] * y[i];
+    }
+    return total;
+}
+
+/* Multiplies [n] numbers by [k] in place */
+void array_scale(BT_NUMBER* x, BT_NUMBER k, int n)
+{
+    int i = 0;
+#ifdef ARRAY_SIMD
+    Lanes factor = lset(k);
+    for (; i + LANES <= n; i += LANES) {
+        lstore(x + i, lmul(lload(x + i), factor));
+    }
+#endif
+    for (; i < n; ++i) {
+        x[i] *= k;
+    }
+}
+
+/* Adds [n] numbers from [y] to the ones in [x] */
+void array_add(BT_NUMBER* x, const BT_NUMBER* y, int n)
+{
+    int i = 0;
+#ifdef ARRAY_SIMD
+    for (; i + LANES <= n; i += LANES) {
+        lstore(x + i, ladd(lload(x + i), lload(y + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        x[i] += y[i];
+    }
+}
\ No newline at end of file
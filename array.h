@@ -0,0 +1,42 @@
+#ifndef _ARRAY_H_
+#define _ARRAY_H_
+
+#include <limits.h>
+
+#include "bullet_train.h"
+#include "value.h"
+
+/*
+** Array of numbers.
+** Elements are stored unboxed in one buffer, so the bulk operations run
+** straight over it. [data] has room for [capacity] numbers, the first
+** [length] of which are in use. Like structs, arrays aren't locked, so
+** tasks sharing one mustn't append to it at the same time.
+*/
+struct Array {
+    BT_NUMBER* data;
+    int length;
+    int capacity;
+};
+
+/* Most elements an array can hold */
+#define ARRAY_MAX (INT_MAX / (int)sizeof(BT_NUMBER))
+
+/* Gets element [idx] of an array, nil if it's out of range */
+static inline bt_Value array_get(Array* a, BT_NUMBER idx)
+{
+    if (idx >= 0 && idx < a->length) {
+        return number(a->data[(int)idx]);
+    }
+    return nil();
+}
+
+Array* array_new(bt_Context* bt, bt_Value* length, bt_Value* elements, int count);
+int array_set(bt_Context* bt, Array* a, bt_Value* idx, bt_Value* vl);
+
+BT_NUMBER array_sum(const BT_NUMBER* x, int n);
+BT_NUMBER array_dot(const BT_NUMBER* x, const BT_NUMBER* y, int n);
+void array_scale(BT_NUMBER* x, BT_NUMBER k, int n);
+void array_add(BT_NUMBER* x, const BT_NUMBER* y, int n);
+
+#endif
\ No newline at end of file
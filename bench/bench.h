@@ -0,0 +1,24 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*
+** Shared by the benchmark programs.
+** Include it before any system header, since clock_gettime needs a POSIX
+** feature level; programs that need a later one define their own first.
+*/
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <time.h>
+
+/* Seconds on a monotonic clock, for timing runs */
+static inline double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+#endif
\ No newline at end of file
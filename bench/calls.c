@@ -0,0 +1,86 @@
+/*
+** Call benchmark.
+** Times recursive and call-heavy scripts, and checks with bt_callstats
+** that calls stop allocating once the first run has set the frames up.
+** Usage: bench_calls [fib n] [loop iterations]
+*/
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bullet_train.h"
+
+#define RUNS 5
+
+/* Plain recursion, two calls deep per level */
+static const char* fib =
+    "func fib(n) {\n"
+    "    if n < 2 {\n"
+    "        ret n\n"
+    "    }\n"
+    "    ret fib(n - 1) + fib(n - 2)\n"
+    "}\n"
+    "print fib(%d)\n";
+
+/* Small functions called from a loop, and a tail recursive one */
+static const char* loop =
+    "func add(a, b) {\n"
+    "    ret a + b\n"
+    "}\n"
+    "func madd(a, b, c) {\n"
+    "    ret add(a * b, c)\n"
+    "}\n"
+    "func count(n, acc) {\n"
+    "    if n == 0 {\n"
+    "        ret acc\n"
+    "    }\n"
+    "    ret count(n - 1, acc + 1)\n"
+    "}\n"
+    "acc = 0\n"
+    "i = 0\n"
+    "while i < %d {\n"
+    "    acc = madd(acc, 0.5, i)\n"
+    "    i = i + 1\n"
+    "}\n"
+    "print count(%d, 0)\n";
+
+static void run(const char* name, const char* src)
+{
+    bt_Context* bt = bt_newcontext();
+    bt_Function* fn = bt_compile(bt, src);
+    unsigned long calls, allocs, warmcalls, warmallocs;
+
+    // The first run sets up the frames and the stack
+    bt_call(bt, fn);
+    bt_callstats(bt, &warmcalls, &warmallocs);
+
+    double best = 1e30;
+    for (int i = 0; i != RUNS; ++i) {
+        double start = now();
+        bt_call(bt, fn);
+        double t = now() - start;
+        if (t < best) {
+            best = t;
+        }
+    }
+    bt_callstats(bt, &calls, &allocs);
+    calls -= warmcalls;
+    allocs -= warmallocs;
+    printf("%s: %lu calls per run, %.2f ms, %.2f ns/call, %lu allocations in %d runs (%lu in the first)\n",
+        name, calls / RUNS, best * 1e3, best * 1e9 / (calls / RUNS), allocs, RUNS, warmallocs);
+    bt_freecontext(bt);
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 25;
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    char src[1024];
+    snprintf(src, sizeof(src), fib, n);
+    run("fib", src);
+    snprintf(src, sizeof(src), loop, iterations, iterations);
+    run("loop", src);
+    return 0;
+}
\ No newline at end of file
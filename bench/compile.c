@@ -0,0 +1,63 @@
+/*
+** Compile throughput benchmark.
+** Generates a multi-megabyte script, then times bt_fcompile on it.
+** Usage: bench_compile [megabytes] [file]
+*/
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bullet_train.h"
+
+#define RUNS 5
+
+/* Writes a script of at least [size] bytes made of loops, branches and struct accesses */
+static long generate(const char* path, long size)
+{
+    FILE* file = fopen(path, "w");
+    long written = fprintf(file, "total = 0\n");
+    for (int i = 0; written < size; ++i) {
+        int k = i % 50;
+        written += fprintf(file,
+            "p%d = {}\n"
+            "p%d.xpos = %d\n"
+            "p%d.ypos = p%d.xpos + %d\n"
+            "counter = 0\n"
+            "while counter < %d {\n"
+            "    counter = counter + 1\n"
+            "    if p%d.ypos > counter {\n"
+            "        p%d.ypos = p%d.ypos - 1.5\n"
+            "    } else {\n"
+            "        total = total * 2\n"
+            "    }\n"
+            "}\n",
+            k, k, i, k, k, k, k + 3, k, k, k);
+    }
+    fclose(file);
+    return written;
+}
+
+int main(int argc, char** argv)
+{
+    long mb = argc > 1 ? atol(argv[1]) : 8;
+    const char* path = argc > 2 ? argv[2] : "bench_compile.bt";
+    long size = generate(path, mb * 1024 * 1024);
+
+    double best = 0;
+    for (int i = 0; i != RUNS; ++i) {
+        bt_Context* bt = bt_newcontext();
+        double start = now();
+        bt_fcompile(bt, path);
+        double t = now() - start;
+        if (i == 0 || t < best) {
+            best = t;
+        }
+        bt_freecontext(bt);
+    }
+    remove(path);
+
+    double mbytes = size / (1024.0 * 1024.0);
+    printf("compile: %.1f MB in %.2f ms, %.1f MB/s\n", mbytes, best * 1e3, mbytes / best);
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+** Multi-core throughput benchmark.
+** Spawns a batch of CPU-bound tasks and runs them with bt_run on
+** 1 to N workers, reporting tasks per second and the speedup over one.
+** Usage: bench_cores [max workers] [tasks] [iterations per task]
+*/
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bullet_train.h"
+
+#define BUDGET 10000
+
+/* Arithmetic and struct field traffic, with a little allocation now and then */
+static const char* script =
+    "acc = 0\n"
+    "p = {}\n"
+    "p.x = 1\n"
+    "p.y = 2\n"
+    "i = 0\n"
+    "while i < %d {\n"
+    "    p.x = p.x + p.y * 0.5\n"
+    "    if p.x > 1000 {\n"
+    "        p = {}\n"
+    "        p.x = 1\n"
+    "        p.y = acc - i\n"
+    "    }\n"
+    "    acc = acc + p.x - i\n"
+    "    i = i + 1\n"
+    "}\n";
+
+int main(int argc, char** argv)
+{
+    int maxworkers = argc > 1 ? atoi(argv[1]) : 8;
+    int tasks = argc > 2 ? atoi(argv[2]) : 256;
+    int iterations = argc > 3 ? atoi(argv[3]) : 20000;
+
+    char src[1024];
+    snprintf(src, sizeof(src), script, iterations);
+
+    double base = 0;
+    for (int workers = 1; workers <= maxworkers; workers *= 2) {
+        bt_Context* bt = bt_newcontext();
+        bt_Function* fn = bt_compile(bt, src);
+        for (int i = 0; i != tasks; ++i) {
+            bt_spawn(bt, fn);
+        }
+        double start = now();
+        int used = bt_run(bt, workers, BUDGET);
+        double t = now() - start;
+        if (workers == 1) {
+            base = t;
+        }
+        printf("workers: %d (%d ran), %d tasks in %.2f ms, %.0f tasks/s, %.2fx\n",
+            workers, used, tasks, t * 1e3, tasks / t, base / t);
+        bt_freecontext(bt);
+    }
+    return 0;
+}
\ No newline at end of file
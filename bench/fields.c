@@ -0,0 +1,89 @@
+/*
+** Struct shape memory benchmark.
+** Builds structs field by field and reports, with bt_shapestats, how many
+** metatables their shapes took and how many bytes those use. A chain is
+** one struct built up to the given number of fields, a branch is 8 structs
+** of 16 fields each skipping a different key. Building the same struct
+** again has to reuse its shape, so the repeated runs must not add any.
+** Usage: bench_fields
+*/
+#include <stdio.h>
+
+#include "../bullet_train.h"
+
+#define REPEATS 100
+#define BRANCHES 8
+
+/* Appends [s] to the script being built in [src] */
+static void append(char* src, int* at, int size, const char* s)
+{
+    *at += snprintf(src + *at, size - *at, "%s", s);
+}
+
+/* Appends statements setting fields 0 to [fields] of s, except [skip] */
+static void setfields(char* src, int* at, int size, int fields, int skip)
+{
+    char line[32];
+    for (int f = 0; f != fields; ++f) {
+        if (f != skip) {
+            snprintf(line, sizeof(line), "    s.f%d = %d\n", f, f);
+            append(src, at, size, line);
+        }
+    }
+}
+
+/* Runs [src] in a fresh context, returning its shape statistics */
+static void measure(const char* src, unsigned long* metatables, unsigned long* bytes)
+{
+    bt_Context* bt = bt_newcontext();
+    bt_Function* fn = bt_compile(bt, src);
+    bt_call(bt, fn);
+    bt_shapestats(bt, metatables, bytes);
+    bt_freecontext(bt);
+}
+
+/*
+** Measures [branches] structs of [fields] fields, each skipping a
+** different key if there's more than one, built once and then
+** [repeats] times. Returns 0 if the repeats made new shapes.
+*/
+static int run(const char* name, int fields, int branches, int repeats)
+{
+    static char src[65536];
+    char line[64];
+    unsigned long once, oncebytes, again, againbytes;
+
+    for (int pass = 0; pass != 2; ++pass) {
+        int at = 0;
+        snprintf(line, sizeof(line), "i = 0\nwhile i < %d {\n", pass == 0 ? 1 : repeats);
+        append(src, &at, sizeof(src), line);
+        for (int b = 0; b != branches; ++b) {
+            append(src, &at, sizeof(src), "    s = {}\n");
+            setfields(src, &at, sizeof(src), fields, branches > 1 ? b : -1);
+        }
+        append(src, &at, sizeof(src), "    i = i + 1\n}\n");
+        if (pass == 0) {
+            measure(src, &once, &oncebytes);
+        } else {
+            measure(src, &again, &againbytes);
+        }
+    }
+
+    printf("%s: %lu metatables, %lu bytes", name, once, oncebytes);
+    if (again != once || againbytes != oncebytes) {
+        printf(", but %lu metatables, %lu bytes built %d times\n", again, againbytes, repeats);
+        return 0;
+    }
+    printf("\n");
+    return 1;
+}
+
+int main()
+{
+    int ok = 1;
+    ok &= run("4 fields", 4, 1, REPEATS);
+    ok &= run("16 fields", 16, 1, REPEATS);
+    ok &= run("64 fields", 64, 1, REPEATS);
+    ok &= run("branch x8", 16, BRANCHES, REPEATS);
+    return !ok;
+}
@@ -0,0 +1,92 @@
+/*
+** Constant folding check.
+** Runs every operator on every pair of a few constants twice: written
+** out, which the compiler folds where it can, and through variables,
+** which it never does. The two have to agree, including on operands
+** that aren't numbers, which must be left to the instruction. Negation
+** with ! has to be the opposite of what an if sees, for every value.
+** Usage: bench_fold
+*/
+#include <math.h>
+#include <stdio.h>
+
+#include "../bullet_train.h"
+
+static const char* operands[] = { "nil", "true", "false", "0", "1", "2.5", "-3" };
+static const char* comparisons[] = { "==", "!=", "<", "<=", ">", ">=" };
+static const char* arithmetic[] = { "+", "-", "*", "/" };
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+/* Runs [src], which yields at most once, returning if it did and what */
+static int run(bt_Context* bt, const char* src, BT_NUMBER* out)
+{
+    bt_Function* fn = bt_compile(bt, src);
+    if (fn == NULL) {
+        return -1;
+    }
+    bt_Thread* gen = bt_newgenerator(bt, fn);
+    int yielded = bt_next(bt, gen, out);
+    bt_freegenerator(bt, gen);
+    return yielded;
+}
+
+/* Checks [folded] and [unfolded] yield the same, printing [what] if not */
+static int same(bt_Context* bt, const char* folded, const char* unfolded, const char* what)
+{
+    BT_NUMBER a = 0, b = 0;
+    int ya = run(bt, folded, &a), yb = run(bt, unfolded, &b);
+    if (ya != yb || (ya == 1 && a != b && !(isnan(a) && isnan(b)))) {
+        printf("%s: folded %s %g, unfolded %s %g\n", what,
+            ya == 1 ? "yields" : "fails", (double)a, yb == 1 ? "yields" : "fails", (double)b);
+        return 0;
+    }
+    return 1;
+}
+
+int main()
+{
+    bt_Context* bt = bt_newcontext();
+    char folded[256], unfolded[256], what[64];
+    int checks = 0, failed = 0;
+
+    for (int l = 0; l != COUNT(operands); ++l) {
+        for (int r = 0; r != COUNT(operands); ++r) {
+            const char* lhs = operands[l];
+            const char* rhs = operands[r];
+            for (int o = 0; o != COUNT(comparisons); ++o) {
+                const char* op = comparisons[o];
+                snprintf(folded, sizeof(folded), "if %s %s %s { yield 1 }\nyield 2\n", lhs, op, rhs);
+                snprintf(unfolded, sizeof(unfolded), "a = %s\nb = %s\nif a %s b { yield 1 }\nyield 2\n", lhs, rhs, op);
+                snprintf(what, sizeof(what), "%s %s %s", lhs, op, rhs);
+                failed += !same(bt, folded, unfolded, what);
+                ++checks;
+            }
+            for (int o = 0; o != COUNT(arithmetic); ++o) {
+                const char* op = arithmetic[o];
+                snprintf(folded, sizeof(folded), "yield %s %s %s\n", lhs, op, rhs);
+                snprintf(unfolded, sizeof(unfolded), "a = %s\nb = %s\nyield a %s b\n", lhs, rhs, op);
+                snprintf(what, sizeof(what), "%s %s %s", lhs, op, rhs);
+                failed += !same(bt, folded, unfolded, what);
+                ++checks;
+            }
+        }
+        snprintf(folded, sizeof(folded), "yield -%s\n", operands[l]);
+        snprintf(unfolded, sizeof(unfolded), "a = %s\nyield -a\n", operands[l]);
+        snprintf(what, sizeof(what), "-%s", operands[l]);
+        failed += !same(bt, folded, unfolded, what);
+        ++checks;
+
+        snprintf(folded, sizeof(folded), "if %s { yield 2 }\nyield 1\n", operands[l]);
+        snprintf(unfolded, sizeof(unfolded), "if !%s { yield 1 }\nyield 2\n", operands[l]);
+        snprintf(what, sizeof(what), "!%s", operands[l]);
+        failed += !same(bt, folded, unfolded, what);
+        snprintf(unfolded, sizeof(unfolded), "a = %s\nb = !a\nif b { yield 1 }\nyield 2\n", operands[l]);
+        failed += !same(bt, folded, unfolded, what);
+        checks += 2;
+    }
+
+    bt_freecontext(bt);
+    printf("folding: %d checks, %d failed\n", checks, failed);
+    return failed != 0;
+}
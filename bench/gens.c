@@ -0,0 +1,93 @@
+/*
+** Generator benchmark.
+** Times values pulled out of generators, by a script resuming one and by
+** the host through bt_next, and checks with bt_callstats that nothing is
+** allocated between values once the generator is running.
+** Usage: bench_gens [values]
+*/
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bullet_train.h"
+
+#define RUNS 5
+
+/* A script pulling every value out of a counting generator */
+static const char* pull =
+    "func count(n) {\n"
+    "    i = 0\n"
+    "    while i < n {\n"
+    "        yield i\n"
+    "        i = i + 1\n"
+    "    }\n"
+    "}\n"
+    "g = count(%d)\n"
+    "acc = 0\n"
+    "v = g()\n"
+    "while v != nil {\n"
+    "    acc = acc + v\n"
+    "    v = g()\n"
+    "}\n";
+
+/* The same generator, pulled from by the host */
+static const char* host =
+    "i = 0\n"
+    "while i < %d {\n"
+    "    yield i\n"
+    "    i = i + 1\n"
+    "}\n";
+
+int main(int argc, char** argv)
+{
+    int values = argc > 1 ? atoi(argv[1]) : 1000000;
+    char src[1024];
+    unsigned long calls, allocs, warmcalls, warmallocs;
+
+    bt_Context* bt = bt_newcontext();
+    snprintf(src, sizeof(src), pull, values);
+    bt_Function* fn = bt_compile(bt, src);
+    bt_call(bt, fn); // The first run sets up the threads
+    bt_callstats(bt, &warmcalls, &warmallocs);
+    double best = 1e30;
+    for (int i = 0; i != RUNS; ++i) {
+        double start = now();
+        bt_call(bt, fn);
+        double t = now() - start;
+        if (t < best) {
+            best = t;
+        }
+    }
+    bt_callstats(bt, &calls, &allocs);
+    printf("script: %d values, %.2f ms, %.2f ns/value, %lu allocations in %d runs\n",
+        values, best * 1e3, best * 1e9 / values, allocs - warmallocs, RUNS);
+
+    snprintf(src, sizeof(src), host, values);
+    fn = bt_compile(bt, src);
+    best = 1e30;
+    for (int i = 0; i != RUNS; ++i) {
+        bt_Thread* gen = bt_newgenerator(bt, fn);
+        BT_NUMBER v, acc = 0;
+        int count = 0;
+        double start = now();
+        while (bt_next(bt, gen, &v)) {
+            acc += v;
+            ++count;
+        }
+        double t = now() - start;
+        bt_freegenerator(bt, gen);
+        if (count != values) {
+            printf("host: expected %d values, got %d\n", values, count);
+            return 1;
+        }
+        if (t < best) {
+            best = t;
+        }
+    }
+    bt_callstats(bt, &warmcalls, &warmallocs);
+    printf("host: %d values, %.2f ms, %.2f ns/value, %lu allocations in %d runs\n",
+        values, best * 1e3, best * 1e9 / values, warmallocs - allocs, RUNS);
+    bt_freecontext(bt);
+    return 0;
+}
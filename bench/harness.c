@@ -0,0 +1,375 @@
+/*
+** Benchmark harness.
+** Runs every .bt script in a corpus directory in its own process and
+** prints one tab separated row per script:
+**     script ns_per_op dispatches_per_sec compile_mb_per_sec peak_rss_kb status
+** Each script yields how many operations it did, which ns_per_op divides
+** its best run by. Compile speed is timed on the script's own source, and
+** a generated multi-megabyte "large" source is added too, which is run as
+** well so programs too big for short jumps are caught.
+** Rows are compared with a baseline in the same format, and the status says
+** if a number got worse by more than the tolerance. Regressions are only
+** reported, since timings are noisy, unless -s is given or BENCH_STRICT
+** is set to something other than 0, which makes them exit with code 1.
+** Scripts that fail to compile or run always exit with code 2.
+** Dispatches are only counted if the library is built with
+** BT_COUNT_DISPATCHES, which the Makefile does for this harness.
+** Usage: bench_harness [-j] [-s] [-w] [-t tolerance] corpus [baseline]
+**     -j  runs the scripts with the JIT
+**     -s  fails on regressions
+**     -w  writes the results to the baseline instead of comparing
+**     -t  the tolerance, 0.15 by default
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include "bench.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../bullet_train.h"
+
+#define RUNS 5
+#define MAX_SCRIPTS 256
+#define MIN_COMPILE_TIME 0.05 // Seconds, small sources are compiled over and over until it takes this long
+#define LARGE_SIZE (4 * 1024 * 1024)
+#define TIMEOUT 120 // Seconds a script gets before it's taken to be stuck
+
+typedef struct Result {
+    char name[64];
+    double ns_per_op;
+    double dispatches_per_sec;
+    double compile_mb_per_sec;
+    long peak_rss_kb;
+} Result;
+
+static char* readfile(const char* path, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* src = malloc(length + 1);
+    *size = fread(src, 1, length, file);
+    src[*size] = '\0';
+    fclose(file);
+    return src;
+}
+
+/* Same shape of script as bench/compile.c, in memory, yielding the loop iterations it runs */
+static char* generate(size_t size)
+{
+    char* src = malloc(size + 1024);
+    size_t written = sprintf(src, "total = 0\n");
+    long ops = 0;
+    for (int i = 0; written < size; ++i) {
+        int k = i % 50;
+        written += sprintf(src + written,
+            "p%d = {}\n"
+            "p%d.xpos = %d\n"
+            "p%d.ypos = p%d.xpos + %d\n"
+            "counter = 0\n"
+            "while counter < %d {\n"
+            "    counter = counter + 1\n"
+            "    if p%d.ypos > counter {\n"
+            "        p%d.ypos = p%d.ypos - 1.5\n"
+            "    } else {\n"
+            "        total = total * 2\n"
+            "    }\n"
+            "}\n",
+            k, k, i, k, k, k, k + 3, k, k, k);
+        ops += k + 3;
+    }
+    sprintf(src + written, "yield %ld\n", ops);
+    return src;
+}
+
+/* Best of a few batches, each compiling [src] enough times to be timed */
+static double compilespeed(const char* src, size_t size)
+{
+    int count = 1;
+    double best = 1e30;
+    for (int run = 0; run != RUNS; ++run) {
+        bt_Context* bt = bt_newcontext();
+        double start = now();
+        for (int i = 0; i != count; ++i) {
+            bt_compile(bt, src);
+        }
+        double t = now() - start;
+        bt_freecontext(bt);
+        if (t < MIN_COMPILE_TIME && count < (1 << 20)) {
+            count *= 2; // Too quick to count, start over
+            --run;
+            continue;
+        }
+        if (t / count < best) {
+            best = t / count;
+        }
+    }
+    return size / (1024.0 * 1024.0) / best;
+}
+
+static long peakrss()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Best time of a few runs, and the operations the script yields */
+static int runscript(Result* r, const char* src, int jit)
+{
+    bt_Context* bt = bt_newcontext();
+    bt_jit(bt, jit);
+    bt_Function* fn = bt_compile(bt, src);
+    if (fn == NULL) {
+        return 0;
+    }
+    double best = 1e30;
+    unsigned long dispatches = 0;
+    BT_NUMBER ops = 0;
+    for (int i = 0; i != RUNS; ++i) {
+        unsigned long before, after;
+        bt_Thread* gen = bt_newgenerator(bt, fn);
+        bt_dispatchstats(bt, &before);
+        double start = now();
+        int yielded = bt_next(bt, gen, &ops);
+        double t = now() - start;
+        bt_dispatchstats(bt, &after);
+        bt_freegenerator(bt, gen);
+        if (!yielded || ops <= 0) {
+            return 0;
+        }
+        if (t < best) {
+            best = t;
+            dispatches = after - before;
+        }
+    }
+    bt_freecontext(bt);
+    r->ns_per_op = best * 1e9 / ops;
+    r->dispatches_per_sec = dispatches / best;
+    return 1;
+}
+
+/* Measures one script, in the child process */
+static int measure(Result* r, const char* src, size_t size, int jit)
+{
+    if (!runscript(r, src, jit)) {
+        return 0;
+    }
+    r->peak_rss_kb = peakrss(); // Before the compile batches, which keep everything they compile
+    r->compile_mb_per_sec = compilespeed(src, size);
+    return 1;
+}
+
+/*
+** Measures [src] in a fresh process, so every script starts from the same
+** heap and gets its own peak RSS. The child passes the result back in a pipe.
+*/
+static int bench(Result* r, const char* name, const char* src, size_t size, int jit)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        alarm(TIMEOUT);
+        Result child;
+        int ok = measure(&child, src, size, jit);
+        if (ok) {
+            ok = write(fds[1], &child, sizeof(child)) == sizeof(child);
+        }
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    int status = 0;
+    int ok = pid > 0 && read(fds[0], r, sizeof(*r)) == sizeof(*r);
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, &status, 0);
+    }
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compare(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+/* Reads the rows of a baseline, returning how many or -1 if it can't be opened */
+static int readbaseline(const char* path, Result* rows, int max)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char line[512];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), file)) {
+        Result* r = &rows[count];
+        if (sscanf(line, "%63s %lf %lf %lf %ld", r->name, &r->ns_per_op,
+                &r->dispatches_per_sec, &r->compile_mb_per_sec, &r->peak_rss_kb) == 5) {
+            ++count; // The header doesn't scan
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+/* Higher is worse for time and memory, lower for throughput. Zero means not measured */
+static int worse(double value, double base, int higher, double tolerance)
+{
+    if (value == 0 || base == 0) {
+        return 0;
+    }
+    return higher ? value > base * (1 + tolerance) : value < base * (1 - tolerance);
+}
+
+/* Compares [r] with its row in the baseline, printing what regressed to stderr */
+static const char* status(const Result* r, const Result* base, int count, double tolerance)
+{
+    for (int i = 0; i != count; ++i) {
+        if (strcmp(base[i].name, r->name) != 0) {
+            continue;
+        }
+        int regressed = 0;
+        if (worse(r->ns_per_op, base[i].ns_per_op, 1, tolerance)) {
+            fprintf(stderr, "%s: ns_per_op %.2f, was %.2f\n", r->name, r->ns_per_op, base[i].ns_per_op);
+            regressed = 1;
+        }
+        if (worse(r->dispatches_per_sec, base[i].dispatches_per_sec, 0, tolerance)) {
+            fprintf(stderr, "%s: dispatches_per_sec %.0f, was %.0f\n", r->name, r->dispatches_per_sec, base[i].dispatches_per_sec);
+            regressed = 1;
+        }
+        if (worse(r->compile_mb_per_sec, base[i].compile_mb_per_sec, 0, tolerance)) {
+            fprintf(stderr, "%s: compile_mb_per_sec %.2f, was %.2f\n", r->name, r->compile_mb_per_sec, base[i].compile_mb_per_sec);
+            regressed = 1;
+        }
+        if (worse(r->peak_rss_kb, base[i].peak_rss_kb, 1, tolerance)) {
+            fprintf(stderr, "%s: peak_rss_kb %ld, was %ld\n", r->name, r->peak_rss_kb, base[i].peak_rss_kb);
+            regressed = 1;
+        }
+        return regressed ? "regressed" : "ok";
+    }
+    return "new";
+}
+
+int main(int argc, char** argv)
+{
+    const char* env = getenv("BENCH_STRICT");
+    int jit = 0, save = 0, strict = env != NULL && *env != '\0' && strcmp(env, "0") != 0;
+    double tolerance = 0.15;
+    int opt;
+    while ((opt = getopt(argc, argv, "jswt:")) != -1) {
+        switch (opt)
+        {
+            case 'j': jit = 1; break;
+            case 's': strict = 1; break;
+            case 'w': save = 1; break;
+            case 't': tolerance = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-j] [-s] [-w] [-t tolerance] corpus [baseline]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-j] [-s] [-w] [-t tolerance] corpus [baseline]\n", argv[0]);
+        return 2;
+    }
+    const char* corpus = argv[optind];
+    const char* baseline = optind + 1 < argc ? argv[optind + 1] : NULL;
+
+    if (jit) {
+        bt_Context* bt = bt_newcontext();
+        jit = bt_jit(bt, 1);
+        bt_freecontext(bt);
+        if (!jit) {
+            fprintf(stderr, "the JIT isn't built on this platform, interpreting\n");
+        }
+    }
+
+    // Scripts in name order, so rows line up from one run to the next
+    DIR* dir = opendir(corpus);
+    if (dir == NULL) {
+        fprintf(stderr, "can't open %s\n", corpus);
+        return 2;
+    }
+    char* names[MAX_SCRIPTS];
+    int scripts = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL && scripts < MAX_SCRIPTS) {
+        size_t length = strlen(entry->d_name);
+        if (length > 3 && strcmp(entry->d_name + length - 3, ".bt") == 0) {
+            names[scripts++] = strdup(entry->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, scripts, sizeof(char*), compare);
+
+    Result results[MAX_SCRIPTS + 1];
+    int count = 0, failed = 0;
+    for (int i = 0; i != scripts; ++i) {
+        char path[1024], name[64];
+        size_t size;
+        snprintf(path, sizeof(path), "%s/%s", corpus, names[i]);
+        snprintf(name, sizeof(name), "%.*s", (int)strlen(names[i]) - 3, names[i]);
+        char* src = readfile(path, &size);
+        if (src == NULL || !bench(&results[count], name, src, size, jit)) {
+            fprintf(stderr, "%s: failed, it has to compile and yield how many operations it did\n", name);
+            failed = 1;
+        } else {
+            ++count;
+        }
+        free(src);
+        free(names[i]);
+    }
+    char* large = generate(LARGE_SIZE);
+    if (bench(&results[count], "large", large, strlen(large), jit)) {
+        ++count;
+    } else {
+        fprintf(stderr, "large: failed to compile or run\n");
+        failed = 1;
+    }
+    free(large);
+
+    Result base[MAX_SCRIPTS + 1];
+    int bases = baseline && !save ? readbaseline(baseline, base, MAX_SCRIPTS + 1) : 0;
+    if (bases < 0) {
+        fprintf(stderr, "no baseline in %s, nothing to compare with\n", baseline);
+        bases = 0;
+    }
+
+    FILE* out = stdout;
+    if (save && baseline) {
+        out = fopen(baseline, "w");
+        if (out == NULL) {
+            fprintf(stderr, "can't write %s\n", baseline);
+            return 2;
+        }
+    }
+    int regressed = 0;
+    fprintf(out, "script\tns_per_op\tdispatches_per_sec\tcompile_mb_per_sec\tpeak_rss_kb\tstatus\n");
+    for (int i = 0; i != count; ++i) {
+        const Result* r = &results[i];
+        const char* s = save ? "baseline" : status(r, base, bases, tolerance);
+        regressed |= strcmp(s, "regressed") == 0;
+        fprintf(out, "%s\t%.2f\t%.0f\t%.2f\t%ld\t%s\n", r->name, r->ns_per_op,
+            r->dispatches_per_sec, r->compile_mb_per_sec, r->peak_rss_kb, s);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failed ? 2 : strict && regressed;
+}
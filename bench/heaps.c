@@ -0,0 +1,42 @@
+/*
+** Worker heap check.
+** Runs tasks that keep making arrays and structs too big for a slab size
+** class on several workers, so their blocks get grown, swept and freed by
+** workers other than the one that made them, then collects and frees
+** everything from the host. Meant to run under a sanitizer, which
+** catches a block that's freed through the wrong heap.
+** Usage: bench_heaps [workers] [tasks] [iterations per task]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bullet_train.h"
+
+#define BUDGET 1000
+#define FIELDS 24
+
+int main(int argc, char** argv)
+{
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    int tasks = argc > 2 ? atoi(argv[2]) : 64;
+    int iterations = argc > 3 ? atoi(argv[3]) : 2000;
+
+    // An array of 200 numbers, appended to, and a struct with FIELDS fields
+    char src[2048];
+    int at = snprintf(src, sizeof(src), "i = 0\nwhile i < %d {\n    a = array(200)\n    a[200] = i\n    s = {}\n", iterations);
+    for (int f = 0; f != FIELDS; ++f) {
+        at += snprintf(src + at, sizeof(src) - at, "    s.f%d = i\n", f);
+    }
+    snprintf(src + at, sizeof(src) - at, "    i = i + 1\n}\n");
+
+    bt_Context* bt = bt_newcontext();
+    bt_Function* fn = bt_compile(bt, src);
+    for (int i = 0; i != tasks; ++i) {
+        bt_spawn(bt, fn);
+    }
+    int used = bt_run(bt, workers, BUDGET);
+    bt_gccollect(bt);
+    bt_freecontext(bt);
+    printf("heaps: %d tasks on %d workers (%d ran)\n", tasks, workers, used);
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+** JIT benchmark.
+** Times the same scripts in thread_execute and in native code from bt_jit,
+** and checks both come up with the same result. Each script yields its
+** result, so the host reads it back through bt_next.
+** Usage: bench_jit [iterations]
+*/
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../bullet_train.h"
+
+#define RUNS 5
+
+/* Arithmetic and a branch in a loop */
+static const char* arith =
+    "i = 0\n"
+    "s = 0\n"
+    "while i < %d {\n"
+    "    s = s + i * 2\n"
+    "    if s > 1000 {\n"
+    "        s = s - 1000\n"
+    "    }\n"
+    "    i = i + 1\n"
+    "}\n"
+    "yield s\n";
+
+/* Struct fields read and written through the inline caches */
+static const char* fields =
+    "p = {}\n"
+    "p.x = 0\n"
+    "p.y = 1\n"
+    "i = 0\n"
+    "while i < %d {\n"
+    "    p.x = p.x + p.y\n"
+    "    p.y = p.y * 0.5 + 1\n"
+    "    i = i + 1\n"
+    "}\n"
+    "yield p.x\n";
+
+/* Comparisons and boolean logic */
+static const char* logic =
+    "i = 0\n"
+    "n = 0\n"
+    "while i < %d {\n"
+    "    a = i < 500\n"
+    "    b = i >= 250\n"
+    "    if a == b && !(i == 300) {\n"
+    "        n = n + 1\n"
+    "    }\n"
+    "    i = i + 1\n"
+    "}\n"
+    "yield n\n";
+
+/* Calls, which native code hands back to the interpreter */
+static const char* calls =
+    "func add(a, b) {\n"
+    "    ret a + b\n"
+    "}\n"
+    "i = 0\n"
+    "s = 0\n"
+    "while i < %d {\n"
+    "    s = add(s, i)\n"
+    "    i = i + 1\n"
+    "}\n"
+    "yield s\n";
+
+/* Best time of a few runs, and the value the script yields */
+static double run(const char* src, int jit, BT_NUMBER* result)
+{
+    bt_Context* bt = bt_newcontext();
+    bt_jit(bt, jit);
+    bt_Function* fn = bt_compile(bt, src);
+    double best = 1e30;
+    for (int i = 0; i != RUNS; ++i) {
+        bt_Thread* gen = bt_newgenerator(bt, fn);
+        double start = now();
+        bt_next(bt, gen, result);
+        double t = now() - start;
+        bt_freegenerator(bt, gen);
+        if (t < best) {
+            best = t;
+        }
+    }
+    bt_freecontext(bt);
+    return best;
+}
+
+static int bench(const char* name, const char* script, int iterations)
+{
+    char src[1024];
+    BT_NUMBER interpreted, native;
+    snprintf(src, sizeof(src), script, iterations);
+    double ti = run(src, 0, &interpreted);
+    double tj = run(src, 1, &native);
+    printf("%s: interpreter %.2f ns/iteration, jit %.2f ns/iteration, %.2fx\n",
+        name, ti * 1e9 / iterations, tj * 1e9 / iterations, ti / tj);
+    if (interpreted != native) {
+        printf("%s: interpreter got %g, jit got %g\n", name, (double)interpreted, (double)native);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 10000000;
+
+    bt_Context* bt = bt_newcontext();
+    int available = bt_jit(bt, 1);
+    bt_freecontext(bt);
+    if (!available) {
+        printf("the JIT isn't built on this platform\n");
+        return 0;
+    }
+
+    int failed = 0;
+    failed |= bench("arith", arith, iterations);
+    failed |= bench("fields", fields, iterations);
+    failed |= bench("logic", logic, iterations);
+    failed |= bench("calls", calls, iterations);
+    return failed;
+}
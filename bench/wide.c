@@ -0,0 +1,104 @@
+/*
+** Operand width check.
+** Generates scripts with more constants, keys or locals than the 8 bit
+** instruction args can index. Constants past the first 256 have to be
+** loaded into registers and still give the right results, in every
+** operand position and with and without the JIT. Functions with too many
+** keys or registers have to fail to compile instead of wrapping.
+** Usage: bench_wide
+*/
+#include <stdio.h>
+
+#include "../bullet_train.h"
+
+#define FILLER 300
+
+/* Appends [s] to the script being built in [src] */
+static void append(char* src, int* at, int size, const char* s)
+{
+    *at += snprintf(src + *at, size - *at, "%s", s);
+}
+
+/* Runs [src], which yields at most once, returning if it did and what */
+static int run(bt_Context* bt, const char* src, BT_NUMBER* out)
+{
+    bt_Function* fn = bt_compile(bt, src);
+    if (fn == NULL) {
+        return -1;
+    }
+    bt_Thread* gen = bt_newgenerator(bt, fn);
+    int yielded = bt_next(bt, gen, out);
+    bt_freegenerator(bt, gen);
+    return yielded;
+}
+
+/* Expressions using a constant past the first 256 in each kind of operand, and what they come to */
+static const struct {
+    const char* expr;
+    BT_NUMBER expected;
+} cases[] = {
+    { "900.5 - y", 899.5 },
+    { "y - 900.5", -899.5 },
+    { "900.5 - z[2]", 897.5 },
+    { "900.5 * (y + 1)", 1801 },
+    { "900.5 - -y", 901.5 },
+    { "901.5 - y * 2 - 902.5", -3 },
+    { "z[0] + 903.5", 904.5 },
+    { "-904.5", -904.5 },
+    { "f(905.5)", 904.5 },
+    { "s.a", 906.5 },
+};
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+int main()
+{
+    static char src[65536];
+    char line[128];
+    int checks = 0, failed = 0;
+
+    for (int jit = 0; jit != 2; ++jit) {
+        bt_Context* bt = bt_newcontext();
+        bt_jit(bt, jit);
+        for (int c = 0; c != COUNT(cases); ++c) {
+            int at = 0;
+            append(src, &at, sizeof(src), "func f(a) {\n    ret a - 1\n}\ny = 1\nz = [1, 2, 3]\nx = 0\n");
+            for (int i = 0; i != FILLER; ++i) {
+                snprintf(line, sizeof(line), "x = %d.25\n", i);
+                append(src, &at, sizeof(src), line);
+            }
+            snprintf(line, sizeof(line), "s = {}\ns.a = 906.5\nyield %s\n", cases[c].expr);
+            append(src, &at, sizeof(src), line);
+            BT_NUMBER n = 0;
+            int yielded = run(bt, src, &n);
+            if (yielded != 1 || n != cases[c].expected) {
+                printf("%s%s: %s %g, expected %g\n", cases[c].expr, jit ? " (jit)" : "",
+                    yielded == 1 ? "yields" : "fails", (double)n, (double)cases[c].expected);
+                ++failed;
+            }
+            ++checks;
+        }
+        bt_freecontext(bt);
+    }
+
+    // Keys and registers have nowhere to go, so these can't compile
+    bt_Context* bt = bt_newcontext();
+    for (int kind = 0; kind != 2; ++kind) {
+        int at = 0;
+        append(src, &at, sizeof(src), "s = {}\n");
+        for (int i = 0; i != FILLER; ++i) {
+            snprintf(line, sizeof(line), kind == 0 ? "s.k%d = %d\n" : "v%d = %d\n", i, i);
+            append(src, &at, sizeof(src), line);
+        }
+        append(src, &at, sizeof(src), kind == 0 ? "yield s.k0\n" : "yield v0\n");
+        if (bt_compile(bt, src) != NULL) {
+            printf("%d %s: compiled\n", FILLER, kind == 0 ? "keys" : "locals");
+            ++failed;
+        }
+        ++checks;
+    }
+    bt_freecontext(bt);
+
+    printf("operand width: %d checks, %d failed\n", checks, failed);
+    return failed != 0;
+}
@@ -10,11 +10,17 @@
 ** ============================================================
 */
 
+#if defined(_WIN32)
 #ifdef BT_BUILD_DLL
 #define BT_API __declspec(dllexport)
 #else
 #define BT_API __declspec(dllimport)
 #endif
+#elif defined(__GNUC__)
+#define BT_API __attribute__((visibility("default")))
+#else
+#define BT_API
+#endif
 
 #ifdef BT_USE_DOUBLE
 #define BT_NUMBER double
@@ -22,6 +28,56 @@
 #define BT_NUMBER float
 #endif
 
+/*
+** Dispatch the interpreter with computed gotos (labels as values)
+** on compilers that support them.
+** Define BT_NO_COMPUTED_GOTO to fall back to a portable switch.
+*/
+#if defined(__GNUC__) && !defined(BT_NO_COMPUTED_GOTO)
+#define BT_COMPUTED_GOTO
+#endif
+
+/*
+** Build the baseline JIT on x86-64 Linux.
+** It still has to be turned on per context with bt_jit.
+** Define BT_NO_JIT to leave it out. Profiling builds leave it out too,
+** since only the interpreter is profiled.
+*/
+#if defined(__x86_64__) && defined(__linux__) && !defined(BT_NO_JIT) && !defined(BT_PROFILE)
+#define BT_JIT
+#endif
+
+/*
+** Define BT_PROFILE to count how many times every instruction runs and
+** the cycles spent in it, per opcode and per instruction of each function.
+** See the bt_profile functions. Builds without it don't pay anything.
+*/
+
+/*
+** Define BT_SAMPLE for the sampling profiler, see bt_sample_start.
+** It works from SIGPROF on POSIX systems, and costs the interpreter a
+** store on every instruction so a sample can find where a script is.
+*/
+
+/*
+** Pack every value into 8 bytes with NaN boxing.
+** The type tags live in unused NaN bit patterns, so this needs doubles.
+*/
+#if defined(BT_NAN_BOXING) && !defined(BT_USE_DOUBLE)
+#error "BT_NAN_BOXING requires BT_USE_DOUBLE"
+#endif
+
+/*
+** Vectors, the vec2, vec3 and vec4 values, are in by default.
+** Without NaN boxing they're kept in the value itself, which takes every
+** bt_Value from 16 bytes to 24. NaN boxed values stay 8 bytes, since
+** vectors are boxed there instead.
+** Define BT_NO_VECTORS to leave them out.
+*/
+#ifndef BT_NO_VECTORS
+#define BT_VECTORS
+#endif
+
 #ifndef BT_TIMER
 #define BT_TIMER int
 #endif
@@ -45,12 +101,42 @@ typedef void (*bt_Destructor)(void*);
 BT_API bt_Context* bt_newcontext();
 BT_API void bt_freecontext(bt_Context* bt);
 BT_API void* bt_gcalloc(bt_Context* bt, size_t size, bt_Destructor d);
+BT_API void bt_gcconfig(bt_Context* bt, size_t threshold, int stepsize);
+BT_API void bt_gccollect(bt_Context* bt);
 
 BT_API bt_Struct* bt_newstruct(bt_Context* bt);
+BT_API void bt_shapestats(bt_Context* bt, unsigned long* metatables, unsigned long* bytes);
 
 BT_API bt_Function* bt_compile(bt_Context* bt, const char* src);
 BT_API bt_Function* bt_fcompile(bt_Context* bt, const char* path);
+BT_API void bt_peephole(bt_Context* bt, int enabled);
+BT_API int bt_jit(bt_Context* bt, int enabled);
+BT_API void bt_optstats(bt_Context* bt, unsigned long* emitted, unsigned long* removed);
+
+BT_API int bt_dump(bt_Function* fn, const char* path);
+BT_API bt_Function* bt_load(bt_Context* bt, const char* path);
 
 BT_API void bt_call(bt_Context* bt, bt_Function* fn);
+BT_API void bt_spawn(bt_Context* bt, bt_Function* fn);
+BT_API int bt_step(bt_Context* bt, BT_TIMER budget);
+BT_API int bt_run(bt_Context* bt, int workers, BT_TIMER budget);
+
+BT_API bt_Thread* bt_newgenerator(bt_Context* bt, bt_Function* fn);
+BT_API int bt_next(bt_Context* bt, bt_Thread* gen, BT_NUMBER* out);
+BT_API void bt_freegenerator(bt_Context* bt, bt_Thread* gen);
+
+BT_API void bt_cachestats(bt_Function* fn, unsigned long* hits, unsigned long* misses);
+BT_API void bt_callstats(bt_Context* bt, unsigned long* calls, unsigned long* allocs);
+BT_API void bt_dispatchstats(bt_Context* bt, unsigned long* dispatches);
+
+BT_API const char* bt_profile_opcode(bt_Context* bt, int op, unsigned long* count, unsigned long long* cycles);
+BT_API int bt_profile_instruction(bt_Function* fn, int at, unsigned long* count, unsigned long long* cycles);
+BT_API void bt_profile_reset(bt_Context* bt, bt_Function* fn);
+BT_API int bt_profile_dump(bt_Function* fn, const char* path);
+
+BT_API int bt_getline(bt_Function* fn, int at);
+BT_API int bt_sample_start(int frequency);
+BT_API void bt_sample_stop();
+BT_API int bt_sample_dump(const char* path);
 
 #endif
\ No newline at end of file
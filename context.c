@@ -1,11 +1,25 @@
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 
 #include "context.h"
 #include "thread.h"
 #include "struct.h"
+#include "slab.h"
+#include "sync.h"
+#include "runtime.h"
 
-#define BT_REG_SIZE 127
+/* Start size for the key registry, must be a power of two */
+#define KEY_BUF 64
+
+/* Size of each chunk of key memory */
+#define KEY_CHUNK 4096
+
+/* Default bytes allocated before a collection cycle starts */
+#define GC_THRESHOLD (256 * 1024)
+
+/* Default number of objects marked or swept per incremental step */
+#define GC_STEPSIZE 64
 
 /*
 ** Information about a GC memory allocation .
@@ -13,16 +27,101 @@
 */
 typedef struct GCBlock {
     struct GCBlock* next;
-    bt_Destructor destructor;
-    int refs;
+    bt_Destructor destructor; // Host destructor, for blocks from bt_gcalloc
+    const GCType* type; // Callbacks for internal objects, NULL for blocks from bt_gcalloc
+    int color;
+    int size; // Size of the allocation, header included
 } GCBlock;
 
+/*
+** Object colors.
+** There are two whites so objects created while sweeping
+** can be told apart from the unreachable ones being swept.
+*/
+enum {
+    GC_WHITE0,
+    GC_WHITE1,
+    GC_GRAY,
+    GC_BLACK
+};
+
+/* Collector phases */
+enum {
+    GC_PAUSE, // Waiting for enough allocations to start a cycle
+    GC_MARK, // Incrementally traversing gray objects
+    GC_SWEEP // Incrementally freeing unreachable objects
+};
+
+/*
+** Key registry entry.
+** The hash is kept next to the pointer so probing
+** rarely has to touch the keys themselves.
+*/
+typedef struct KeySlot {
+    unsigned long hash;
+    Key* key;
+} KeySlot;
+
+/*
+** Allocation state of one worker of the multi-core runtime.
+** Workers allocate from their own heap without locking. The objects they
+** create are handed over to the context's list whenever the world stops
+** for a collection, and when the runtime finishes.
+*/
+struct Heap {
+    SlabAllocator slab;
+    GCBlock* gclist; // Objects allocated since the last handover, newest first
+    GCBlock* gclast; // Oldest object in gclist, so the list can be spliced on
+    size_t debt; // Bytes allocated since the last handover
+    size_t threshold; // Debt at which the worker asks for a collection
+    int destructors;
+};
+
+/* Heap of the worker running on this OS thread, NULL outside the runtime */
+static THREAD_LOCAL Heap* localheap;
+
+/* Block of memory keys are carved out of, keys are never freed individually */
+typedef struct KeyChunk {
+    struct KeyChunk* next;
+    char data[];
+} KeyChunk;
+
 struct bt_Context {
-    Key* key_regist[BT_REG_SIZE];
+    SlabAllocator heap;
+    KeySlot* keys; // Open addressing table of every key
+    int keycount;
+    int keymask; // Table size - 1
+    KeyChunk* keychunks;
+    char* keytop; // Free space in the current chunk
+    char* keyend;
     Metatable* root_meta;
+    CompileInfo compile;
+    CallInfo calls;
+#ifdef BT_PROFILE
+    ProfileInfo profile;
+#endif
     GCBlock* gclist;
+    int destructors; // Number of live blocks with a host destructor or an external type
     bt_Thread* inactive;
     bt_Thread* active;
+    bt_Thread* tasks; // Queue of tasks waiting for bt_step, in the order they run
+    bt_Thread** tasktail; // Where the next task is linked in
+    int taskcount;
+    Mutex lock; // Guards the thread lists and the task queue
+    Mutex shapelock; // Guards metatable transitions and inline cache updates
+    Runtime* runtime; // Multi-core runtime, while it's running
+    Heap** heaps; // One per runtime worker, created as needed
+    int heapcount;
+    atomic_int gcwanted; // Set by workers that want the world stopped for a collection
+    // Garbage collector state
+    GCBlock** gray; // Stack of marked objects that still need to be traversed
+    int graycount, graysize;
+    GCBlock** sweep; // Sweep position in gclist
+    size_t gcdebt; // Bytes allocated since the last cycle started
+    size_t gcthreshold;
+    int gcstepsize;
+    int gcphase;
+    int white; // Current white, given to new objects
 };
 
 /*
@@ -32,13 +131,49 @@ struct bt_Context {
 BT_API bt_Context* bt_newcontext()
 {
     bt_Context* bt = malloc(sizeof(bt_Context));
-    for (int i = 0; i != BT_REG_SIZE; ++i) {
-        bt->key_regist[i] = NULL;
+    slab_init(&bt->heap);
+    bt->keys = calloc(KEY_BUF, sizeof(KeySlot));
+    bt->keycount = 0;
+    bt->keymask = KEY_BUF - 1;
+    bt->keychunks = NULL;
+    bt->keytop = NULL;
+    bt->keyend = NULL;
+    bt->root_meta = newrootmeta(bt);
+    bt->compile.peephole = 1;
+    bt->compile.jit = 0;
+    bt->compile.emitted = 0;
+    bt->compile.removed = 0;
+    atomic_init(&bt->calls.calls, 0);
+    atomic_init(&bt->calls.allocs, 0);
+    atomic_init(&bt->calls.dispatches, 0);
+#ifdef BT_PROFILE
+    for (int i = 0; i != 64; ++i) {
+        atomic_init(&bt->profile.counts[i], 0);
+        atomic_init(&bt->profile.cycles[i], 0);
     }
-    bt->root_meta = newrootmeta();
+#endif
     bt->inactive = NULL;
     bt->active = NULL;
+    bt->tasks = NULL;
+    bt->tasktail = &bt->tasks;
+    bt->taskcount = 0;
+    mutex_init(&bt->lock);
+    mutex_init(&bt->shapelock);
+    bt->runtime = NULL;
+    bt->heaps = NULL;
+    bt->heapcount = 0;
+    atomic_init(&bt->gcwanted, 0);
     bt->gclist = NULL;
+    bt->destructors = 0;
+    bt->gray = malloc(sizeof(GCBlock*) * GC_STEPSIZE);
+    bt->graycount = 0;
+    bt->graysize = GC_STEPSIZE;
+    bt->sweep = NULL;
+    bt->gcdebt = 0;
+    bt->gcthreshold = GC_THRESHOLD;
+    bt->gcstepsize = GC_STEPSIZE;
+    bt->gcphase = GC_PAUSE;
+    bt->white = GC_WHITE0;
     return bt;
 }
 
@@ -48,65 +183,152 @@ BT_API bt_Context* bt_newcontext()
 */
 BT_API void bt_freecontext(bt_Context* bt)
 {
-    GCBlock* gc = bt->gclist;
-    while (gc != NULL) {
-        if (gc->destructor != NULL) {
+    ctx_mergeheaps(bt);
+    // Only host destructors and external types need to run, everything else goes with the slabs
+    for (GCBlock* gc = bt->gclist; bt->destructors != 0 && gc != NULL; gc = gc->next) {
+        if (gc->type != NULL && gc->type->external) {
+            gc->type->finalize(bt, gc + 1);
+            --bt->destructors;
+        } else if (gc->destructor != NULL) {
             gc->destructor(gc + 1);
+            --bt->destructors;
+        }
+    }
+    bt_Thread* lists[] = { bt->active, bt->inactive, bt->tasks };
+    for (int i = 0; i != 3; ++i) {
+        bt_Thread* t = lists[i];
+        while (t != NULL) {
+            bt_Thread* temp = t->next;
+            thread_free(t);
+            t = temp;
         }
-        GCBlock* temp = gc->next;
-        free(gc);
-        gc = temp;
     }
+    free(bt->gray);
+    free(bt->keys);
+    KeyChunk* chunk = bt->keychunks;
+    while (chunk != NULL) {
+        KeyChunk* temp = chunk->next;
+        free(chunk);
+        chunk = temp;
+    }
+    for (int i = 0; i != bt->heapcount; ++i) {
+        slab_destroy(&bt->heaps[i]->slab);
+        free(bt->heaps[i]);
+    }
+    free(bt->heaps);
+    mutex_destroy(&bt->lock);
+    mutex_destroy(&bt->shapelock);
+    slab_destroy(&bt->heap);
     free(bt);
 }
 
 /*
 ** djb2 hash function
 */
-static unsigned long keyhash(const char* str)
+static unsigned long keyhash(const char* str, int length)
 {
     unsigned long hash = 5381;
-    int c;
-    while ((c = *str++))
-        hash = ((hash << 5) + hash) + c;
+    for (int i = 0; i != length; ++i)
+        hash = ((hash << 5) + hash) + (unsigned char)str[i];
     return hash;
 }
 
+/* Allocates memory for a key from the current chunk, starting a new one if it's full */
+static Key* newkey(bt_Context* bt, int length)
+{
+    size_t size = (sizeof(Key) + length + 1 + 7) & ~(size_t)7; // Keep keys 8 byte aligned
+    if ((size_t)(bt->keyend - bt->keytop) < size) {
+        size_t chunksize = size > KEY_CHUNK ? size : KEY_CHUNK;
+        KeyChunk* chunk = malloc(sizeof(KeyChunk) + chunksize);
+        chunk->next = bt->keychunks;
+        bt->keychunks = chunk;
+        bt->keytop = chunk->data;
+        bt->keyend = chunk->data + chunksize;
+    }
+    Key* key = (Key*)bt->keytop;
+    bt->keytop += size;
+    return key;
+}
+
+/* Doubles the size of the key registry */
+static void growkeys(bt_Context* bt)
+{
+    int size = (bt->keymask + 1) * 2;
+    KeySlot* keys = calloc(size, sizeof(KeySlot));
+    for (int i = 0; i <= bt->keymask; ++i) {
+        if (bt->keys[i].key != NULL) {
+            int j = bt->keys[i].hash & (size - 1);
+            while (keys[j].key != NULL) {
+                j = (j + 1) & (size - 1);
+            }
+            keys[j] = bt->keys[i];
+        }
+    }
+    free(bt->keys);
+    bt->keys = keys;
+    bt->keymask = size - 1;
+}
+
 /*
 ** Retrieves a key from the key registry.
 ** Creates a new entry if it doesn't exist.
+** [name] doesn't need to be null terminated, so the parser can
+** pass identifiers straight out of the source.
 */
-Key* ctx_getkey(bt_Context* bt, const char* name)
+Key* ctx_getkey(bt_Context* bt, const char* name, int length)
 {
-    unsigned long hash = keyhash(name);
-    Key** loc = &bt->key_regist[hash % BT_REG_SIZE];
-    Key* key = *loc;
-    while (key != NULL) {
-        if (strcmp(key->text, name) == 0) {
+    unsigned long hash = keyhash(name, length);
+    int i = hash & bt->keymask;
+    while (bt->keys[i].key != NULL) {
+        Key* key = bt->keys[i].key;
+        if (bt->keys[i].hash == hash && key->length == length && memcmp(key->text, name, length) == 0) {
             return key;
         }
-        key = key->next;
+        i = (i + 1) & bt->keymask;
     }
     // Key not found, make a new one
-    key = malloc(sizeof(Key) + strlen(name) + 1);
-    strcpy(key->text, name);
+    Key* key = newkey(bt, length);
+    memcpy(key->text, name, length);
+    key->text[length] = '\0';
     key->hash = hash;
-    key->next = *loc;
-    *loc = key;
+    key->length = length;
+    bt->keys[i].hash = hash;
+    bt->keys[i].key = key;
+    // Keep the table at most half full
+    if (++bt->keycount * 2 > bt->keymask + 1) {
+        growkeys(bt);
+    }
     return key;
 }
 
+/* Gets the context's compiler settings */
+CompileInfo* ctx_compileinfo(bt_Context* bt)
+{
+    return &bt->compile;
+}
+
+/* Gets the context's call statistics */
+CallInfo* ctx_callinfo(bt_Context* bt)
+{
+    return &bt->calls;
+}
+
+#ifdef BT_PROFILE
+/* Gets the context's opcode profile */
+ProfileInfo* ctx_profileinfo(bt_Context* bt)
+{
+    return &bt->profile;
+}
+#endif
+
 /*
 ** ============================================================
 ** Thread management
 ** ============================================================
 */
 
-/*
-** Gets an inactive thread.
-** If no inactive threads are available, creates a new one.
-*/
-bt_Thread* ctx_getthread(bt_Context* bt)
+/* Takes a thread off the inactive list, or creates one if there are none */
+static bt_Thread* reusethread(bt_Context* bt)
 {
     bt_Thread* result;
     if (bt->inactive) {
@@ -118,32 +340,566 @@ bt_Thread* ctx_getthread(bt_Context* bt)
     return result;
 }
 
+/*
+** Puts a thread on the inactive list.
+** Its stack is cleared so old values don't stay reachable.
+*/
+static void retirethread(bt_Context* bt, bt_Thread* t)
+{
+    for (int i = 0; i != t->stacksize; ++i) {
+        t->stack[i] = nil();
+    }
+    t->next = bt->inactive;
+    bt->inactive = t;
+}
+
+/*
+** Gets an inactive thread and moves it to the active list.
+** If no inactive threads are available, creates a new one.
+*/
+bt_Thread* ctx_getthread(bt_Context* bt)
+{
+    mutex_lock(&bt->lock);
+    bt_Thread* result = reusethread(bt);
+    result->next = bt->active;
+    bt->active = result;
+    mutex_unlock(&bt->lock);
+    return result;
+}
+
+/*
+** Gets an inactive thread that isn't put on any list, for a generator.
+** The generator marks it, and hands it back with ctx_retirethread.
+*/
+bt_Thread* ctx_takethread(bt_Context* bt)
+{
+    mutex_lock(&bt->lock);
+    bt_Thread* result = reusethread(bt);
+    mutex_unlock(&bt->lock);
+    return result;
+}
+
+/* Moves a thread from the active list back to the inactive list */
+void ctx_releasethread(bt_Context* bt, bt_Thread* t)
+{
+    mutex_lock(&bt->lock);
+    bt_Thread** loc = &bt->active;
+    while (*loc != t) {
+        loc = &(*loc)->next;
+    }
+    *loc = t->next;
+    retirethread(bt, t);
+    mutex_unlock(&bt->lock);
+}
+
+/* Moves a finished task or generator thread, which isn't on any list, to the inactive list */
+void ctx_retirethread(bt_Context* bt, bt_Thread* t)
+{
+    mutex_lock(&bt->lock);
+    retirethread(bt, t);
+    mutex_unlock(&bt->lock);
+}
+
+/*
+** ============================================================
+** Task scheduling
+** ============================================================
+*/
+
+/*
+** Starts [fn] as a task on a thread of its own.
+** Tasks don't run until the host calls bt_step.
+*/
+BT_API void bt_spawn(bt_Context* bt, bt_Function* fn)
+{
+    mutex_lock(&bt->lock);
+    bt_Thread* t = reusethread(bt);
+    if (!thread_start(t, fn)) {
+        retirethread(bt, t);
+    } else {
+        t->next = NULL;
+        *bt->tasktail = t;
+        bt->tasktail = &t->next;
+        ++bt->taskcount;
+    }
+    mutex_unlock(&bt->lock);
+}
+
+/*
+** Empties the task queue, returning its tasks as a list.
+** Used by the runtime to spread them over its workers.
+*/
+bt_Thread* ctx_taketasks(bt_Context* bt, int* count)
+{
+    mutex_lock(&bt->lock);
+    bt_Thread* tasks = bt->tasks;
+    *count = bt->taskcount;
+    bt->tasks = NULL;
+    bt->tasktail = &bt->tasks;
+    bt->taskcount = 0;
+    mutex_unlock(&bt->lock);
+    return tasks;
+}
+
+/*
+** Gives every waiting task one time slice, in the order they were spawned.
+** A slice ends when the task finishes or has used up [budget] instructions.
+** The budget is only checked when a task loops or calls, so a slice can run
+** over by part of a loop or function. Finished tasks leave the queue, the rest run again next step.
+** Returns the number of tasks still waiting.
+*/
+BT_API int bt_step(bt_Context* bt, BT_TIMER budget)
+{
+    // Tasks stay linked in while they run, so the collector can find them
+    bt_Thread** loc = &bt->tasks;
+    while (*loc != NULL) {
+        bt_Thread* t = *loc;
+        t->timer = budget;
+        int result = thread_execute(bt, t);
+        if (result == THREAD_YIELD || result == THREAD_VALUE) {
+            loc = &t->next;
+            continue;
+        }
+        *loc = t->next;
+        if (bt->tasktail == &t->next) {
+            bt->tasktail = loc;
+        }
+        --bt->taskcount;
+        thread_finish(t);
+        ctx_retirethread(bt, t);
+    }
+    return bt->taskcount;
+}
+
+/*
+** ============================================================
+** Multi-core support
+** ============================================================
+*/
+
+/* Takes the lock guarding metatable transitions and inline cache updates */
+void ctx_lockshapes(bt_Context* bt)
+{
+    mutex_lock(&bt->shapelock);
+}
+
+void ctx_unlockshapes(bt_Context* bt)
+{
+    mutex_unlock(&bt->shapelock);
+}
+
+/* Gets the runtime running this context's tasks, NULL if there isn't one */
+Runtime* ctx_runtime(bt_Context* bt)
+{
+    return bt->runtime;
+}
+
+/* Sets or clears the runtime running this context's tasks */
+void ctx_setruntime(bt_Context* bt, Runtime* rt)
+{
+    bt->runtime = rt;
+}
+
+/* Gets the heap of worker [idx], creating it if it doesn't exist yet */
+Heap* ctx_getheap(bt_Context* bt, int idx)
+{
+    if (idx >= bt->heapcount) {
+        bt->heaps = realloc(bt->heaps, sizeof(Heap*) * (idx + 1));
+        for (int i = bt->heapcount; i <= idx; ++i) {
+            Heap* h = malloc(sizeof(Heap));
+            slab_init(&h->slab);
+            h->gclist = NULL;
+            h->gclast = NULL;
+            h->debt = 0;
+            h->threshold = 0;
+            h->destructors = 0;
+            bt->heaps[i] = h;
+        }
+        bt->heapcount = idx + 1;
+    }
+    return bt->heaps[idx];
+}
+
+/*
+** Makes the calling OS thread allocate from heap [h], or from the
+** context itself if [h] is NULL. [share] is the number of heaps
+** splitting the collection threshold.
+*/
+void ctx_useheap(bt_Context* bt, Heap* h, int share)
+{
+    if (h != NULL) {
+        h->threshold = bt->gcthreshold / share;
+    }
+    localheap = h;
+}
+
+/* Checks if a worker has asked for a collection */
+int ctx_gcwanted(bt_Context* bt)
+{
+    return atomic_load_explicit(&bt->gcwanted, memory_order_relaxed);
+}
+
+/*
+** Hands every worker heap's new objects over to the context.
+** Only safe while no worker is running.
+*/
+void ctx_mergeheaps(bt_Context* bt)
+{
+    for (int i = 0; i != bt->heapcount; ++i) {
+        Heap* h = bt->heaps[i];
+        if (h->gclist != NULL) {
+            h->gclast->next = bt->gclist;
+            bt->gclist = h->gclist;
+            h->gclist = NULL;
+            h->gclast = NULL;
+        }
+        bt->gcdebt += h->debt;
+        h->debt = 0;
+        bt->destructors += h->destructors;
+        h->destructors = 0;
+    }
+    atomic_store_explicit(&bt->gcwanted, 0, memory_order_relaxed);
+}
+
+/*
+** ============================================================
+** Memory
+** ============================================================
+*/
+
+/*
+** Allocates memory from the slabs of the calling worker, or the context's
+** own outside the runtime. Blocks can be freed from any heap: small ones
+** join the free lists of the heap freeing them, since slabs are only
+** returned to the system along with the context, and large ones come off
+** the list of the heap that made them.
+*/
+void* ctx_alloc(bt_Context* bt, size_t size)
+{
+    Heap* h = localheap;
+    if (h != NULL) {
+        h->debt += size;
+        return slab_alloc(&h->slab, size);
+    }
+    bt->gcdebt += size;
+    return slab_alloc(&bt->heap, size);
+}
+
+/* Frees memory from ctx_alloc. [size] must be the size it was allocated with. */
+void ctx_free(bt_Context* bt, void* p, size_t size)
+{
+    Heap* h = localheap;
+    slab_free(h != NULL ? &h->slab : &bt->heap, p, size);
+}
+
+/* Resizes memory from ctx_alloc */
+void* ctx_realloc(bt_Context* bt, void* p, size_t old, size_t size)
+{
+    Heap* h = localheap;
+    if (h != NULL) {
+        if (size > old) {
+            h->debt += size - old;
+        }
+        return slab_realloc(&h->slab, p, old, size);
+    }
+    if (size > old) {
+        bt->gcdebt += size - old;
+    }
+    return slab_realloc(&bt->heap, p, old, size);
+}
+
 /*
 ** ============================================================
 ** Garbage collection
 ** ============================================================
 */
 
-/* Allocates garbage collected memory */
-BT_API void* bt_gcalloc(bt_Context* bt, size_t size, bt_Destructor d)
+/* Allocates a garbage collected internal object */
+void* ctx_gcalloc(bt_Context* bt, size_t size, const GCType* type)
 {
-    GCBlock* gc = malloc(sizeof(GCBlock) + size);
-    gc->refs = 0;
-    gc->destructor = d;
-    gc->next = bt->gclist;
-    bt->gclist = gc;
+    GCBlock* gc = ctx_alloc(bt, sizeof(GCBlock) + size);
+    gc->color = bt->white;
+    gc->destructor = NULL;
+    gc->type = type;
+    gc->size = sizeof(GCBlock) + size;
+    Heap* h = localheap;
+    if (type != NULL && type->external) {
+        if (h != NULL) {
+            ++h->destructors;
+        } else {
+            ++bt->destructors;
+        }
+    }
+    if (h != NULL) {
+        if (h->gclist == NULL) {
+            h->gclast = gc;
+        }
+        gc->next = h->gclist;
+        h->gclist = gc;
+    } else {
+        gc->next = bt->gclist;
+        bt->gclist = gc;
+    }
     return gc + 1;
 }
 
-/* Start vector size for structs */
-#define STRUCT_BUF 4
+/*
+** Allocates garbage collected memory.
+** Safe to call from the runtime's workers.
+*/
+BT_API void* bt_gcalloc(bt_Context* bt, size_t size, bt_Destructor d)
+{
+    void* mem = ctx_gcalloc(bt, size, NULL);
+    if (d != NULL) {
+        ((GCBlock*)mem - 1)->destructor = d;
+        if (localheap != NULL) {
+            ++localheap->destructors;
+        } else {
+            ++bt->destructors;
+        }
+    }
+    return mem;
+}
+
+#define iswhite(gc) ((gc)->color <= GC_WHITE1)
+
+/* Colors an object gray, queueing it to be traversed */
+static void pushgray(bt_Context* bt, GCBlock* gc)
+{
+    gc->color = GC_GRAY;
+    if (bt->graycount == bt->graysize) {
+        bt->graysize *= 2;
+        bt->gray = realloc(bt->gray, sizeof(GCBlock*) * bt->graysize);
+    }
+    bt->gray[bt->graycount++] = gc;
+}
+
+/* Marks a white object, queueing it to be traversed if it references anything */
+static void markobject(bt_Context* bt, GCBlock* gc)
+{
+    if (!iswhite(gc)) {
+        return;
+    }
+    if (gc->type == NULL || gc->type->traverse == NULL) {
+        gc->color = GC_BLACK; // Nothing to traverse
+        return;
+    }
+    pushgray(bt, gc);
+}
+
+/* Marks the object referenced by a value, if there is one */
+void ctx_markvalue(bt_Context* bt, bt_Value* vl)
+{
+    switch (vtype(*vl))
+    {
+        case VT_STRUCT: markobject(bt, (GCBlock*)tostruct(*vl) - 1); break;
+        case VT_GEN:    markobject(bt, (GCBlock*)togenerator(*vl) - 1); break;
+        case VT_ARRAY:  markobject(bt, (GCBlock*)toarray(*vl) - 1); break;
+#ifdef BT_NAN_BOXING
+        case VT_VEC:    markobject(bt, (GCBlock*)tovector(*vl) - 1); break;
+#endif
+    }
+}
+
+/*
+** Write barrier, called when [vl] is stored into GC object [obj].
+** If a traversed object gains a reference to an untraversed one while
+** marking, the new reference is marked so it can't be missed.
+*/
+void ctx_barrier(bt_Context* bt, void* obj, bt_Value* vl)
+{
+    if (bt->gcphase == GC_MARK && ((GCBlock*)obj - 1)->color == GC_BLACK) {
+        ctx_markvalue(bt, vl);
+    }
+}
+
+/*
+** Backward write barrier, for objects that change too often to check every store.
+** A traversed object that changes while marking is queued to be traversed again.
+*/
+void ctx_barrierback(bt_Context* bt, void* obj)
+{
+    GCBlock* gc = (GCBlock*)obj - 1;
+    if (bt->gcphase == GC_MARK && gc->color == GC_BLACK) {
+        pushgray(bt, gc);
+    }
+}
+
+/* Marks the roots: every thread's stack and call frames, tasks included */
+static void markroots(bt_Context* bt)
+{
+    for (bt_Thread* t = bt->active; t != NULL; t = t->next) {
+        thread_mark(bt, t);
+    }
+    for (bt_Thread* t = bt->inactive; t != NULL; t = t->next) {
+        thread_mark(bt, t);
+    }
+    for (bt_Thread* t = bt->tasks; t != NULL; t = t->next) {
+        thread_mark(bt, t);
+    }
+    if (bt->runtime != NULL) {
+        runtime_mark(bt, bt->runtime);
+    }
+}
+
+/* Traverses up to [work] gray objects. Returns the work left over. */
+static int propagate(bt_Context* bt, int work)
+{
+    while (work > 0 && bt->graycount != 0) {
+        GCBlock* gc = bt->gray[--bt->graycount];
+        gc->color = GC_BLACK;
+        gc->type->traverse(bt, gc + 1);
+        --work;
+    }
+    return work;
+}
+
+/*
+** Finishes marking in one go.
+** Registers aren't covered by the write barrier,
+** so the roots are marked again before deciding what's garbage.
+*/
+static void atomic(bt_Context* bt)
+{
+    markroots(bt);
+    while (bt->graycount != 0) {
+        propagate(bt, bt->graycount);
+    }
+    // Unmarked objects now have the old white, survivors get the new one while sweeping
+    bt->white ^= 1;
+    bt->sweep = &bt->gclist;
+    bt->gcphase = GC_SWEEP;
+}
+
+/* Frees up to [work] unreachable objects. Returns the work left over. */
+static int sweep(bt_Context* bt, int work)
+{
+    int dead = bt->white ^ 1;
+    GCBlock** loc = bt->sweep;
+    while (work > 0 && *loc != NULL) {
+        GCBlock* gc = *loc;
+        if (gc->color == dead) {
+            *loc = gc->next;
+            if (gc->type != NULL && gc->type->finalize != NULL) {
+                gc->type->finalize(bt, gc + 1);
+                if (gc->type->external) {
+                    --bt->destructors;
+                }
+            } else if (gc->destructor != NULL) {
+                gc->destructor(gc + 1);
+                --bt->destructors;
+            }
+            ctx_free(bt, gc, gc->size);
+        } else {
+            gc->color = bt->white;
+            loc = &gc->next;
+        }
+        --work;
+    }
+    bt->sweep = loc;
+    if (*loc == NULL) {
+        bt->gcphase = GC_PAUSE;
+    }
+    return work;
+}
+
+/* Performs up to [work] units of collection work */
+static void gcstep(bt_Context* bt, int work)
+{
+    switch (bt->gcphase)
+    {
+        case GC_PAUSE:
+            bt->gcdebt = 0;
+            markroots(bt);
+            bt->gcphase = GC_MARK;
+            // Fall through
+        case GC_MARK:
+            work = propagate(bt, work);
+            if (bt->graycount != 0) {
+                break;
+            }
+            atomic(bt);
+            // Fall through
+        case GC_SWEEP:
+            sweep(bt, work);
+            break;
+    }
+}
+
+/*
+** Collector safe point, called by the interpreter after allocating.
+** Starts a cycle once enough memory has been allocated,
+** then does one bounded step per call until the cycle is done.
+*/
+void ctx_gccheck(bt_Context* bt)
+{
+    Heap* h = localheap;
+    if (h != NULL) {
+        // Workers can't collect on their own, they ask for the world to be stopped
+        if (h->debt >= h->threshold) {
+            atomic_store_explicit(&bt->gcwanted, 1, memory_order_relaxed);
+        }
+        return;
+    }
+    if (bt->gcphase != GC_PAUSE || bt->gcdebt >= bt->gcthreshold) {
+        gcstep(bt, bt->gcstepsize);
+    }
+}
+
+/* Finishes the collection cycle in progress, if there is one */
+void ctx_gcfinish(bt_Context* bt)
+{
+    while (bt->gcphase != GC_PAUSE) {
+        gcstep(bt, bt->gcstepsize);
+    }
+}
+
+/*
+** Configures the collector.
+** A cycle starts after [threshold] bytes have been allocated,
+** and each step marks or sweeps at most [stepsize] objects.
+*/
+BT_API void bt_gcconfig(bt_Context* bt, size_t threshold, int stepsize)
+{
+    bt->gcthreshold = threshold;
+    bt->gcstepsize = stepsize > 0 ? stepsize : 1;
+}
+
+/*
+** Runs a full collection, finishing the current cycle first if there is one.
+** Objects only referenced from the host aren't roots and will be freed!
+** The runtime also calls this once it has stopped all its workers.
+*/
+BT_API void bt_gccollect(bt_Context* bt)
+{
+    ctx_mergeheaps(bt);
+    ctx_gcfinish(bt);
+    do {
+        gcstep(bt, bt->gcstepsize);
+    } while (bt->gcphase != GC_PAUSE);
+}
+
+static const GCType structtype = { traversestruct, finalizestruct, 0 };
 
 /* Creates a new bt_Struct */
 BT_API bt_Struct* bt_newstruct(bt_Context* bt)
 {
-    bt_Struct* st = bt_gcalloc(bt, sizeof(bt_Struct), destroystruct);
-    st->data = malloc(sizeof(bt_Value) * STRUCT_BUF);
-    st->size = STRUCT_BUF;
+    bt_Struct* st = ctx_gcalloc(bt, sizeof(bt_Struct), &structtype);
+    st->data = NULL;
+    st->size = STRUCT_INLINE;
     st->meta = bt->root_meta;
     return st;
+}
+
+/*
+** Retrieves how many metatables the context's structs have made, and the
+** bytes those shapes take up, not counting the structs themselves.
+*/
+BT_API void bt_shapestats(bt_Context* bt, unsigned long* metatables, unsigned long* bytes)
+{
+    *metatables = 0;
+    *bytes = 0;
+    ctx_lockshapes(bt);
+    metastats(bt->root_meta, metatables, bytes);
+    ctx_unlockshapes(bt);
 }
\ No newline at end of file
@@ -1,9 +1,13 @@
 #ifndef _CONTEXT_H_
 #define _CONTEXT_H_
 
+#include <stdatomic.h>
+
 #include "bullet_train.h"
 
 typedef struct Key Key;
+typedef struct Heap Heap;
+typedef struct Runtime Runtime;
 
 /*
 ** Key used to access struct members.
@@ -12,12 +16,71 @@ typedef struct Key Key;
 */
 struct Key {
     unsigned long hash;
-    Key* next;
-    char text[];
+    int length;
+    char text[]; // Null terminated, for convenience
 };
 
-Key* ctx_getkey(bt_Context* bt, const char* name);
+/* Callbacks for a kind of internal garbage collected object */
+typedef struct GCType {
+    void (*traverse)(bt_Context* bt, void* obj); // Marks everything the object references
+    void (*finalize)(bt_Context* bt, void* obj); // Frees memory owned by the object
+    int external; // Owns memory outside the context's slabs, so it's finalized even when the context is freed
+} GCType;
+
+/* Compiler settings and statistics, kept per context */
+typedef struct CompileInfo {
+    int peephole; // Run the peephole optimizer on new functions
+    int jit; // Compile new functions to native code
+    unsigned long emitted; // Instructions emitted before optimization
+    unsigned long removed; // Instructions removed by the optimizer
+} CompileInfo;
+
+/* Call statistics, kept per context and added to by every worker */
+typedef struct CallInfo {
+    _Atomic unsigned long calls; // Calls made by scripts
+    _Atomic unsigned long allocs; // Frames and stack growth those calls had to allocate
+    _Atomic unsigned long dispatches; // Instructions dispatched, with BT_COUNT_DISPATCHES
+} CallInfo;
+
+#ifdef BT_PROFILE
+/* Time spent in each opcode, kept per context with BT_PROFILE and added to by every worker */
+typedef struct ProfileInfo {
+    _Atomic unsigned long counts[64]; // Times each opcode was dispatched
+    _Atomic unsigned long long cycles[64]; // Cycles spent running it
+} ProfileInfo;
+#endif
+
+Key* ctx_getkey(bt_Context* bt, const char* name, int length);
+CompileInfo* ctx_compileinfo(bt_Context* bt);
+CallInfo* ctx_callinfo(bt_Context* bt);
+#ifdef BT_PROFILE
+ProfileInfo* ctx_profileinfo(bt_Context* bt);
+#endif
 
 bt_Thread* ctx_getthread(bt_Context* bt);
+bt_Thread* ctx_takethread(bt_Context* bt);
+void ctx_releasethread(bt_Context* bt, bt_Thread* t);
+void ctx_retirethread(bt_Context* bt, bt_Thread* t);
+bt_Thread* ctx_taketasks(bt_Context* bt, int* count);
+
+void ctx_lockshapes(bt_Context* bt);
+void ctx_unlockshapes(bt_Context* bt);
+Runtime* ctx_runtime(bt_Context* bt);
+void ctx_setruntime(bt_Context* bt, Runtime* rt);
+Heap* ctx_getheap(bt_Context* bt, int idx);
+void ctx_useheap(bt_Context* bt, Heap* h, int share);
+int ctx_gcwanted(bt_Context* bt);
+void ctx_mergeheaps(bt_Context* bt);
+
+void* ctx_alloc(bt_Context* bt, size_t size);
+void ctx_free(bt_Context* bt, void* p, size_t size);
+void* ctx_realloc(bt_Context* bt, void* p, size_t old, size_t size);
+
+void* ctx_gcalloc(bt_Context* bt, size_t size, const GCType* type);
+void ctx_markvalue(bt_Context* bt, bt_Value* vl);
+void ctx_barrier(bt_Context* bt, void* obj, bt_Value* vl);
+void ctx_barrierback(bt_Context* bt, void* obj);
+void ctx_gccheck(bt_Context* bt);
+void ctx_gcfinish(bt_Context* bt);
 
 #endif
\ No newline at end of file
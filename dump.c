@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "bullet_train.h"
+#include "function.h"
+#include "context.h"
+#include "map.h"
+#include "jit.h"
+#include "profile.h"
+
+/*
+** Precompiled bytecode files.
+** A file holds the function that was dumped and every function its
+** closures refer to, however deeply, each once. Everything is stored in
+** native byte order, and each function starts on an 8 byte boundary:
+** - DumpHeader
+** - The program, exactly as it's laid out in memory so it can be used in place
+** - Constants, as DumpConst records
+** - Keys, as a 32 bit length followed by the text
+** - The function's name, if it has one
+** - The line table, as it's laid out in memory
+** The function that was dumped comes first. Closures refer to the others
+** by their position in the file, since functions can refer to each other
+** and to themselves. The header records the instruction size and byte
+** order, and files written by a build that disagrees with the loading one
+** are rejected.
+*/
+
+#define DUMP_MAGIC "\x1b" "BTC"
+#define DUMP_VERSION 6
+#define DUMP_CHECK 0x01020304 // Reads back differently with the wrong byte order
+
+typedef struct DumpHeader {
+    char magic[4];
+    uint16_t version;
+    uint8_t instsize; // sizeof(Instruction)
+    uint8_t unused;
+    uint32_t check;
+    uint32_t size; // Size of the function, up to the end of its line table
+    int32_t params, registers, type;
+    int32_t progcount, constcount, keycount;
+    int32_t namelength; // -1 if it has no name
+    int32_t linesize;
+} DumpHeader;
+
+/* Keeps the program that follows the header aligned */
+_Static_assert(sizeof(DumpHeader) % 8 == 0, "DumpHeader must keep the program aligned");
+
+typedef struct DumpConst {
+    int32_t type;
+    int32_t function; // Position of a closure's function in the file
+    double number; // Numbers are widened, booleans are 0 or 1
+} DumpConst;
+
+/* Functions start on 8 byte boundaries, to keep their programs aligned */
+#define align8(n) (((n) + 7) & ~(size_t)7)
+
+/* Every function going in a file, in the order they're written */
+typedef struct DumpList {
+    bt_Function** functions;
+    int count, size;
+} DumpList;
+
+/*
+** ============================================================
+** Dumping
+** ============================================================
+*/
+
+/* Finds a function's position in the list, -1 if it isn't there */
+static int dumpindex(DumpList* l, bt_Function* fn)
+{
+    for (int i = 0; i != l->count; ++i) {
+        if (l->functions[i] == fn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Adds a function to the list, then every function its closures refer to */
+static void dumpcollect(DumpList* l, bt_Function* fn)
+{
+    if (dumpindex(l, fn) != -1) {
+        return;
+    }
+    if (l->count == l->size) {
+        l->size = l->size == 0 ? 4 : l->size * 2;
+        l->functions = realloc(l->functions, sizeof(bt_Function*) * l->size);
+    }
+    l->functions[l->count++] = fn;
+    for (int i = 0; i != fn->constcount; ++i) {
+        if (vtype(fn->constants[i]) == VT_CLOSURE) {
+            dumpcollect(l, toclosure(fn->constants[i])->function);
+        }
+    }
+}
+
+/* Writes one function, returning the number of bytes written */
+static size_t dumpfunction(DumpList* l, bt_Function* fn, FILE* file)
+{
+    DumpHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DUMP_MAGIC, 4);
+    h.version = DUMP_VERSION;
+    h.instsize = sizeof(Instruction);
+    h.check = DUMP_CHECK;
+    h.params = fn->params;
+    h.registers = fn->registers;
+    h.type = fn->type;
+    h.progcount = fn->progcount;
+    h.constcount = fn->constcount;
+    h.keycount = fn->keycount;
+    h.namelength = fn->name != NULL ? fn->name->length : -1;
+    h.linesize = fn->linesize;
+    size_t size = sizeof(DumpHeader) + sizeof(Instruction) * fn->progcount + sizeof(DumpConst) * fn->constcount;
+    for (int i = 0; i != fn->keycount; ++i) {
+        size += sizeof(int32_t) + fn->keys[i]->length;
+    }
+    size += (fn->name != NULL ? fn->name->length : 0) + fn->linesize;
+    h.size = (uint32_t)size;
+
+    fwrite(&h, sizeof(h), 1, file);
+    for (int i = 0; i != fn->progcount; ++i) {
+        Instruction ins = unquicken(fn->program[i]);
+        fwrite(&ins, sizeof(ins), 1, file);
+    }
+    for (int i = 0; i != fn->constcount; ++i) {
+        DumpConst dc;
+        memset(&dc, 0, sizeof(dc));
+        bt_Value* vl = &fn->constants[i];
+        dc.type = vtype(*vl);
+        switch (dc.type) {
+            case VT_NUMBER: dc.number = tonumber(*vl); break;
+            case VT_BOOL: dc.number = toboolean(*vl); break;
+            case VT_CLOSURE: dc.function = dumpindex(l, toclosure(*vl)->function); break;
+        }
+        fwrite(&dc, sizeof(dc), 1, file);
+    }
+    for (int i = 0; i != fn->keycount; ++i) {
+        int32_t length = fn->keys[i]->length;
+        fwrite(&length, sizeof(length), 1, file);
+        fwrite(fn->keys[i]->text, 1, length, file);
+    }
+    if (fn->name != NULL) {
+        fwrite(fn->name->text, 1, fn->name->length, file);
+    }
+    fwrite(fn->lines, 1, fn->linesize, file);
+    return size;
+}
+
+/*
+** Writes a function to a bytecode file, along with the functions it refers to.
+** Returns 0 on success, or -1 if the file couldn't be written.
+*/
+BT_API int bt_dump(bt_Function* fn, const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    DumpList l = { NULL, 0, 0 };
+    dumpcollect(&l, fn);
+    size_t written = 0;
+    for (int i = 0; i != l.count; ++i) {
+        static const char padding[8];
+        fwrite(padding, 1, align8(written) - written, file);
+        written = align8(written) + dumpfunction(&l, l.functions[i], file);
+    }
+    free(l.functions);
+    int error = ferror(file);
+    return fclose(file) != 0 || error ? -1 : 0;
+}
+
+/*
+** ============================================================
+** Loading
+** ============================================================
+*/
+
+/* Checks that a header belongs to a function this build can load, in [size] bytes */
+static int checkheader(DumpHeader* h, size_t size)
+{
+    if (memcmp(h->magic, DUMP_MAGIC, 4) != 0 || h->version != DUMP_VERSION
+        || h->instsize != sizeof(Instruction) || h->check != DUMP_CHECK
+        || h->size > size || h->size < sizeof(DumpHeader)) {
+        return 0;
+    }
+    if (h->progcount <= 0 || h->constcount < 0 || h->keycount < 0 || h->registers < 0
+        || h->namelength < -1 || h->linesize < 0) {
+        return 0;
+    }
+    // Counts come from the file, so keep the arithmetic from overflowing
+    size_t body = h->size - sizeof(DumpHeader);
+    return (size_t)h->progcount <= body / sizeof(Instruction)
+        && (size_t)h->constcount <= (body - h->progcount * sizeof(Instruction)) / sizeof(DumpConst);
+}
+
+/* Frees a function that was loaded, leaving its closures for the caller */
+static void freeloaded(bt_Function* fn)
+{
+    profile_free(fn);
+    free(fn->caches);
+    free(fn->cacheidx);
+    free(fn->keys);
+    free(fn->constants);
+    free(fn);
+}
+
+/*
+** Loads the function at the start of the [size] bytes at [image].
+** Closures are left nil, they're linked up once every function is loaded.
+** Returns NULL if it's malformed.
+*/
+static bt_Function* loadfunction(bt_Context* bt, const char* image, size_t size, size_t* used)
+{
+    DumpHeader h;
+    if (size < sizeof(DumpHeader)) {
+        return NULL;
+    }
+    memcpy(&h, image, sizeof(h));
+    if (!checkheader(&h, size)) {
+        return NULL;
+    }
+    *used = h.size;
+
+    bt_Function* fn = malloc(sizeof(bt_Function));
+    fn->program = (Instruction*)(image + sizeof(DumpHeader));
+    fn->progcount = h.progcount;
+    fn->params = h.params;
+    fn->registers = h.registers;
+    fn->type = h.type;
+    fn->native = NULL;
+    fn->entries = NULL;
+    fn->cachehits = 0;
+    fn->cachemisses = 0;
+    profile_init(fn);
+
+    const char* cur = (const char*)(fn->program + h.progcount);
+    fn->constants = malloc(sizeof(bt_Value) * h.constcount);
+    fn->constcount = h.constcount;
+    for (int i = 0; i != h.constcount; ++i) {
+        DumpConst dc;
+        memcpy(&dc, cur, sizeof(dc));
+        cur += sizeof(dc);
+        switch (dc.type) {
+            case VT_NUMBER: fn->constants[i] = number((BT_NUMBER)dc.number); break;
+            case VT_BOOL: fn->constants[i] = boolean(dc.number != 0); break;
+            default: fn->constants[i] = nil(); break;
+        }
+    }
+
+    const char* end = image + h.size;
+    fn->keys = malloc(sizeof(Key*) * h.keycount);
+    fn->keycount = h.keycount;
+    fn->caches = NULL;
+    fn->cacheidx = NULL;
+    for (int i = 0; i != h.keycount; ++i) {
+        int32_t length;
+        if ((size_t)(end - cur) < sizeof(length)) {
+            freeloaded(fn);
+            return NULL;
+        }
+        memcpy(&length, cur, sizeof(length));
+        cur += sizeof(length);
+        if (length < 0 || length > end - cur) {
+            freeloaded(fn);
+            return NULL;
+        }
+        fn->keys[i] = ctx_getkey(bt, cur, length);
+        cur += length;
+    }
+
+    // The line table is used in place, like the program
+    int32_t namelength = h.namelength > 0 ? h.namelength : 0;
+    if (namelength > end - cur || h.linesize != end - cur - namelength) {
+        freeloaded(fn);
+        return NULL;
+    }
+    fn->name = h.namelength >= 0 ? ctx_getkey(bt, cur, namelength) : NULL;
+    fn->lines = (unsigned char*)cur + namelength;
+    fn->linesize = h.linesize;
+
+    initcaches(fn);
+    return fn;
+}
+
+/*
+** Points a loaded function's closure constants at the functions they refer to.
+** Each function gets one closure, shared by everything that refers to it.
+** Returns 0 if a closure refers to a function that isn't in the file.
+*/
+static int linkfunction(bt_Function* fn, DumpList* l, bt_Closure** closures)
+{
+    const char* consts = (const char*)(fn->program + fn->progcount);
+    for (int i = 0; i != fn->constcount; ++i) {
+        DumpConst dc;
+        memcpy(&dc, consts + sizeof(dc) * i, sizeof(dc));
+        if (dc.type != VT_CLOSURE) {
+            continue;
+        }
+        if (dc.function < 0 || dc.function >= l->count) {
+            return 0;
+        }
+        if (closures[dc.function] == NULL) {
+            closures[dc.function] = malloc(sizeof(bt_Closure));
+            closures[dc.function]->function = l->functions[dc.function];
+        }
+        fn->constants[i] = closure(closures[dc.function]);
+    }
+    return 1;
+}
+
+/*
+** Loads a function from a bytecode file written by bt_dump.
+** The file is mapped and its programs used in place; only the constants
+** are unpacked and the keys re-interned. The mapping lives as long as the
+** functions do. Returns NULL if the file is missing or malformed.
+** Instructions aren't verified, so only load files you trust.
+*/
+BT_API bt_Function* bt_load(bt_Context* bt, const char* path)
+{
+    size_t size;
+    char* image = map_open(path, &size);
+    if (image == NULL) {
+        return NULL;
+    }
+    DumpList l = { NULL, 0, 0 };
+    for (size_t at = 0; at < size; ) {
+        size_t used;
+        bt_Function* fn = loadfunction(bt, image + at, size - at, &used);
+        if (fn == NULL) {
+            goto Fail;
+        }
+        if (l.count == l.size) {
+            l.size = l.size == 0 ? 4 : l.size * 2;
+            l.functions = realloc(l.functions, sizeof(bt_Function*) * l.size);
+        }
+        l.functions[l.count++] = fn;
+        at = align8(at + used);
+    }
+    if (l.count == 0) {
+        goto Fail;
+    }
+
+    bt_Closure** closures = calloc(l.count, sizeof(bt_Closure*));
+    for (int i = 0; i != l.count; ++i) {
+        if (!linkfunction(l.functions[i], &l, closures)) {
+            for (int j = 0; j != l.count; ++j) {
+                free(closures[j]);
+            }
+            free(closures);
+            goto Fail;
+        }
+    }
+    free(closures);
+    if (ctx_compileinfo(bt)->jit) {
+        for (int i = 0; i != l.count; ++i) {
+            jit_compile(bt, l.functions[i]);
+        }
+    }
+    bt_Function* fn = l.functions[0];
+    free(l.functions);
+    return fn;
+
+Fail:
+    for (int i = 0; i != l.count; ++i) {
+        freeloaded(l.functions[i]);
+    }
+    free(l.functions);
+    map_close(image, size);
+    return NULL;
+}
\ No newline at end of file
@@ -1,9 +1,12 @@
 #ifndef _FUNCTION_H_
 #define _FUNCTION_H_
 
+#include <stdatomic.h>
+
 #include "bullet_train.h"
 #include "context.h"
 #include "value.h"
+#include "struct.h"
 
 /* VM instructions */
 enum {
@@ -17,15 +20,47 @@ enum {
     OP_SUB,
     OP_MUL,
     OP_DIV,
+    OP_ADDI,
+    OP_SUBI,
+    OP_MULI,
     OP_NEG,
     OP_NOT,
     OP_EQUAL,
     OP_LEQUAL,
     OP_LESS,
     OP_TEST,
+    OP_JEQUAL,
+    OP_JLEQUAL,
+    OP_JLESS,
+    OP_JTEST,
     OP_JUMP,
+    OP_CALL,
+    OP_TAILCALL,
+    OP_YIELD,
     OP_PRINT,
-    OP_RETURN
+    OP_RETURN,
+    OP_NEWARRAY,
+    OP_GETINDEX,
+    OP_SETINDEX,
+    OP_LEN,
+    OP_SUM,
+    OP_DOT,
+    OP_SCALE,
+    OP_ADDARRAY,
+    OP_VEC,
+
+    // Quickened instructions, never emitted by the parser
+    OP_ADDNN, OP_ADDNK,
+    OP_SUBNN, OP_SUBNK,
+    OP_MULNN, OP_MULNK,
+    OP_DIVNN, OP_DIVNK,
+    OP_ADDIN, OP_SUBIN, OP_MULIN,
+    OP_EQUALNN, OP_EQUALNK,
+    OP_LEQUALNN, OP_LEQUALNK,
+    OP_LESSNN, OP_LESSNK,
+    OP_JEQUALNN, OP_JEQUALNK,
+    OP_JLEQUALNN, OP_JLEQUALNK,
+    OP_JLESSNN, OP_JLESSNK
 };
 
 /*
@@ -40,14 +75,73 @@ enum {
 ** - 16 bits for arg BX
 ** | opcode |kb|kc|   arg A    |        arg BX         |
 ** Note that kb and kc are not used in every instruction.
+**
+** Some instructions are fused versions of common pairs:
+** - OP_ADDI, OP_SUBI and OP_MULI take arg C as a signed 8 bit immediate.
+** - OP_JEQUAL, OP_JLEQUAL, OP_JLESS and OP_JTEST are comparisons that are
+**   always followed by an OP_JUMP, and take that jump themselves.
+**
+** OP_CALL A B calls the closure in register A with the B arguments after it.
+** Those registers become the bottom of the callee's frame, so arguments
+** are never copied, and the result comes back in register A.
+** OP_TAILCALL does the same in place of the caller's frame. Generators are
+** called normally instead, so it's followed by an OP_RETURN of register A.
+** OP_RETURN returns arg C if arg A is set, and nil otherwise.
+** Calling a FT_GEN function makes a generator instead of running it, and
+** calling the generator runs it until OP_YIELD hands back arg C.
+**
+** OP_NEWARRAY A B C makes an array arg C long, its first B elements taken
+** from the registers after A and the rest 0. OP_GETINDEX A B C reads
+** element C of array B, nil if it's out of range, and OP_SETINDEX A B C
+** sets element B of the array in register A to C, appending it if B is the
+** length. OP_LEN, OP_SUM, OP_DOT, OP_SCALE and OP_ADDARRAY are the array
+** built-ins. OP_SCALE and OP_ADDARRAY change array B in place and put it
+** in register A.
+**
+** OP_VEC A B C makes a vector of the C numbers in the registers from B on.
+** Arithmetic works on vectors component by component, and OP_GETSTRUCT
+** and OP_SETSTRUCT on one take the key as a swizzle, like x or zyx.
+**
+** Arithmetic and comparisons are quickened as they run: once one sees
+** two numbers it rewrites its opcode to a variant for numbers only. NN
+** variants take both arguments from registers, NK ones take arg C from
+** the constants, and the I ones are the immediate instructions. A variant
+** that finds anything else puts the generic opcode back.
 */
 typedef unsigned long Instruction;
 
+/*
+** Largest arg BX: everything above arg A, so 16 bits where instructions
+** are 32 bits and 48 where they're 64. Jump targets and OP_LOAD's
+** constant index go in it, and the compiler rejects functions whose
+** don't fit.
+*/
+#define BX_MAX ((Instruction)-1 >> 16)
+
+/*
+** Instruction [i] with its generic opcode, if it was quickened.
+** Dumps are written with these, so files don't depend on what ran.
+*/
+static inline Instruction unquicken(Instruction i)
+{
+    static const unsigned char generic[] = {
+        OP_ADD, OP_ADD, OP_SUB, OP_SUB, OP_MUL, OP_MUL, OP_DIV, OP_DIV,
+        OP_ADDI, OP_SUBI, OP_MULI,
+        OP_EQUAL, OP_EQUAL, OP_LEQUAL, OP_LEQUAL, OP_LESS, OP_LESS,
+        OP_JEQUAL, OP_JEQUAL, OP_JLEQUAL, OP_JLEQUAL, OP_JLESS, OP_JLESS
+    };
+    int op = i & 0x3F;
+    if (op < OP_ADDNN) {
+        return i;
+    }
+    return (i & ~(Instruction)0x3F) | generic[op - OP_ADDNN];
+}
+
 /* Function types */
 typedef enum {
     FT_FUNC, // Normal function
     FT_TASK, // Function that kicks off into a new thread
-    FT_GEN   // A "traditional" coroutine
+    FT_GEN   // A "traditional" coroutine, any function that yields
 } FuncType;
 
 /*
@@ -57,11 +151,50 @@ typedef enum {
 */
 struct bt_Function {
     Instruction* program;
+    int progcount; // Number of instructions
     bt_Value* constants;
+    int constcount; // Number of constants
     Key** keys;
+    int keycount; // Number of keys
+    StructCache* caches; // Inline caches, one per struct access. NULL if there's none
+    int* cacheidx; // Index into [caches] of each instruction's cache, NULL along with it
+    _Atomic unsigned long cachehits, cachemisses; // Inline cache statistics, added to by every worker
     int params; // Number of parameters
     int registers; // Number of registers needed by this function
     FuncType type; // Type of function (func, task, or gen)
+    void* native; // Native code from the JIT, NULL if the function is only interpreted
+    unsigned int* entries; // Offset of each instruction in the native code
+    unsigned char* lines; // Line table, see bt_getline
+    int linesize; // Size of the line table in bytes
+    Key* name; // Name it was declared with, NULL for a whole script
+#ifdef BT_PROFILE
+    _Atomic unsigned long* counts; // Times each instruction was dispatched
+    _Atomic unsigned long long* cycles; // Cycles spent running it
+#endif
 };
 
+/*
+** Gives each OP_GETSTRUCT and OP_SETSTRUCT in [fn] an inline cache.
+** Sites are numbered in order, so only they get one, and [cacheidx]
+** maps an instruction to its cache. Runs once the program is final.
+*/
+static inline void initcaches(bt_Function* fn)
+{
+    int sites = 0;
+    fn->caches = NULL;
+    fn->cacheidx = NULL;
+    for (int i = 0; i != fn->progcount; ++i) {
+        int op = fn->program[i] & 0x3F;
+        if (op == OP_GETSTRUCT || op == OP_SETSTRUCT) {
+            if (fn->cacheidx == NULL) {
+                fn->cacheidx = malloc(sizeof(int) * fn->progcount);
+            }
+            fn->cacheidx[i] = sites++;
+        }
+    }
+    if (sites != 0) {
+        fn->caches = calloc(sites, sizeof(StructCache));
+    }
+}
+
 #endif
\ No newline at end of file
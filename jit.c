@@ -0,0 +1,920 @@
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "jit.h"
+#include "context.h"
+#include "struct.h"
+#include "array.h"
+#include "vector.h"
+#include "thread.h"
+
+/*
+** ============================================================
+** Baseline JIT for x86-64
+** ============================================================
+*/
+
+#ifdef BT_JIT
+
+#include <sys/mman.h>
+
+/*
+** Every instruction becomes a fixed template of native code. Registers are
+** read and written straight off the frame's base, and nothing is kept in
+** machine registers from one instruction to the next, so the interpreter
+** and native code can trade a frame at any instruction. Calls, returns and
+** yields change frames, so native code hands those back to the interpreter,
+** which goes back into native code once it's in a compiled function again.
+*/
+
+/* State of one run of native code, which gets a pointer to it */
+typedef struct JitFrame {
+    bt_Context* bt;
+    bt_Value* constants;
+    BT_TIMER budget;
+    unsigned long hits, misses; // Inline cache statistics, added to the function on the way out
+} JitFrame;
+
+/* Native code of a function, runs from [entry] and returns a JitExit pc */
+typedef int (*NativeCode)(bt_Value* reg, JitFrame* f, void* entry);
+
+/* Machine registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/* The frame's base, the JitFrame and the constants, callee saved so calls out to C keep them */
+#define BASE RBX
+#define FRAME R12
+#define CONSTS R13
+
+/* Condition codes */
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_G = 0xF, CC_ALWAYS = -1 };
+
+/* Scalar SSE instructions are ss for floats and sd for doubles */
+#ifdef BT_USE_DOUBLE
+#define SSE_SCALAR 0xF2
+#define SSE_COMPARE 0x66
+#else
+#define SSE_SCALAR 0xF3
+#define SSE_COMPARE 0
+#endif
+
+/* SSE opcodes, after 0x0F */
+enum { SSE_LOAD = 0x10, SSE_STORE = 0x11, SSE_CVTSI = 0x2A, SSE_UCOMI = 0x2E, SSE_ADD = 0x58, SSE_MUL = 0x59, SSE_SUB = 0x5C, SSE_DIV = 0x5E };
+
+#define VSIZE ((int)sizeof(bt_Value))
+
+// Shortcuts
+#define arga(i) ((i >> 8) & 0xFF)
+#define argb(i) ((i >> 16) & 0xFF)
+#define argbx(i) (i >> 16)
+#define argc(i) (i >> 24)
+#define argsc(i) ((signed char)argc(i))
+
+/* Branch waiting for its target's address */
+typedef struct Patch {
+    int at; // Offset of the rel32 to fill in
+    int target; // Instruction branched to
+} Patch;
+
+typedef struct Emitter {
+    unsigned char* code;
+    int size;
+    size_t cap;
+    Patch* patches;
+    int patchcount, patchsize;
+    int epilogue; // Offset of the code returning to the interpreter
+} Emitter;
+
+/* Memory operand, [base + disp] */
+typedef struct Operand {
+    int base, disp;
+} Operand;
+
+static void emit1(Emitter* e, int b)
+{
+    if ((size_t)e->size == e->cap) {
+        e->cap *= 2;
+        e->code = realloc(e->code, e->cap);
+    }
+    e->code[e->size++] = (unsigned char)b;
+}
+
+static void emit4(Emitter* e, uint32_t v)
+{
+    for (int i = 0; i != 4; ++i) {
+        emit1(e, (v >> (i * 8)) & 0xFF);
+    }
+}
+
+static void emit8(Emitter* e, uint64_t v)
+{
+    emit4(e, (uint32_t)v);
+    emit4(e, (uint32_t)(v >> 32));
+}
+
+/* REX prefix, left out when it would be empty */
+static void rex(Emitter* e, int w, int r, int b)
+{
+    int bits = (w << 3) | ((r >> 3) << 2) | (b >> 3);
+    if (bits != 0) {
+        emit1(e, 0x40 | bits);
+    }
+}
+
+/* ModRM for [base + disp32] */
+static void modrm(Emitter* e, int r, Operand m)
+{
+    emit1(e, 0x80 | ((r & 7) << 3) | (m.base & 7));
+    if ((m.base & 7) == RSP) {
+        emit1(e, 0x24); // R12 needs a SIB byte
+    }
+    emit4(e, (uint32_t)m.disp);
+}
+
+/* mov r, [m] */
+static void load(Emitter* e, int w, int r, Operand m)
+{
+    rex(e, w, r, m.base);
+    emit1(e, 0x8B);
+    modrm(e, r, m);
+}
+
+/* mov [m], r */
+static void store(Emitter* e, int w, Operand m, int r)
+{
+    rex(e, w, r, m.base);
+    emit1(e, 0x89);
+    modrm(e, r, m);
+}
+
+#ifndef BT_NAN_BOXING
+/* mov dword [m], imm */
+static void storeimm(Emitter* e, Operand m, uint32_t imm)
+{
+    rex(e, 0, 0, m.base);
+    emit1(e, 0xC7);
+    modrm(e, 0, m);
+    emit4(e, imm);
+}
+#endif
+
+/* lea r, [m] */
+static void lea(Emitter* e, int r, Operand m)
+{
+    rex(e, 1, r, m.base);
+    emit1(e, 0x8D);
+    modrm(e, r, m);
+}
+
+/* mov r, imm64 */
+static void loadimm(Emitter* e, int r, uint64_t imm)
+{
+    rex(e, 1, 0, r);
+    emit1(e, 0xB8 + (r & 7));
+    emit8(e, imm);
+}
+
+/* mov dst, src */
+static void move(Emitter* e, int dst, int src)
+{
+    rex(e, 1, src, dst);
+    emit1(e, 0x89);
+    emit1(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+/* SSE instruction on xmm[x] and [m] */
+static void ssemem(Emitter* e, int prefix, int op, int x, Operand m)
+{
+    if (prefix != 0) {
+        emit1(e, prefix);
+    }
+    rex(e, 0, x, m.base);
+    emit1(e, 0x0F);
+    emit1(e, op);
+    modrm(e, x, m);
+}
+
+/* SSE instruction on xmm[x] and register [y] */
+static void ssereg(Emitter* e, int prefix, int op, int x, int y)
+{
+    if (prefix != 0) {
+        emit1(e, prefix);
+    }
+    rex(e, 0, x, y);
+    emit1(e, 0x0F);
+    emit1(e, op);
+    emit1(e, 0xC0 | ((x & 7) << 3) | (y & 7));
+}
+
+/* Calls a C function, arguments are already in place */
+static void callc(Emitter* e, void* fn)
+{
+    loadimm(e, RAX, (uintptr_t)fn);
+    emit1(e, 0xFF);
+    emit1(e, 0xD0);
+}
+
+/* Branches to instruction [target], [cc] is CC_ALWAYS for a jmp */
+static void branch(Emitter* e, int cc, int target)
+{
+    if (cc == CC_ALWAYS) {
+        emit1(e, 0xE9);
+    } else {
+        emit1(e, 0x0F);
+        emit1(e, 0x80 | cc);
+    }
+    if (e->patchcount == e->patchsize) {
+        e->patchsize *= 2;
+        e->patches = realloc(e->patches, sizeof(Patch) * e->patchsize);
+    }
+    e->patches[e->patchcount++] = (Patch) { e->size, target };
+    emit4(e, 0);
+}
+
+/*
+** Branches forward within a template, to wherever landhere is called
+** with what this returns.
+*/
+static int jumpahead(Emitter* e, int cc)
+{
+    if (cc == CC_ALWAYS) {
+        emit1(e, 0xE9);
+    } else {
+        emit1(e, 0x0F);
+        emit1(e, 0x80 | cc);
+    }
+    emit4(e, 0);
+    return e->size;
+}
+
+static void landhere(Emitter* e, int from)
+{
+    uint32_t rel = (uint32_t)(e->size - from);
+    memcpy(&e->code[from - 4], &rel, sizeof(rel));
+}
+
+/* Returns [pc] to the interpreter */
+static void exitto(Emitter* e, int pc)
+{
+    emit1(e, 0xB8);
+    emit4(e, (uint32_t)pc);
+    emit1(e, 0xE9);
+    emit4(e, (uint32_t)(e->epilogue - (e->size + 4)));
+}
+
+/* Returns [pc] to the interpreter unless eax is set, after a slow path that can fail */
+static void exitunless(Emitter* e, int pc)
+{
+    emit1(e, 0x85); // test eax, eax
+    emit1(e, 0xC0);
+    emit1(e, 0x75); // jnz over the exit
+    emit1(e, 10);
+    exitto(e, pc);
+}
+
+/*
+** Jumps to [target] from an instruction that leaves ip at [from].
+** Backward jumps are charged against the budget like in the interpreter,
+** and hand the thread back to it to yield once the budget runs out.
+*/
+static void jumpto(Emitter* e, int target, int from)
+{
+    if (target >= from) {
+        branch(e, CC_ALWAYS, target);
+        return;
+    }
+    rex(e, 0, 0, FRAME);
+    emit1(e, 0x81); // sub dword [budget], charge
+    modrm(e, 5, (Operand) { FRAME, offsetof(JitFrame, budget) });
+    emit4(e, (uint32_t)(from - target));
+    branch(e, CC_G, target);
+    exitto(e, -(target + 1));
+}
+
+static Operand regop(int r)
+{
+    return (Operand) { BASE, r * VSIZE };
+}
+
+static Operand constop(int k)
+{
+    return (Operand) { CONSTS, k * VSIZE };
+}
+
+#define rkb(i) (i & 0x40 ? constop(argb(i)) : regop(argb(i)))
+#define rkc(i) (i & 0x80 ? constop(argc(i)) : regop(argc(i)))
+
+static void copyvalue(Emitter* e, Operand dst, Operand src)
+{
+    if (VSIZE == 8) {
+        load(e, 1, RAX, src);
+        store(e, 1, dst, RAX);
+    } else {
+        ssemem(e, 0, 0x10, 0, src); // movups
+        ssemem(e, 0, 0x11, 0, dst);
+    }
+    if (VSIZE == 24) { // The type, after a vector's components
+        load(e, 1, RAX, (Operand) { src.base, src.disp + 16 });
+        store(e, 1, (Operand) { dst.base, dst.disp + 16 }, RAX);
+    }
+}
+
+/* Stores xmm0 as a number */
+static void storenumber(Emitter* e, Operand dst)
+{
+    ssemem(e, SSE_SCALAR, SSE_STORE, 0, dst);
+#ifndef BT_NAN_BOXING
+    storeimm(e, (Operand) { dst.base, dst.disp + offsetof(bt_Value, type) }, VT_NUMBER);
+#endif
+}
+
+/* Stores eax, which is 0 or 1, as a boolean */
+static void storebool(Emitter* e, Operand dst)
+{
+#ifdef BT_NAN_BOXING
+    loadimm(e, RCX, nbtag(VT_BOOL));
+    emit1(e, 0x48); // or rax, rcx
+    emit1(e, 0x09);
+    emit1(e, 0xC8);
+    store(e, 1, dst, RAX);
+#else
+    emit1(e, 0x89); // mov eax, eax clears the rest of the payload like the interpreter does
+    emit1(e, 0xC0);
+    store(e, 1, dst, RAX);
+    storeimm(e, (Operand) { dst.base, dst.disp + offsetof(bt_Value, type) }, VT_BOOL);
+#endif
+}
+
+/* Branches forward unless [m] holds a number */
+static int unlessnumber(Emitter* e, Operand m)
+{
+#ifdef BT_NAN_BOXING
+    load(e, 1, RAX, m);
+    loadimm(e, RCX, nbtag(VT_NIL)); // Every tag is above every number
+    emit1(e, 0x48); // cmp rax, rcx
+    emit1(e, 0x39);
+    emit1(e, 0xC8);
+    return jumpahead(e, CC_AE);
+#else
+    rex(e, 0, 0, m.base);
+    emit1(e, 0x83); // cmp dword [type], VT_NUMBER
+    modrm(e, 7, (Operand) { m.base, m.disp + offsetof(bt_Value, type) });
+    emit1(e, VT_NUMBER);
+    return jumpahead(e, CC_NE);
+#endif
+}
+
+/*
+** Guards arg B and arg C of [i], where [b] and [c] ask for them, adding a
+** branch to [slow] for each. Constants that are numbers need no guard.
+** Returns how many branches were added.
+*/
+static int guardnumbers(Emitter* e, bt_Function* fn, Instruction i, int b, int c, int* slow)
+{
+    int slows = 0;
+    if (b && (!(i & 0x40) || !isnumber(fn->constants[argb(i)]))) {
+        slow[slows++] = unlessnumber(e, rkb(i));
+    }
+    if (c && (!(i & 0x80) || !isnumber(fn->constants[argc(i)]))) {
+        slow[slows++] = unlessnumber(e, rkc(i));
+    }
+    return slows;
+}
+
+/* Sends the guards in [slow] back to the interpreter, which raises the error at [pc] */
+static void exitslow(Emitter* e, const int* slow, int slows, int pc)
+{
+    if (slows == 0) {
+        return;
+    }
+    int done = jumpahead(e, CC_ALWAYS);
+    for (int s = 0; s != slows; ++s) {
+        landhere(e, slow[s]);
+    }
+    exitto(e, pc);
+    landhere(e, done);
+}
+
+/* Skips the next instruction if eax equals [a] */
+static void skipif(Emitter* e, int a, int pc)
+{
+    emit1(e, 0x83); // cmp eax, a
+    emit1(e, 0xF8);
+    emit1(e, a);
+    branch(e, CC_E, pc + 2);
+}
+
+/*
+** Slow paths, called from native code.
+** Struct access works like the interpreter's, going through the same inline caches.
+*/
+
+static void jitnewstruct(JitFrame* f, bt_Value* dst)
+{
+    *dst = struc(bt_newstruct(f->bt));
+    ctx_gccheck(f->bt);
+}
+
+static int jitgetstruct(JitFrame* f, bt_Value* dst, bt_Value* src, StructCache* ic, Key* k)
+{
+    if (vtype(*src) != VT_STRUCT) {
+        return vec_get(f->bt, src, k, dst);
+    }
+    bt_Struct* s = tostruct(*src);
+    int w = cacheway(ic, s->meta);
+    if (w != -1) {
+        ++f->hits;
+        *dst = *structslot(s, ic->idx[w]);
+    } else {
+        ++f->misses;
+        *dst = cachegetstruct(f->bt, s, k, ic);
+    }
+    return 1;
+}
+
+static int jitsetstruct(JitFrame* f, bt_Value* dst, bt_Value* vl, StructCache* ic, Key* k)
+{
+    if (vtype(*dst) != VT_STRUCT) {
+        return vec_set(f->bt, dst, k, vl);
+    }
+    bt_Struct* s = tostruct(*dst);
+    int w = cacheway(ic, s->meta);
+    if (w != -1) {
+        ++f->hits;
+        int idx = ic->idx[w];
+        if (ic->target[w] != s->meta) {
+            s->meta = ic->target[w];
+            if (idx == s->size) {
+                growstruct(f->bt, s);
+            }
+        }
+        *structslot(s, idx) = *vl;
+    } else {
+        ++f->misses;
+        cachesetstruct(f->bt, s, k, vl, ic);
+    }
+    if (isobject(*vl)) {
+        ctx_barrier(f->bt, s, vl);
+    }
+    return 1;
+}
+
+/*
+** Arithmetic that isn't on two numbers, [rhs] being NULL for an immediate.
+** Vectors go component by component, anything else fails like it does in
+** the interpreter. With NaN boxing, numbers whose result was NaN end up
+** here too.
+*/
+static int jitarith(JitFrame* f, unsigned int i, bt_Value* dst, bt_Value* lhs, bt_Value* rhs)
+{
+    int op = i & 0x3F;
+    bt_Value k;
+    if (rhs == NULL) {
+        k = number((BT_NUMBER)argsc(i));
+        rhs = &k;
+        op = op == OP_ADDI ? OP_ADD : op == OP_SUBI ? OP_SUB : OP_MUL;
+    }
+    if (!isnumbers(*lhs, *rhs)) {
+        return vec_arith(f->bt, op, lhs, rhs, dst);
+    }
+    switch (op)
+    {
+        case OP_ADD: *dst = number(tonumber(*lhs) + tonumber(*rhs)); break;
+        case OP_SUB: *dst = number(tonumber(*lhs) - tonumber(*rhs)); break;
+        case OP_MUL: *dst = number(tonumber(*lhs) * tonumber(*rhs)); break;
+        default:     *dst = number(tonumber(*lhs) / tonumber(*rhs)); break;
+    }
+    return 1;
+}
+
+static int jitvec(JitFrame* f, bt_Value* dst, bt_Value* components, int count)
+{
+    return vec_new(f->bt, components, count, dst);
+}
+
+/*
+** Array instructions return 0 when they can't be carried out, having
+** changed nothing, so the interpreter runs them again to raise the error.
+*/
+
+static int jitnewarray(JitFrame* f, bt_Value* dst, bt_Value* length, int count)
+{
+    Array* a = array_new(f->bt, length, dst + 1, count);
+    if (a == NULL) {
+        return 0;
+    }
+    f->budget -= (BT_TIMER)a->length;
+    *dst = array(a);
+    ctx_gccheck(f->bt);
+    return 1;
+}
+
+static int jitgetindex(JitFrame* f, bt_Value* dst, bt_Value* arr, bt_Value* idx)
+{
+    (void)f;
+    if (vtype(*arr) != VT_ARRAY || !isnumber(*idx)) {
+        return 0;
+    }
+    *dst = array_get(toarray(*arr), tonumber(*idx));
+    return 1;
+}
+
+static int jitsetindex(JitFrame* f, bt_Value* arr, bt_Value* idx, bt_Value* vl)
+{
+    return vtype(*arr) == VT_ARRAY && array_set(f->bt, toarray(*arr), idx, vl);
+}
+
+static int jitlen(JitFrame* f, bt_Value* dst, bt_Value* arr)
+{
+    (void)f;
+    if (vtype(*arr) != VT_ARRAY) {
+        return 0;
+    }
+    *dst = number(toarray(*arr)->length);
+    return 1;
+}
+
+static int jitsum(JitFrame* f, bt_Value* dst, bt_Value* arr)
+{
+    if (vtype(*arr) != VT_ARRAY) {
+        return 0;
+    }
+    Array* a = toarray(*arr);
+    f->budget -= (BT_TIMER)a->length;
+    *dst = number(array_sum(a->data, a->length));
+    return 1;
+}
+
+static int jitdot(JitFrame* f, bt_Value* dst, bt_Value* lhs, bt_Value* rhs)
+{
+    if (vtype(*lhs) != VT_ARRAY || vtype(*rhs) != VT_ARRAY || toarray(*lhs)->length != toarray(*rhs)->length) {
+        return 0;
+    }
+    Array* a = toarray(*lhs);
+    f->budget -= (BT_TIMER)a->length;
+    *dst = number(array_dot(a->data, toarray(*rhs)->data, a->length));
+    return 1;
+}
+
+static int jitscale(JitFrame* f, bt_Value* dst, bt_Value* arr, bt_Value* k)
+{
+    if (vtype(*arr) != VT_ARRAY || !isnumber(*k)) {
+        return 0;
+    }
+    Array* a = toarray(*arr);
+    f->budget -= (BT_TIMER)a->length;
+    array_scale(a->data, tonumber(*k), a->length);
+    *dst = *arr;
+    return 1;
+}
+
+static int jitaddarray(JitFrame* f, bt_Value* dst, bt_Value* lhs, bt_Value* rhs)
+{
+    if (vtype(*lhs) != VT_ARRAY || vtype(*rhs) != VT_ARRAY || toarray(*lhs)->length != toarray(*rhs)->length) {
+        return 0;
+    }
+    Array* a = toarray(*lhs);
+    f->budget -= (BT_TIMER)a->length;
+    array_add(a->data, toarray(*rhs)->data, a->length);
+    *dst = *lhs;
+    return 1;
+}
+
+/* Emits the template of instruction [pc] */
+static void translate(Emitter* e, bt_Function* fn, int pc)
+{
+    Instruction i = unquicken(fn->program[pc]); // Native code doesn't need the variants
+    int op = i & 0x3F;
+    switch (op)
+    {
+        case OP_LOAD: copyvalue(e, regop(arga(i)), constop(argbx(i))); break;
+        case OP_MOVE: copyvalue(e, regop(arga(i)), regop(argbx(i))); break;
+        case OP_LOADBOOL:
+            emit1(e, 0xB8); // mov eax, b
+            emit4(e, argb(i) != 0);
+            storebool(e, regop(arga(i)));
+            if (argc(i) != 0) {
+                branch(e, CC_ALWAYS, pc + 1 + argc(i));
+            }
+            break;
+
+        case OP_NEWSTRUCT:
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i)));
+            callc(e, (void*)jitnewstruct);
+            break;
+        case OP_GETSTRUCT:
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i)));
+            lea(e, RDX, regop(argb(i)));
+            loadimm(e, RCX, (uintptr_t)&fn->caches[fn->cacheidx[pc]]);
+            loadimm(e, R8, (uintptr_t)fn->keys[argc(i)]);
+            callc(e, (void*)jitgetstruct);
+            exitunless(e, pc);
+            break;
+        case OP_SETSTRUCT:
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i)));
+            lea(e, RDX, rkc(i));
+            loadimm(e, RCX, (uintptr_t)&fn->caches[fn->cacheidx[pc]]);
+            loadimm(e, R8, (uintptr_t)fn->keys[argb(i)]);
+            callc(e, (void*)jitsetstruct);
+            exitunless(e, pc);
+            break;
+
+        /*
+        ** Arithmetic is done inline on numbers, and calls out for anything
+        ** else, like vectors. Without NaN boxing the types are checked
+        ** first, constants that are numbers aside. With it anything that
+        ** isn't a number is a NaN, so the result is checked instead, and
+        ** a NaN from numbers just takes the long way round.
+        */
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_ADDI: case OP_SUBI: case OP_MULI: {
+            int imm = op == OP_ADDI || op == OP_SUBI || op == OP_MULI;
+            int sse = op == OP_ADD || op == OP_ADDI ? SSE_ADD : op == OP_SUB || op == OP_SUBI ? SSE_SUB
+                : op == OP_MUL || op == OP_MULI ? SSE_MUL : SSE_DIV;
+            int slow[3], slows = 0;
+#ifndef BT_NAN_BOXING
+            slows = guardnumbers(e, fn, i, 1, !imm, slow);
+#endif
+            ssemem(e, SSE_SCALAR, SSE_LOAD, 0, rkb(i));
+            if (imm) {
+                emit1(e, 0xB8); // mov eax, imm
+                emit4(e, (uint32_t)(int)argsc(i));
+                ssereg(e, SSE_SCALAR, SSE_CVTSI, 1, RAX);
+                ssereg(e, SSE_SCALAR, sse, 0, 1);
+            } else {
+                ssemem(e, SSE_SCALAR, sse, 0, rkc(i));
+            }
+#ifdef BT_NAN_BOXING
+            ssereg(e, SSE_COMPARE, SSE_UCOMI, 0, 0);
+            slow[slows++] = jumpahead(e, CC_P);
+#endif
+            storenumber(e, regop(arga(i)));
+            int done = jumpahead(e, CC_ALWAYS);
+            for (int s = 0; s != slows; ++s) {
+                landhere(e, slow[s]);
+            }
+            move(e, RDI, FRAME);
+            emit1(e, 0xBE); // mov esi, i
+            emit4(e, i);
+            lea(e, RDX, regop(arga(i)));
+            lea(e, RCX, rkb(i));
+            if (imm) {
+                emit1(e, 0x45); // xor r8d, r8d
+                emit1(e, 0x31);
+                emit1(e, 0xC0);
+            } else {
+                lea(e, R8, rkc(i));
+            }
+            callc(e, (void*)jitarith);
+            exitunless(e, pc);
+            landhere(e, done);
+            break;
+        }
+
+        case OP_NEG: {
+            int slow[1], slows = guardnumbers(e, fn, i, 0, 1, slow);
+            // Flip the sign bit, like the compiler does for a negation
+            if (sizeof(BT_NUMBER) == 4) {
+                load(e, 0, RAX, rkc(i));
+                emit1(e, 0x35); // xor eax, sign
+                emit4(e, 0x80000000u);
+                store(e, 0, regop(arga(i)), RAX);
+            } else {
+                load(e, 1, RAX, rkc(i));
+                emit1(e, 0x48); // btc rax, 63
+                emit1(e, 0x0F);
+                emit1(e, 0xBA);
+                emit1(e, 0xF8);
+                emit1(e, 63);
+                store(e, 1, regop(arga(i)), RAX);
+            }
+#ifndef BT_NAN_BOXING
+            storeimm(e, (Operand) { BASE, arga(i) * VSIZE + offsetof(bt_Value, type) }, VT_NUMBER);
+#endif
+            exitslow(e, slow, slows, pc);
+            break;
+        }
+        case OP_NOT:
+            // The opposite of what OP_TEST sees, whatever the operand is
+            lea(e, RDI, rkc(i));
+            callc(e, (void*)thread_test);
+            emit1(e, 0x83); // xor eax, 1
+            emit1(e, 0xF0);
+            emit1(e, 1);
+            storebool(e, regop(arga(i)));
+            break;
+
+        /*
+        ** Comparisons skip the next instruction when the result equals arg A.
+        ** Fused ones jump to the target of the OP_JUMP after them otherwise,
+        ** which is where ip is left, so they're charged from there.
+        */
+        case OP_EQUAL: case OP_JEQUAL:
+            lea(e, RDI, rkb(i));
+            lea(e, RSI, rkc(i));
+            callc(e, (void*)thread_equal);
+            skipif(e, arga(i), pc);
+            break;
+        case OP_TEST: case OP_JTEST:
+            lea(e, RDI, rkc(i));
+            callc(e, (void*)thread_test);
+            skipif(e, arga(i), pc);
+            break;
+        case OP_LESS: case OP_JLESS: case OP_LEQUAL: case OP_JLEQUAL: {
+            int slow[2], slows = guardnumbers(e, fn, i, 1, 1, slow);
+            // b < c is c above b, and unordered operands are never above
+            int less = op == OP_LESS || op == OP_JLESS;
+            ssemem(e, SSE_SCALAR, SSE_LOAD, 0, rkc(i));
+            ssemem(e, SSE_COMPARE, SSE_UCOMI, 0, rkb(i));
+            branch(e, less ? (arga(i) ? CC_A : CC_BE) : (arga(i) ? CC_AE : CC_B), pc + 2);
+            exitslow(e, slow, slows, pc);
+            break;
+        }
+
+        case OP_JUMP: jumpto(e, argbx(i), pc + 1); break;
+
+        case OP_PRINT:
+            lea(e, RDI, rkc(i));
+            callc(e, (void*)thread_print);
+            break;
+
+        case OP_NEWARRAY:
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i)));
+            lea(e, RDX, rkc(i));
+            emit1(e, 0xB9); // mov ecx, count
+            emit4(e, argb(i));
+            callc(e, (void*)jitnewarray);
+            exitunless(e, pc);
+            break;
+        case OP_LEN: case OP_SUM:
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i)));
+            lea(e, RDX, rkc(i));
+            callc(e, op == OP_LEN ? (void*)jitlen : (void*)jitsum);
+            exitunless(e, pc);
+            break;
+        case OP_GETINDEX: case OP_SETINDEX: case OP_DOT: case OP_SCALE: case OP_ADDARRAY: {
+            void* helper = op == OP_GETINDEX ? (void*)jitgetindex : op == OP_SETINDEX ? (void*)jitsetindex
+                : op == OP_DOT ? (void*)jitdot : op == OP_SCALE ? (void*)jitscale : (void*)jitaddarray;
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i))); // The array itself for OP_SETINDEX
+            lea(e, RDX, rkb(i));
+            lea(e, RCX, rkc(i));
+            callc(e, helper);
+            exitunless(e, pc);
+            break;
+        }
+        case OP_VEC:
+            move(e, RDI, FRAME);
+            lea(e, RSI, regop(arga(i)));
+            lea(e, RDX, regop(argb(i)));
+            emit1(e, 0xB9); // mov ecx, count
+            emit4(e, argc(i));
+            callc(e, (void*)jitvec);
+            exitunless(e, pc);
+            break;
+
+        default: // Calls, returns and yields change frames, the interpreter does those
+            exitto(e, pc);
+            return;
+    }
+    if (op == OP_JEQUAL || op == OP_JTEST || op == OP_JLESS || op == OP_JLEQUAL) {
+        jumpto(e, argbx(fn->program[pc + 1]), pc + 1);
+    }
+}
+
+/*
+** Compiles a function to native code.
+** Runs after the program is final, since constants, keys and inline caches
+** are addressed directly. Returns 0 if it can't, and the function keeps
+** running in the interpreter.
+*/
+int jit_compile(bt_Context* bt, bt_Function* fn)
+{
+    (void)bt;
+    if ((VSIZE != 8 && VSIZE != 16 && VSIZE != 24) || sizeof(BT_TIMER) != 4 || fn->progcount == 0) {
+        return 0;
+    }
+    Emitter e;
+    e.cap = 64 + (size_t)fn->progcount * 32;
+    e.code = malloc(e.cap);
+    e.size = 0;
+    e.patchsize = 16;
+    e.patches = malloc(sizeof(Patch) * e.patchsize);
+    e.patchcount = 0;
+    unsigned int* entries = malloc(sizeof(unsigned int) * fn->progcount);
+
+    // Save the registers native code keeps its state in, and go to the entry
+    emit1(&e, 0x53); // push rbx
+    emit1(&e, 0x41); // push r12
+    emit1(&e, 0x54);
+    emit1(&e, 0x41); // push r13
+    emit1(&e, 0x55);
+    move(&e, BASE, RDI);
+    move(&e, FRAME, RSI);
+    load(&e, 1, CONSTS, (Operand) { RSI, offsetof(JitFrame, constants) });
+    emit1(&e, 0xFF); // jmp rdx
+    emit1(&e, 0xE2);
+    e.epilogue = e.size;
+    emit1(&e, 0x41); // pop r13
+    emit1(&e, 0x5D);
+    emit1(&e, 0x41); // pop r12
+    emit1(&e, 0x5C);
+    emit1(&e, 0x5B); // pop rbx
+    emit1(&e, 0xC3); // ret
+
+    int ok = 1;
+    for (int pc = 0; pc != fn->progcount; ++pc) {
+        entries[pc] = e.size;
+        int op = unquicken(fn->program[pc]) & 0x3F;
+        if ((op == OP_JEQUAL || op == OP_JTEST || op == OP_JLESS || op == OP_JLEQUAL) && pc + 1 == fn->progcount) {
+            ok = 0; // Fused without its jump
+            break;
+        }
+        translate(&e, fn, pc);
+    }
+    for (int p = 0; ok && p != e.patchcount; ++p) {
+        Patch* patch = &e.patches[p];
+        if (patch->target < 0 || patch->target >= fn->progcount) {
+            ok = 0;
+            break;
+        }
+        uint32_t rel = (uint32_t)((int)entries[patch->target] - (patch->at + 4));
+        memcpy(&e.code[patch->at], &rel, sizeof(rel));
+    }
+    free(e.patches);
+
+    void* code = MAP_FAILED;
+    if (ok) {
+        code = mmap(NULL, e.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (code != MAP_FAILED) {
+        memcpy(code, e.code, e.size);
+        if (mprotect(code, e.size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(code, e.size);
+            code = MAP_FAILED;
+        }
+    }
+    free(e.code);
+    if (code == MAP_FAILED) {
+        free(entries);
+        return 0;
+    }
+    fn->native = code;
+    fn->entries = entries;
+    return 1;
+}
+
+/*
+** Runs a function's native code from [ip] with the frame at [reg],
+** until it needs the interpreter or runs out of [budget].
+*/
+JitExit jit_run(bt_Context* bt, bt_Function* fn, bt_Value* reg, Instruction* ip, BT_TIMER budget)
+{
+    JitFrame f = { bt, fn->constants, budget, 0, 0 };
+    NativeCode code = (NativeCode)fn->native;
+    int pc = code(reg, &f, (char*)fn->native + fn->entries[ip - fn->program]);
+    if ((f.hits | f.misses) != 0) {
+        fn->cachehits += f.hits;
+        fn->cachemisses += f.misses;
+    }
+    return (JitExit) { pc, f.budget };
+}
+
+#else
+
+int jit_compile(bt_Context* bt, bt_Function* fn)
+{
+    (void)bt;
+    (void)fn;
+    return 0;
+}
+
+#endif
+
+/*
+** Turns the JIT on or off for functions compiled or loaded from now on.
+** It's off by default. Returns 0 if this build has no JIT,
+** in which case everything keeps running in the interpreter.
+*/
+BT_API int bt_jit(bt_Context* bt, int enabled)
+{
+#ifdef BT_JIT
+    ctx_compileinfo(bt)->jit = enabled;
+    return 1;
+#else
+    (void)bt;
+    (void)enabled;
+    return 0;
+#endif
+}
\ No newline at end of file
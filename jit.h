@@ -0,0 +1,20 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "bullet_train.h"
+#include "function.h"
+
+/*
+** Where a function's native code stopped.
+** [pc] is the instruction the interpreter carries on from, or -(pc + 1)
+** if the budget ran out on a jump to pc. [budget] is what's left of it.
+*/
+typedef struct JitExit {
+    int pc;
+    BT_TIMER budget;
+} JitExit;
+
+int jit_compile(bt_Context* bt, bt_Function* fn);
+JitExit jit_run(bt_Context* bt, bt_Function* fn, bt_Value* reg, Instruction* ip, BT_TIMER budget);
+
+#endif
\ No newline at end of file
@@ -7,18 +7,25 @@
 
 struct Lexer {
     const char* current; /* Current character */
-    char buffer[128]; /* Buffer that stores identifiers, strings, numbers, etc. */
+    const char* end; /* End of the source, which doesn't need a null terminator */
+    const char* text; /* Start of the last identifier or number, points into the source */
+    int length; /* Length of the last identifier or number */
     int lookahead; /* Peeked token */
-    int line; /* Line number */
+    int line; /* Line number the cursor is on, from 1 */
+    int tokenline; /* Line of the last token returned by lex_next */
+    int lookline; /* Line of the peeked token */
 };
 
 
-Lexer* lex_new(const char* src)
+/* Creates a lexer that scans [length] bytes of [src] in place */
+Lexer* lex_new(const char* src, size_t length)
 {
     Lexer* lx = malloc(sizeof(Lexer));
     lx->current = src;
+    lx->end = src + length;
     lx->lookahead = -1;
-    lx->line = 0;
+    lx->line = 1;
+    lx->tokenline = 1;
     return lx;
 }
 
@@ -34,53 +41,75 @@ void lex_free(Lexer* lx)
 ** ===========================================================
 */
 
+/*
+** Gets the character [offset] places past the cursor.
+** Reads past the end of the source give a null character.
+*/
+static inline int peekchar(Lexer* lx, int offset)
+{
+    return lx->end - lx->current > offset ? (unsigned char)lx->current[offset] : '\0';
+}
+
+#define current(lx) peekchar(lx, 0)
+
+/* Scans a number, which is converted by lex_getnumber */
 static int scannumber(Lexer* lx)
 {
-    char* buf = lx->buffer;
+    lx->text = lx->current;
     do {
-        *buf++ = *lx->current++;
-    } while (isdigit(*lx->current));
+        ++lx->current;
+    } while (isdigit(current(lx)));
     // Decimal place?
-    if (*lx->current == '.') {
+    if (current(lx) == '.') {
         do {
-            *buf++ = *lx->current++;
-        } while (isdigit(*lx->current));  
+            ++lx->current;
+        } while (isdigit(current(lx)));
     }
-    *buf = 0; // Null terminator
+    lx->length = (int)(lx->current - lx->text);
     return TK_NUMBER;
 }
 
+/* Checks if the identifier just scanned is the keyword [kw] */
+static int iskeyword(Lexer* lx, const char* kw, int length)
+{
+    return lx->length == length && memcmp(lx->text, kw, length) == 0;
+}
+
 /*
-** Scans a keyword, identifier, or boolean literal
+** Scans a keyword, identifier, or boolean literal.
+** Identifiers aren't copied, the parser reads them from the source.
 */
 static int scanident(Lexer* lx)
 {
-    char* buf = lx->buffer;
+    lx->text = lx->current;
     do {
-        *buf++ = *lx->current++;
-    } while (isalnum(*lx->current) || *lx->current == '_');
-    *buf = 0; // Null terminator
+        ++lx->current;
+    } while (isalnum(current(lx)) || current(lx) == '_');
+    lx->length = (int)(lx->current - lx->text);
 
-    switch (lx->buffer[0])
+    switch (lx->text[0])
     {
         case 'e':
-            if (0 == strcmp(lx->buffer, "else"))  return TK_ELSE;
-            if (0 == strcmp(lx->buffer, "elif"))  return TK_ELIF;
+            if (iskeyword(lx, "else", 4))  return TK_ELSE;
+            if (iskeyword(lx, "elif", 4))  return TK_ELIF;
         case 'f':
-            if (0 == strcmp(lx->buffer, "false")) return TK_FALSE;
+            if (iskeyword(lx, "false", 5)) return TK_FALSE;
+            if (iskeyword(lx, "func", 4))  return TK_FUNC;
         case 'i':
-            if (0 == strcmp(lx->buffer, "if"))    return TK_IF;
+            if (iskeyword(lx, "if", 2))    return TK_IF;
         case 'n':
-            if (0 == strcmp(lx->buffer, "nil"))   return TK_NIL;
+            if (iskeyword(lx, "nil", 3))   return TK_NIL;
         case 'p':
-            if (0 == strcmp(lx->buffer, "print")) return TK_PRINT;
+            if (iskeyword(lx, "print", 5)) return TK_PRINT;
         case 'r':
-            if (0 == strcmp(lx->buffer, "ret"))   return TK_RET;
+            if (iskeyword(lx, "ret", 3))   return TK_RET;
         case 't':
-            if (0 == strcmp(lx->buffer, "true"))  return TK_TRUE;
-            if (0 == strcmp(lx->buffer, "task"))  return TK_TASK;
+            if (iskeyword(lx, "true", 4))  return TK_TRUE;
+            if (iskeyword(lx, "task", 4))  return TK_TASK;
         case 'w':
-            if (0 == strcmp(lx->buffer, "while")) return TK_WHILE;
+            if (iskeyword(lx, "while", 5)) return TK_WHILE;
+        case 'y':
+            if (iskeyword(lx, "yield", 5)) return TK_YIELD;
     }
 
     return TK_ID;
@@ -94,75 +123,83 @@ int lex_next(Lexer* lx)
     if (lx->lookahead != -1) {
         int temp = lx->lookahead;
         lx->lookahead = -1;
+        lx->tokenline = lx->lookline;
         return temp;
     }
 
 Retry:
-    switch (*lx->current)
+    lx->tokenline = lx->line;
+    switch (current(lx))
     {
         case '\0':
             return TK_EOF;
 
-        case '\n': case '\r':
-            ++lx->line;
-        case ' ': case '\t':
+        case '\n':
+            ++lx->line; // \r\n ends one line, so \r is just whitespace
+        case '\r': case ' ': case '\t':
             ++lx->current; // Skip whitespace
             goto Retry;
 
         case '=':
-            if (*(++lx->current) == '=') {
-                ++lx->current;
+            if (peekchar(lx, 1) == '=') {
+                lx->current += 2;
                 return TK_EQ;
             }
+            ++lx->current;
             return '=';
         
         case '!':
-            if (*(++lx->current) == '=') {
-                ++lx->current;
+            if (peekchar(lx, 1) == '=') {
+                lx->current += 2;
                 return TK_NE;
             }
+            ++lx->current;
             return '!';
 
         case '<':
-            if (*(++lx->current) == '=') {
-                ++lx->current;
+            if (peekchar(lx, 1) == '=') {
+                lx->current += 2;
                 return TK_LE;
             }
+            ++lx->current;
             return '<';
 
         case '>':
-            if (*(++lx->current) == '=') {
-                ++lx->current;
+            if (peekchar(lx, 1) == '=') {
+                lx->current += 2;
                 return TK_ME;
             }
+            ++lx->current;
             return '>';
         
         case '&':
-            if (*(++lx->current) == '&') {
-                ++lx->current;
+            if (peekchar(lx, 1) == '&') {
+                lx->current += 2;
                 return TK_AND;
             }
+            ++lx->current;
             return '&';
          
         case '|':
-            if (*(++lx->current) == '|') {
-                ++lx->current;
+            if (peekchar(lx, 1) == '|') {
+                lx->current += 2;
                 return TK_OR;
             }
+            ++lx->current;
             return '|';
         
         case '-':
             // Negative number literal?
-            if (isdigit(*(lx->current + 1))) { 
+            if (isdigit(peekchar(lx, 1))) {
                 return scannumber(lx);
             }
             ++lx->current;
             return '-';
 
         default:
-            if (isdigit(*lx->current)) {
+            if (isdigit(current(lx))) {
                 return scannumber(lx);
-            } else if (isalpha(*lx->current) || *lx->current == '_') {
+            } else if (isalpha(current(lx)) || current(lx) == '_') {
                 return scanident(lx);
             } else {
                 return *lx->current++; // Single character token
@@ -176,18 +213,56 @@ Retry:
 int lex_peek(Lexer* lx)
 {
     if (lx->lookahead == -1) {
+        int line = lx->tokenline;
         lx->lookahead = lex_next(lx);
+        lx->lookline = lx->tokenline;
+        lx->tokenline = line;
     }
     return lx->lookahead;
 }
 
+/* Line of the last token consumed, which is what's being compiled */
+int lex_line(Lexer* lx)
+{
+    return lx->tokenline;
+}
+
+/*
+** Saves the lexer's position.
+** Must be called when no token has been peeked.
+*/
+void lex_save(Lexer* lx, LexState* st)
+{
+    st->current = lx->current;
+    st->line = lx->line;
+}
 
+/* Returns the lexer to a saved position */
+void lex_restore(Lexer* lx, LexState* st)
+{
+    lx->current = st->current;
+    lx->line = st->line;
+    lx->tokenline = st->line;
+    lx->lookahead = -1;
+}
+
+
+/* Converts the number just scanned, which isn't null terminated in the source */
 BT_NUMBER lex_getnumber(Lexer* lx)
 {
-    return (BT_NUMBER)atof(lx->buffer);
+    char buffer[64];
+    int length = lx->length < 63 ? lx->length : 63;
+    memcpy(buffer, lx->text, length);
+    buffer[length] = '\0';
+    return (BT_NUMBER)atof(buffer);
 }
 
-const char* lex_gettext(Lexer* lx)
+/*
+** Gets the last identifier scanned.
+** The text isn't null terminated, its length is stored in [length].
+*/
+const char* lex_gettext(Lexer* lx, int* length)
 {
-    return lx->buffer;
+    *length = lx->length;
+    return lx->text;
 }
\ No newline at end of file
@@ -15,18 +15,29 @@ enum {
     TK_EQ, TK_NE, TK_LE, TK_ME, // ==, !=, <=, >=
     TK_AND, TK_OR, // &&, ||
     TK_RET, // ret
-    TK_PRINT // print
+    TK_PRINT, // print
+    TK_YIELD // yield
 };
 
 typedef struct Lexer Lexer;
 
-Lexer* lex_new(const char* src);
+/* Saved lexer position, for scanning the same source twice */
+typedef struct LexState {
+    const char* current;
+    int line;
+} LexState;
+
+Lexer* lex_new(const char* src, size_t length);
 void lex_free(Lexer* lx);
 
 int lex_next(Lexer* lx);
 int lex_peek(Lexer* lex);
+int lex_line(Lexer* lx);
+
+void lex_save(Lexer* lx, LexState* st);
+void lex_restore(Lexer* lx, LexState* st);
 
 BT_NUMBER lex_getnumber(Lexer* lx);
-const char* lex_gettext(Lexer* lx);
+const char* lex_gettext(Lexer* lx, int* length);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,84 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "map.h"
+
+/* Empty files can't be mapped, so they all share this instead */
+static char empty[1];
+
+/*
+** Maps a whole file into memory, copy-on-write.
+** Pages can be patched in memory without touching the file,
+** and are only read from disk as they're touched.
+** The file itself is closed before returning.
+** Returns NULL if the file can't be opened or mapped.
+*/
+char* map_open(const char* path, size_t* size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER filesize;
+    if (!GetFileSizeEx(file, &filesize)) {
+        CloseHandle(file);
+        return NULL;
+    }
+    *size = (size_t)filesize.QuadPart;
+    if (*size == 0) {
+        CloseHandle(file);
+        return empty;
+    }
+    HANDLE map = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (map == NULL) {
+        return NULL;
+    }
+    char* data = MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(map); // The view keeps the mapping alive
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return empty;
+    }
+    char* data = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid after the file is closed
+    return data == MAP_FAILED ? NULL : data;
+#endif
+}
+
+/* Unmaps a file mapped by map_open */
+void map_close(char* data, size_t size)
+{
+    if (data == empty) {
+        return;
+    }
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
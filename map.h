@@ -0,0 +1,9 @@
+#ifndef _MAP_H_
+#define _MAP_H_
+
+#include <stddef.h>
+
+char* map_open(const char* path, size_t* size);
+void map_close(char* data, size_t size);
+
+#endif
\ No newline at end of file
@@ -1,70 +1,606 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "bullet_train.h"
 #include "value.h"
 #include "lex.h"
 #include "function.h"
+#include "vector.h"
+#include "map.h"
+#include "jit.h"
+#include "profile.h"
 
 #define MAX_PATCHES 32
 
 typedef struct Local Local;
+typedef struct FuncDecl FuncDecl;
+typedef struct Parser Parser;
 
 struct Local {
     Local* prev;
     int scope;
     int idx;
-    char name[];
+    int pc; // First instruction emitted after the local was declared
+    Key* name; // Interned, so locals are compared by pointer
 };
 
-typedef struct {
+/*
+** Function declared with func.
+** Functions can't capture locals, so their closures are made at compile
+** time and their names are bound to them as constants.
+*/
+struct FuncDecl {
+    FuncDecl* prev;
+    Key* name;
+    bt_Closure* closure;
+};
+
+/* Start size for pool maps, must be a power of two */
+#define POOL_BUF 16
+
+typedef struct PoolSlot {
+    unsigned long hash;
+    int idx; // -1 when empty
+} PoolSlot;
+
+/* Open addressing map from constants or keys to their index, for deduplication */
+typedef struct PoolMap {
+    PoolSlot* slots;
+    int count;
+    int mask; // Table size - 1
+} PoolMap;
+
+/* How far the line table has got, saved so code can be thrown away */
+typedef struct LineState {
+    int size; // Bytes written
+    int start; // First instruction of the run still being added to
+    int line; // Line of that run
+    int last; // Line of the last run written
+} LineState;
+
+struct Parser {
     bt_Context* ctx;
     bt_Function* fn;
     Lexer* lx;
+    Parser* outer; // Parser of the function this one is declared in, NULL at the top
+    int failed; // Set on the top parser if any function can't be encoded
+
     // Hideous vector counters. Not much I can do since this ain't C++
     int ps, pr; // Program size, program reserved
+    unsigned char* lines; int lr; // Line table as it's built, see bt_getline
+    LineState ln;
     int ks, kr; // Keys size, keys reserved
     int cs, cr; // Data size, data reserved
+    PoolMap kmap, cmap; // Indices of keys and constants already added
     int emptyreg; // Index of first empty register
     Local* locals;
-} Parser;
+    FuncDecl* funcs; // Functions declared in this one, visible to nested ones too
+};
+
+static void poolinit(PoolMap* m)
+{
+    m->slots = malloc(sizeof(PoolSlot) * POOL_BUF);
+    for (int i = 0; i != POOL_BUF; ++i) {
+        m->slots[i].idx = -1;
+    }
+    m->count = 0;
+    m->mask = POOL_BUF - 1;
+}
+
+/* Adds an entry to a pool map, doubling its size once it's half full */
+static void pooladd(PoolMap* m, unsigned long hash, int idx)
+{
+    if ((m->count + 1) * 2 > m->mask + 1) {
+        int size = (m->mask + 1) * 2;
+        PoolSlot* slots = malloc(sizeof(PoolSlot) * size);
+        for (int i = 0; i != size; ++i) {
+            slots[i].idx = -1;
+        }
+        for (int i = 0; i <= m->mask; ++i) {
+            if (m->slots[i].idx != -1) {
+                int j = m->slots[i].hash & (size - 1);
+                while (slots[j].idx != -1) {
+                    j = (j + 1) & (size - 1);
+                }
+                slots[j] = m->slots[i];
+            }
+        }
+        free(m->slots);
+        m->slots = slots;
+        m->mask = size - 1;
+    }
+    int i = hash & m->mask;
+    while (m->slots[i].idx != -1) {
+        i = (i + 1) & m->mask;
+    }
+    m->slots[i].hash = hash;
+    m->slots[i].idx = idx;
+    ++m->count;
+}
 
 static void initparser(Parser* p, bt_Context* ctx, Lexer* lx)
 {
     bt_Function* fn = malloc(sizeof(bt_Function));
     fn->program = malloc(sizeof(Instruction) * 4);
+    fn->progcount = 0;
     fn->constants = malloc(sizeof(bt_Value) * 4);
+    fn->constcount = 0;
     fn->keys = malloc(sizeof(Key*) * 4);
+    fn->keycount = 0;
+    fn->caches = NULL;
+    fn->cacheidx = NULL;
+    fn->cachehits = 0;
+    fn->cachemisses = 0;
     fn->params = 0;
-    fn->registers = 0;
+    fn->registers = 1; // The first empty register is written before anything is declared
     fn->type = FT_FUNC;
+    fn->native = NULL;
+    fn->entries = NULL;
+    fn->lines = NULL;
+    fn->linesize = 0;
+    fn->name = NULL;
     p->fn = fn;
     p->lx = lx;
     p->ctx = ctx;
+    p->outer = NULL;
+    p->failed = 0;
     p->ps = 0; p->pr = 4;
+    p->lines = malloc(16); p->lr = 16;
+    p->ln.size = 0; p->ln.start = 0; p->ln.line = 0; p->ln.last = 0;
     p->ks = 0; p->kr = 4;
     p->cs = 0; p->cr = 4;
+    poolinit(&p->kmap);
+    poolinit(&p->cmap);
     p->emptyreg = 0;
     p->locals = NULL;
+    p->funcs = NULL;
 }
 
 /*
-** Shrinks the function's vectors and deallocates locals.
+** Fuses comparisons with the OP_JUMP that follows them.
+** The jump is left in place, so anything else targeting it still works.
+*/
+static void fusejumps(Parser* p)
+{
+    Instruction* program = p->fn->program;
+    for (int i = 0; i < p->ps - 1; ++i) {
+        if ((program[i + 1] & 0x3F) != OP_JUMP) {
+            continue;
+        }
+        Instruction op = program[i] & 0x3F;
+        Instruction fused;
+        switch (op)
+        {
+            case OP_EQUAL:  fused = OP_JEQUAL;  break;
+            case OP_LEQUAL: fused = OP_JLEQUAL; break;
+            case OP_LESS:   fused = OP_JLESS;   break;
+            case OP_TEST:   fused = OP_JTEST;   break;
+            default: continue;
+        }
+        program[i] = (program[i] & ~0x3F) | fused;
+    }
+}
+
+/*
+** ============================================================
+** Peephole optimizer
+** Runs over the whole program once it's been generated, before jumps are
+** fused. Until a local is declared in it, a register only holds
+** temporaries, which the parser reads once right after writing them.
+** ============================================================
+*/
+
+#define insop(i) ((int)((i) & 0x3F))
+#define insa(i)  ((int)(((i) >> 8) & 0xFF))
+#define insb(i)  ((int)(((i) >> 16) & 0xFF))
+#define insc(i)  ((int)(((i) >> 24) & 0xFF))
+#define insbx(i) ((int)((i) >> 16))
+
+#define setinsbx(i, bx) (((i) & 0xFFFF) | ((Instruction)(bx) << 16))
+#define setinsc(i, c)   (((i) & ~((Instruction)0xFF << 24)) | ((Instruction)(c) << 24))
+#define setinsa(i, a)   (((i) & ~((Instruction)0xFF << 8)) | ((Instruction)(a) << 8))
+
+/* Checks if register [r] only holds temporaries at instruction [pc] */
+#define istemp(declared, r, pc) ((pc) < (declared)[r])
+
+/* Comparisons skip the next instruction, so it can't be moved away from them */
+static inline int isskip(int op)
+{
+    return op == OP_EQUAL || op == OP_LEQUAL || op == OP_LESS || op == OP_TEST;
+}
+
+/* Instructions that only write their result to register A */
+static inline int iswriter(int op)
+{
+    switch (op)
+    {
+        case OP_LOAD: case OP_NEWSTRUCT: case OP_GETSTRUCT: case OP_MOVE:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        case OP_ADDI: case OP_SUBI: case OP_MULI: case OP_NEG: case OP_NOT:
+        case OP_GETINDEX: case OP_LEN: case OP_SUM: case OP_DOT:
+        case OP_SCALE: case OP_ADDARRAY: case OP_VEC:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* Instruction a OP_LOADBOOL continues at */
+#define boolnext(program, i) ((i) + 1 + insc(program[i]))
+
+/*
+** Folds booleans that are only materialized to be tested:
+**     LOADBOOL t, b  ->  (NOT t', t)  ->  TEST A, t  ->  JUMP L
+** Every OP_LOADBOOL landing on such a test becomes a jump straight to
+** wherever the test would have gone. The test itself is left for
+** dead code removal if nothing else reaches it.
+*/
+static void foldbools(Instruction* program, int size, const int* declared)
+{
+    for (int i = 0; i != size; ++i) {
+        Instruction ins = program[i];
+        if (insop(ins) != OP_LOADBOOL || !istemp(declared, insa(ins), i)) {
+            continue;
+        }
+        int t = insa(ins), b = insb(ins) != 0;
+        int at = boolnext(program, i);
+        // Negations of temporaries just flip the boolean
+        while (at < size && insop(program[at]) == OP_NOT && !(program[at] & 0x80)
+            && insc(program[at]) == t && istemp(declared, insa(program[at]), at)) {
+            t = insa(program[at]);
+            b = !b;
+            ++at;
+        }
+        if (at + 1 >= size || insop(program[at]) != OP_TEST || (program[at] & 0x80)
+            || insc(program[at]) != t || insop(program[at + 1]) != OP_JUMP) {
+            continue;
+        }
+        int target = b == insa(program[at]) ? at + 2 : insbx(program[at + 1]);
+        program[i] = OP_JUMP | ((Instruction)target << 16);
+    }
+}
+
+/* Points jumps at the end of a chain of jumps directly */
+static void threadjumps(Instruction* program, int size)
+{
+    for (int i = 0; i != size; ++i) {
+        if (insop(program[i]) != OP_JUMP) {
+            continue;
+        }
+        int target = insbx(program[i]);
+        // Bounded, since a loop of jumps never ends
+        for (int hops = 0; hops != size && target < size && insop(program[target]) == OP_JUMP; ++hops) {
+            target = insbx(program[target]);
+        }
+        program[i] = setinsbx(program[i], target);
+    }
+}
+
+/* Marks every instruction control flow can reach */
+static void reachable(Instruction* program, int size, char* live, int* stack)
+{
+    int top = 0;
+    memset(live, 0, size);
+    live[0] = 1;
+    stack[top++] = 0;
+    while (top != 0) {
+        int i = stack[--top];
+        int op = insop(program[i]);
+        int next[2], count = 0;
+        if (op == OP_JUMP) {
+            next[count++] = insbx(program[i]);
+        } else if (op == OP_LOADBOOL) {
+            next[count++] = boolnext(program, i);
+        } else if (op != OP_RETURN) {
+            next[count++] = i + 1;
+            if (isskip(op)) {
+                next[count++] = i + 2;
+            }
+        }
+        for (int n = 0; n != count; ++n) {
+            if (next[n] < size && !live[next[n]]) {
+                live[next[n]] = 1;
+                stack[top++] = next[n];
+            }
+        }
+    }
+}
+
+/* Counts the jumps, skips and bool loads that land on each instruction */
+static void findtargets(Instruction* program, int size, int* refs)
+{
+    memset(refs, 0, sizeof(int) * size);
+    for (int i = 0; i != size; ++i) {
+        int op = insop(program[i]);
+        if (op == OP_JUMP && insbx(program[i]) < size) {
+            ++refs[insbx(program[i])];
+        } else if (op == OP_LOADBOOL && boolnext(program, i) < size) {
+            ++refs[boolnext(program, i)];
+        } else if (isskip(op) && i + 2 < size) {
+            ++refs[i + 2];
+        }
+    }
+}
+
+/*
+** Turns a comparison that jumps over the jump it skips to:
+**     compare A  ->  JUMP next  ->  JUMP L  ->  next:
+** into the inverted comparison that jumps to L itself:
+**     compare !A  ->  JUMP L  ->  next:
+*/
+static void invertjumps(Instruction* program, int size, char* keep, const int* refs)
+{
+    for (int i = 0; i + 3 < size; ++i) {
+        if (!keep[i] || !isskip(insop(program[i]))
+            || insop(program[i + 1]) != OP_JUMP || insop(program[i + 2]) != OP_JUMP
+            || insbx(program[i + 1]) != i + 3 || refs[i + 1] != 0 || refs[i + 2] != 1) {
+            continue;
+        }
+        program[i] = setinsa(program[i], !insa(program[i]));
+        program[i + 1] = program[i + 2];
+        keep[i + 2] = 0;
+    }
+}
+
+/*
+** Removes moves that aren't needed:
+** - moves from a register to itself
+** - results written to a temporary only to be moved somewhere else,
+**   which are written to the destination directly instead
+*/
+static void removemoves(Instruction* program, int size, char* keep, const int* refs, const int* declared)
+{
+    for (int i = 0; i != size; ++i) {
+        Instruction ins = program[i];
+        if (!keep[i] || insop(ins) != OP_MOVE) {
+            continue;
+        }
+        int dest = insa(ins), src = insb(ins);
+        if (dest == src) {
+            keep[i] = 0;
+        } else if (i > 0 && keep[i - 1] && refs[i] == 0 && istemp(declared, src, i)
+            && iswriter(insop(program[i - 1])) && insa(program[i - 1]) == src) {
+            program[i - 1] = setinsa(program[i - 1], dest);
+            keep[i] = 0;
+        }
+    }
+}
+
+/*
+** Removes jumps to the next instruction that's kept.
+** Jumps right after a comparison stay, since the comparison skips them.
+*/
+static void removenextjumps(Instruction* program, int size, char* keep)
+{
+    int prev = -1;
+    for (int i = 0; i != size; ++i) {
+        if (!keep[i]) {
+            continue;
+        }
+        if (insop(program[i]) == OP_JUMP && (prev == -1 || !isskip(insop(program[prev])))) {
+            int next = i + 1;
+            while (next < size && !keep[next]) {
+                ++next;
+            }
+            if (insbx(program[i]) == next) {
+                keep[i] = 0;
+                continue;
+            }
+        }
+        prev = i;
+    }
+}
+
+/*
+** Drops the instructions that aren't kept, retargeting jumps.
+** Jumps to a removed instruction go to the next one that's kept.
+** Returns the new program size.
+*/
+static int compact(Instruction* program, int size, const char* keep, int* newidx)
+{
+    int n = 0;
+    for (int i = 0; i != size; ++i) {
+        newidx[i] = n;
+        n += keep[i];
+    }
+    newidx[size] = n;
+    n = 0;
+    for (int i = 0; i != size; ++i) {
+        if (!keep[i]) {
+            continue;
+        }
+        Instruction ins = program[i];
+        switch (insop(ins))
+        {
+            case OP_JUMP:
+                ins = setinsbx(ins, newidx[insbx(ins)]);
+                break;
+            case OP_LOADBOOL:
+                ins = setinsc(ins, newidx[boolnext(program, i)] - n - 1);
+                break;
+        }
+        program[n++] = ins;
+    }
+    return n;
+}
+
+/* Adds [v] to the line table, 7 bits a byte with the top bit set on all but the last */
+static void putvarint(unsigned char* table, int* size, unsigned int v)
+{
+    while (v >= 0x80) {
+        table[(*size)++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    table[(*size)++] = (unsigned char)v;
+}
+
+/* Reads back a number written by putvarint */
+static unsigned int getvarint(const unsigned char* table, int* at)
+{
+    unsigned int v = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char b = table[(*at)++];
+        v |= (unsigned int)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+}
+
+/* Writes a run of [count] instructions on [line], as a count and a zigzagged delta */
+static void putrun(Parser* p, int count, int line)
+{
+    if (p->ln.size + 10 > p->lr) {
+        p->lr *= 2;
+        p->lines = realloc(p->lines, p->lr);
+    }
+    int delta = line - p->ln.last;
+    putvarint(p->lines, &p->ln.size, count);
+    putvarint(p->lines, &p->ln.size, delta < 0 ? ((unsigned int)-delta << 1) - 1 : (unsigned int)delta << 1);
+    p->ln.last = line;
+}
+
+/* Writes the run still being added to, unless it's empty */
+static void closeline(Parser* p)
+{
+    if (p->ps != p->ln.start) {
+        putrun(p, p->ps - p->ln.start, p->ln.line);
+    }
+}
+
+/*
+** Moves the line table along with the instructions after compact.
+** Runs that lost all their instructions are dropped, merging their neighbours
+** if those are on the same line. It's rewritten in place, which is safe since
+** a run never needs more bytes than the ones it was made from.
+*/
+static void movelines(Parser* p, const int* newidx)
+{
+    int size = p->ln.size, at = 0, start = 0, line = 0;
+    int count = 0, pending = 0; // Run not written yet, in case the next one joins it
+    p->ln.size = 0;
+    p->ln.last = 0;
+    while (at != size) {
+        int end = start + (int)getvarint(p->lines, &at);
+        unsigned int delta = getvarint(p->lines, &at);
+        line += delta & 1 ? -(int)((delta + 1) >> 1) : (int)(delta >> 1);
+        int moved = newidx[end] - newidx[start];
+        start = end;
+        if (moved == 0) {
+            continue;
+        }
+        if (count != 0 && pending != line) {
+            putrun(p, count, pending);
+            count = 0;
+        }
+        count += moved;
+        pending = line;
+    }
+    if (count != 0) {
+        putrun(p, count, pending);
+    }
+}
+
+/* Runs the peephole optimizer, returning the new program size */
+static int optimize(Parser* p)
+{
+    Instruction* program = p->fn->program;
+    int size = p->ps, registers = p->fn->registers;
+    int* declared = malloc(sizeof(int) * registers);
+    for (int r = 0; r != registers; ++r) {
+        declared[r] = size;
+    }
+    for (Local* l = p->locals; l != NULL; l = l->prev) {
+        if (l->pc < declared[l->idx]) {
+            declared[l->idx] = l->pc;
+        }
+    }
+    char* keep = malloc(size);
+    int* refs = malloc(sizeof(int) * size);
+    int* scratch = malloc(sizeof(int) * (size + 1));
+
+    // Simplify control flow, then throw away what can't be reached
+    foldbools(program, size, declared);
+    threadjumps(program, size);
+    reachable(program, size, keep, scratch);
+    int newsize = compact(program, size, keep, scratch);
+    movelines(p, scratch);
+    for (int r = 0; r != registers; ++r) {
+        declared[r] = scratch[declared[r]];
+    }
+    size = newsize;
+
+    // Then clean up what's left
+    memset(keep, 1, size);
+    findtargets(program, size, refs);
+    invertjumps(program, size, keep, refs);
+    removemoves(program, size, keep, refs, declared);
+    removenextjumps(program, size, keep);
+    size = compact(program, size, keep, scratch);
+    movelines(p, scratch);
+
+    free(declared);
+    free(keep);
+    free(refs);
+    free(scratch);
+    return size;
+}
+
+/*
+** Shrinks the function's vectors and deallocates locals,
+** declarations and the parser's pool maps.
 ** Returns the finalized function.
 */
 static bt_Function* finalize(Parser* p)
 {
     bt_Function* fn = p->fn;
+    CompileInfo* info = ctx_compileinfo(p->ctx);
+    info->emitted += p->ps;
+    closeline(p);
+    // Every jump target and constant index has to fit in arg BX, and registers and keys in 8 bits
+    Parser* top = p;
+    while (top->outer != NULL) {
+        top = top->outer;
+    }
+    if ((Instruction)p->ps > BX_MAX + 1 || (Instruction)p->cs > BX_MAX + 1
+        || fn->registers > 0x100 || p->ks > 0x100) {
+        top->failed = 1;
+    }
+    if (info->peephole && !top->failed) {
+        int size = optimize(p);
+        info->removed += p->ps - size;
+        p->ps = size;
+    }
+    fusejumps(p);
+    fn->lines = realloc(p->lines, p->ln.size);
+    fn->linesize = p->ln.size;
     fn->program = realloc(fn->program, sizeof(Instruction) * p->ps);
+    fn->progcount = p->ps;
     fn->constants = realloc(fn->constants, sizeof(bt_Value) * p->cs);
+    fn->constcount = p->cs;
     fn->keys = realloc(fn->keys, sizeof(Key*) * p->ks);
+    fn->keycount = p->ks;
+    profile_init(fn);
+    initcaches(fn);
+    if (info->jit && !top->failed) {
+        jit_compile(p->ctx, fn);
+    }
+    free(p->kmap.slots);
+    free(p->cmap.slots);
     Local* l = p->locals;
     while (l != NULL) {
         Local* temp = l->prev;
         free(l);
         l = temp;
     }
+    FuncDecl* f = p->funcs;
+    while (f != NULL) {
+        FuncDecl* temp = f->prev;
+        free(f);
+        f = temp;
+    }
     return fn;
 }
 
@@ -72,6 +608,12 @@ static bt_Function* finalize(Parser* p)
 static void addop(Parser* p, Instruction i)
 {
     bt_Function* fn = p->fn;
+    int line = lex_line(p->lx);
+    if (line != p->ln.line) {
+        closeline(p);
+        p->ln.start = p->ps;
+        p->ln.line = line;
+    }
     fn->program[p->ps++] = i;
     if (p->ps == p->pr) {
         p->pr *= 2;
@@ -79,10 +621,17 @@ static void addop(Parser* p, Instruction i)
     }
 }
 
+/* Throws away the code emitted from [ps] on, putting the line table back to [lines] */
+static void discard(Parser* p, int ps, const LineState* lines)
+{
+    p->ps = ps;
+    p->ln = *lines;
+}
+
 /* Some shortcuts */
-#define arga(a)  ((a) << 8)
-#define argb(b)  ((b) << 16)
-#define argc(c)  ((c) << 24)
+#define arga(a)  ((Instruction)(a) << 8)
+#define argb(b)  ((Instruction)(b) << 16)
+#define argc(c)  ((Instruction)(c) << 24)
 
 /* Returns the index of an empty instruction to be set later */
 static inline int reserve(Parser* p)
@@ -100,10 +649,58 @@ static inline int reserve(Parser* p)
 */
 #define setdest(p, d) p->fn->program[p->ps - 1] |= ((d) << 8)
 
-/* Adds an FData to the result, returning the index of the item */
+/* Hashes a constant by its type and bits */
+static unsigned long consthash(bt_Value vl)
+{
+    unsigned long hash = vtype(vl);
+    if (vtype(vl) == VT_NUMBER) {
+        BT_NUMBER n = tonumber(vl);
+        unsigned char bytes[sizeof(BT_NUMBER)];
+        memcpy(bytes, &n, sizeof(n));
+        for (size_t i = 0; i != sizeof(bytes); ++i) {
+            hash = hash * 31 + bytes[i];
+        }
+    } else if (vtype(vl) == VT_BOOL) {
+        hash = hash * 31 + toboolean(vl);
+    } else if (vtype(vl) == VT_CLOSURE) {
+        hash = hash * 31 + (unsigned long)(uintptr_t)toclosure(vl);
+    }
+    return hash;
+}
+
+/*
+** Checks if two constants are the same.
+** Numbers are compared bit for bit, so 0 and -0 stay apart.
+*/
+static int sameconst(bt_Value a, bt_Value b)
+{
+    if (vtype(a) != vtype(b)) {
+        return 0;
+    }
+    switch (vtype(a))
+    {
+        case VT_NUMBER: {
+            BT_NUMBER x = tonumber(a), y = tonumber(b);
+            return memcmp(&x, &y, sizeof(x)) == 0;
+        }
+        case VT_BOOL: return toboolean(a) == toboolean(b);
+        case VT_CLOSURE: return toclosure(a) == toclosure(b);
+        default: return 1;
+    }
+}
+
+/* Adds a constant to the result if it isn't there already, returning the index */
 static int addconstant(Parser* p, bt_Value vl)
 {
     bt_Function* fn = p->fn;
+    unsigned long hash = consthash(vl);
+    PoolMap* m = &p->cmap;
+    for (int i = hash & m->mask; m->slots[i].idx != -1; i = (i + 1) & m->mask) {
+        if (m->slots[i].hash == hash && sameconst(fn->constants[m->slots[i].idx], vl)) {
+            return m->slots[i].idx;
+        }
+    }
+    pooladd(m, hash, p->cs);
     fn->constants[p->cs++] = vl;
     if (p->cs == p->cr) {
         p->cr *= 2;
@@ -112,11 +709,25 @@ static int addconstant(Parser* p, bt_Value vl)
     return p->cs - 1;
 }
 
-/* Adds a key to the result, returning the index */
-static int addkey(Parser* p, const char* skey)
+/* Interns the identifier the lexer just scanned */
+static Key* getname(Parser* p)
+{
+    int length;
+    const char* text = lex_gettext(p->lx, &length);
+    return ctx_getkey(p->ctx, text, length);
+}
+
+/* Adds a key to the result if it isn't there already, returning the index */
+static int addkey(Parser* p, Key* key)
 {
-    Key* key = ctx_getkey(p->ctx, skey);
     bt_Function* fn = p->fn;
+    PoolMap* m = &p->kmap;
+    for (int i = key->hash & m->mask; m->slots[i].idx != -1; i = (i + 1) & m->mask) {
+        if (fn->keys[m->slots[i].idx] == key) {
+            return m->slots[i].idx;
+        }
+    }
+    pooladd(m, key->hash, p->ks);
     fn->keys[p->ks++] = key;
     if (p->ks == p->kr) {
         p->kr *= 2;
@@ -129,11 +740,11 @@ static int addkey(Parser* p, const char* skey)
 ** Searches for a local variable in the parser's list.
 ** Returns NULL if it doesn't exist.
 */
-static Local* findlocal(Parser* p, const char* name)
+static Local* findlocal(Parser* p, Key* name)
 {
     Local* l = p->locals;
     while (l != NULL) {
-        if (strcmp(l->name, name) == 0) {
+        if (l->name == name) {
             return l;
         }
         l = l->prev;
@@ -141,15 +752,44 @@ static Local* findlocal(Parser* p, const char* name)
     return NULL;
 }
 
+/*
+** Searches for a function declared in this function or any it's nested in.
+** Returns NULL if there isn't one.
+*/
+static bt_Closure* findfunc(Parser* p, Key* name)
+{
+    for (; p != NULL; p = p->outer) {
+        for (FuncDecl* f = p->funcs; f != NULL; f = f->prev) {
+            if (f->name == name) {
+                return f->closure;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+** Moves on to the next empty register.
+** Temporaries are written to the first empty register, so the function
+** needs one register past the highest it ever reaches.
+*/
+static void pushreg(Parser* p)
+{
+    if (++p->emptyreg >= p->fn->registers) {
+        p->fn->registers = p->emptyreg + 1;
+    }
+}
+
 /*
 ** Creates a new local and adds it to the parser's list
 ** Returns the index of the local's register
 */
-static int newlocal(Parser* p, const char* name)
+static int newlocal(Parser* p, Key* name)
 {
-    Local* l = malloc(sizeof(Local) + strlen(name) + 1);
-    strcpy(l->name, name);
+    Local* l = malloc(sizeof(Local));
+    l->name = name;
     l->idx = p->emptyreg; // New locals use the first empty register
+    l->pc = p->ps;
     l->prev = p->locals;
     l->scope = 0;
     p->locals = l;
@@ -165,20 +805,42 @@ static void addpatch(Parser* p, int* list)
     *list = p->ps - 1;
 }
 
-static void patchhere(Parser* p, int* list)
+static void patchto(Parser* p, int* list, int target)
 {
     int l = *list;
     if (l != NO_PATCHES) {
         int op;
         do {
             op = p->fn->program[l];
-            p->fn->program[l] = OP_JUMP | argb(p->ps);
+            p->fn->program[l] = OP_JUMP | argb(target);
             l = op;
         } while (op != LAST_PATCH);
         *list = NO_PATCHES;
     }
 }
 
+/* Appends patch list [other] to [list] */
+static void joinpatches(Parser* p, int* list, int other)
+{
+    if (other == NO_PATCHES) {
+        return;
+    }
+    if (*list == NO_PATCHES) {
+        *list = other;
+        return;
+    }
+    int l = *list;
+    while (p->fn->program[l] != LAST_PATCH) {
+        l = p->fn->program[l];
+    }
+    p->fn->program[l] = other;
+}
+
+static inline void patchhere(Parser* p, int* list)
+{
+    patchto(p, list, p->ps);
+}
+
 static void patchbool(Parser* p, int* list, int dest, int b)
 {
     int l = *list;
@@ -244,6 +906,7 @@ static void initexp(ExpData* e, int t)
 }
 
 static void exprclimb(Parser* p, ExpData* lhs, int min);
+static void call(Parser* p, ExpData* e);
 
 static inline void expression(Parser* p, ExpData* e)
 {
@@ -295,11 +958,18 @@ static void anyreg(Parser* p, ExpData* e)
     }
 }
 
+/*
+** Encodes an operand that can be a register or a constant.
+** Args B and C only have 8 bits, so a constant past the first 256 is
+** loaded into the first empty register, which is where anything else
+** that isn't in a register already would have gone too.
+*/
 static void toargk(Parser* p, ExpData* e, int* k, int* idx)
 {
-    if (e->type == EX_CONST) {
+    int c = e->type == EX_CONST ? addconstant(p, e->value) : 0;
+    if (e->type == EX_CONST && c <= 0xFF) {
         *k = 1;
-        *idx = addconstant(p, e->value);
+        *idx = c;
     } else {
         *k = 0;
         if (e->type == EX_REG) {
@@ -311,18 +981,18 @@ static void toargk(Parser* p, ExpData* e, int* k, int* idx)
     }
 }
 
-static int argkb(Parser* p, ExpData* e)
+static Instruction argkb(Parser* p, ExpData* e)
 {
     int k, idx;
     toargk(p, e, &k, &idx);
-    return (k << 6) | (idx << 16);
+    return ((Instruction)k << 6) | ((Instruction)idx << 16);
 }
 
-static int argkc(Parser* p, ExpData* e)
+static Instruction argkc(Parser* p, ExpData* e)
 {
     int k, idx;
     toargk(p, e, &k, &idx);
-    return (k << 7) | (idx << 24);
+    return ((Instruction)k << 7) | ((Instruction)idx << 24);
 }
 
 /*
@@ -345,6 +1015,93 @@ static void invert(Parser* p)
     p->fn->program[p->ps - 1] = ins;
 }
 
+/*
+** Looks up a name: locals first, then declared functions.
+** Names that are neither are nil.
+*/
+static void variable(Parser* p, Key* name, ExpData* e)
+{
+    Local* l = findlocal(p, name);
+    if (l != NULL) {
+        initexp(e, EX_REG);
+        e->reg = l->idx;
+        return;
+    }
+    bt_Closure* cl = findfunc(p, name);
+    initexp(e, EX_CONST);
+    e->value = cl != NULL ? closure(cl) : nil();
+}
+
+/* Array and vector operations that are called like functions, but compile to one instruction */
+static const struct {
+    const char* name;
+    int op;
+    int args; // The first of two goes in arg B, the last in arg C
+} builtins[] = {
+    { "array", OP_NEWARRAY, 1 },
+    { "sum", OP_SUM, 1 },
+    { "dot", OP_DOT, 2 },
+    { "scale", OP_SCALE, 2 },
+    { "add", OP_ADDARRAY, 2 },
+#ifdef BT_VECTORS
+    { "vec2", OP_VEC, 2 },
+    { "vec3", OP_VEC, 3 },
+    { "vec4", OP_VEC, 4 },
+#endif
+};
+
+/*
+** Compiles a call to built-in [name], with the opening parenthesis next.
+** Locals and declared functions shadow the built-ins, so this returns 0
+** without consuming anything if [name] is one of those or no built-in.
+*/
+static int builtin(Parser* p, Key* name, ExpData* e)
+{
+    int b = 0, count = sizeof(builtins) / sizeof(builtins[0]);
+    while (b != count && strcmp(name->text, builtins[b].name) != 0) {
+        ++b;
+    }
+    if (b == count || findlocal(p, name) != NULL || findfunc(p, name) != NULL) {
+        return 0;
+    }
+    expect(p, '(');
+    ExpData arg;
+    Instruction inst = builtins[b].op;
+    if (inst == OP_VEC) {
+        // Components go in consecutive registers, like call arguments
+        int base = p->emptyreg;
+        for (int n = 0; n != builtins[b].args; ++n) {
+            if (n != 0) {
+                expect(p, ',');
+            }
+            expression(p, &arg);
+            route(p, &arg, p->emptyreg);
+            pushreg(p);
+        }
+        p->emptyreg = base;
+        inst |= argb(base) | argc(builtins[b].args);
+        expect(p, ')');
+        addop(p, inst); // Destination will be set later
+        initexp(e, EX_ROUTE);
+        return 1;
+    }
+    expression(p, &arg);
+    if (builtins[b].args == 2) {
+        inst |= argkb(p, &arg);
+        pushreg(p);
+        expect(p, ',');
+        expression(p, &arg);
+        inst |= argkc(p, &arg);
+        --p->emptyreg;
+    } else {
+        inst |= argkc(p, &arg);
+    }
+    expect(p, ')');
+    addop(p, inst); // Destination will be set later
+    initexp(e, EX_ROUTE);
+    return 1;
+}
+
 /*
 ** Smallest unit of parsing.
 ** Literals, function calls, things in parentheses.
@@ -355,33 +1112,74 @@ static void atom(Parser* p, ExpData* e)
     {
         case TK_NUMBER:
             initexp(e, EX_CONST);
-            e->value = (bt_Value) { .number = lex_getnumber(p->lx), .type = VT_NUMBER };
+            e->value = number(lex_getnumber(p->lx));
             break;
         case TK_ID: {
-            initexp(e, EX_REG);
-            const char* name = lex_gettext(p->lx);
-            Local* l = findlocal(p, name);
-            e->reg = l->idx;
+            Key* name = getname(p);
+            if (lex_peek(p->lx) != '(' || !builtin(p, name, e)) {
+                variable(p, name, e);
+            }
             break;
         }
         case '!': {
             atom(p, e);
+            if (e->type == EX_TRUE || e->type == EX_FALSE) {
+                e->type = e->type == EX_TRUE ? EX_FALSE : EX_TRUE; // Folded
+                break;
+            }
             addop(p, OP_NOT | argkc(p, e));
             e->type = EX_ROUTE;
             break;
         }
         case '-': {
             atom(p, e);
+            if (e->type == EX_CONST && isnumber(e->value)) {
+                e->value = number(-tonumber(e->value)); // Folded
+                break;
+            }
             addop(p, OP_NEG | argkc(p, e));
             e->type = EX_ROUTE;
             break;
         }
+        case '#': {
+            atom(p, e);
+            addop(p, OP_LEN | argkc(p, e));
+            e->type = EX_ROUTE;
+            break;
+        }
+        case '[': {
+            // Elements go in the registers after the array's, like call arguments
+            int base = p->emptyreg, count = 0;
+            pushreg(p);
+            if (!accept(p, ']')) {
+                do {
+                    ExpData el;
+                    expression(p, &el);
+                    route(p, &el, p->emptyreg);
+                    pushreg(p);
+                    ++count;
+                } while (accept(p, ','));
+                expect(p, ']');
+            }
+            ExpData length;
+            initexp(&length, EX_CONST);
+            length.value = number(count);
+            addop(p, OP_NEWARRAY | arga(base) | argb(count) | argkc(p, &length));
+            p->emptyreg = base;
+            initexp(e, EX_REG);
+            e->reg = base;
+            break;
+        }
         case '{': {
             initexp(e, EX_ROUTE);
             addop(p, OP_NEWSTRUCT);
             expect(p, '}');
             break;
         }
+        case TK_NIL:
+            initexp(e, EX_CONST);
+            e->value = nil();
+            break;
         case TK_TRUE: initexp(e, EX_TRUE); break;
         case TK_FALSE: initexp(e, EX_FALSE); break;
         case '(': expression(p, e); expect(p, ')'); break;
@@ -393,15 +1191,93 @@ static void atom(Parser* p, ExpData* e)
     for (;;) {
         if (accept(p, '.')) {
             expect(p, TK_ID);
-            int k = addkey(p, lex_gettext(p->lx));
+            int k = addkey(p, getname(p));
             anyreg(p, e);
             addop(p, OP_GETSTRUCT | argb(e->reg) | argc(k));
             e->type = EX_ROUTE;
+        } else if (accept(p, '[')) {
+            Instruction kb = argkb(p, e);
+            pushreg(p);
+            ExpData idx;
+            expression(p, &idx);
+            expect(p, ']');
+            addop(p, OP_GETINDEX | kb | argkc(p, &idx)); // Destination will be set later
+            --p->emptyreg;
+            e->type = EX_ROUTE;
+        } else if (accept(p, '(')) {
+            call(p, e);
         } else
             return;
     }
 }
 
+/*
+** Calls the expression in [e] with the arguments in parentheses,
+** the opening one already accepted. The callee and its arguments go in
+** consecutive registers from the first empty one, which become the bottom
+** of the callee's frame. The result comes back where the callee was.
+*/
+static void call(Parser* p, ExpData* e)
+{
+    int base = p->emptyreg;
+    route(p, e, base);
+    pushreg(p);
+    int args = 0;
+    if (!accept(p, ')')) {
+        do {
+            ExpData arg;
+            expression(p, &arg);
+            route(p, &arg, p->emptyreg);
+            pushreg(p);
+            ++args;
+        } while (accept(p, ','));
+        expect(p, ')');
+    }
+    addop(p, OP_CALL | arga(base) | argb(args));
+    p->emptyreg = base;
+    initexp(e, EX_REG);
+    e->reg = base;
+}
+
+/*
+** Encodes a binary operator's right hand side.
+** Small integer constants added, subtracted or multiplied
+** go straight into arg C as an immediate instead of the constant table.
+*/
+static Instruction binop(Parser* p, Instruction inst, Instruction kb, ExpData* rhs)
+{
+    if (rhs->type == EX_CONST && isnumber(rhs->value) && (inst == OP_ADD || inst == OP_SUB || inst == OP_MUL)) {
+        BT_NUMBER n = tonumber(rhs->value);
+        if (n >= -128 && n <= 127 && n == (int)n) {
+            Instruction imm = inst == OP_ADD ? OP_ADDI : inst == OP_SUB ? OP_SUBI : OP_MULI;
+            return imm | kb | argc((int)n & 0xFF);
+        }
+    }
+    return inst | kb | argkc(p, rhs);
+}
+
+/*
+** Evaluates a binary operator on two number constants at compile time.
+** Comparisons carry the result they test for in arg A, just like the
+** instruction would at runtime.
+*/
+static void foldbinop(ExpData* lhs, Instruction inst, ExpData* rhs)
+{
+    BT_NUMBER l = tonumber(lhs->value), r = tonumber(rhs->value);
+    int result;
+    switch (inst & 0x3F)
+    {
+        case OP_ADD: lhs->value = number(l + r); return;
+        case OP_SUB: lhs->value = number(l - r); return;
+        case OP_MUL: lhs->value = number(l * r); return;
+        case OP_DIV: lhs->value = number(l / r); return;
+        case OP_EQUAL:  result = l == r; break;
+        case OP_LEQUAL: result = l <= r; break;
+        default:        result = l < r; break; // OP_LESS
+    }
+    initexp(lhs, result == ((inst >> 8) & 1) ? EX_TRUE : EX_FALSE);
+}
+
 // You should probably find a more elegent way to do this my dude
 enum OpType {
     OPT_BIN,
@@ -444,12 +1320,28 @@ static void exprclimb(Parser* p, ExpData* lhs, int min)
         if (prec >= min) {
             lex_next(p->lx);
             ExpData rhs;
-            if (ty == OPT_AND) {
+            if (ty != OPT_BIN && (lhs->type == EX_TRUE || lhs->type == EX_FALSE)) {
+                // Constant lhs, so either it decides the result or the rhs does
+                int ps = p->ps;
+                LineState lines = p->ln;
+                exprclimb(p, &rhs, ty == OPT_AND ? 3 : 2);
+                if ((lhs->type == EX_TRUE) == (ty == OPT_OR)) {
+                    discard(p, ps, &lines); // The rhs would never run
+                } else if (rhs.type == EX_TRUE || rhs.type == EX_FALSE) {
+                    *lhs = rhs;
+                } else {
+                    lhs->t = rhs.t;
+                    lhs->f = rhs.f;
+                    checklogic(p, &rhs);
+                    lhs->type = EX_LOGIC;
+                }
+            } else if (ty == OPT_AND) {
                 checklogic(p, lhs);
                 addpatch(p, &lhs->f);
                 patchhere(p, &lhs->t);
                 exprclimb(p, &rhs, 3);
                 lhs->t = rhs.t;
+                joinpatches(p, &lhs->f, rhs.f); // The rhs can be a nested &&
                 checklogic(p, &rhs);
                 lhs->type = EX_LOGIC;
             } else if (ty == OPT_OR) {
@@ -459,13 +1351,33 @@ static void exprclimb(Parser* p, ExpData* lhs, int min)
                 patchhere(p, &lhs->f);
                 exprclimb(p, &rhs, 2);
                 lhs->f = rhs.f;
+                joinpatches(p, &lhs->t, rhs.t); // The rhs can be a nested ||
                 checklogic(p, &rhs);
                 lhs->type = EX_LOGIC;
             } else {
-                int kb = argkb(p, lhs);
-                ++p->emptyreg;
+                // A constant lhs doesn't emit anything, so it can wait to see if the rhs is constant too
+                Instruction kb = lhs->type == EX_CONST ? 0 : argkb(p, lhs);
+                pushreg(p);
                 exprclimb(p, &rhs, prec + 1);
-                addop(p, inst | kb | argkc(p, &rhs)); // Destination will be set later
+                // Only numbers fold, anything else is left to the instruction to compare or reject
+                if (lhs->type == EX_CONST && rhs.type == EX_CONST && isnumbers(lhs->value, rhs.value)) {
+                    --p->emptyreg;
+                    foldbinop(lhs, inst, &rhs);
+                    continue;
+                }
+                if (lhs->type == EX_CONST) {
+                    // A constant that has to be loaded goes in the register kept for it, below the rhs
+                    if (addconstant(p, lhs->value) > 0xFF) {
+                        if (rhs.type != EX_CONST) {
+                            anyreg(p, &rhs);
+                        }
+                        route(p, lhs, p->emptyreg - 1);
+                        lhs->type = EX_REG;
+                        lhs->reg = p->emptyreg - 1;
+                    }
+                    kb = argkb(p, lhs);
+                }
+                addop(p, binop(p, inst, kb, &rhs)); // Destination will be set later
                 --p->emptyreg;
                 lhs->type = ex;
             }
@@ -482,28 +1394,82 @@ static void exprclimb(Parser* p, ExpData* lhs, int min)
 
 static void block(Parser* p);
 
+/*
+** Sets an element of the array in register [r], the opening bracket
+** already accepted. [r] is kept out of the way of the index and value.
+*/
+static void setindex(Parser* p, int r)
+{
+    ExpData idx, e;
+    int pushed = r == p->emptyreg;
+    if (pushed) {
+        pushreg(p);
+    }
+    expression(p, &idx);
+    Instruction kb = argkb(p, &idx);
+    pushreg(p);
+    expect(p, ']');
+    expect(p, '=');
+    expression(p, &e);
+    addop(p, OP_SETINDEX | arga(r) | kb | argkc(p, &e));
+    p->emptyreg -= 1 + pushed;
+}
+
 /* Variable set, declaration, or function call */
 static void varstmt(Parser* p)
 {
-    const char* name = lex_gettext(p->lx);
+    Key* name = getname(p);
     Local* l = findlocal(p, name);
     ExpData e;
+    if (lex_peek(p->lx) == '(' && builtin(p, name, &e)) {
+        anyreg(p, &e); // Only run for what it does to an array
+        return;
+    }
+    if (accept(p, '(')) {
+        variable(p, name, &e);
+        call(p, &e);
+        return;
+    }
     if (accept(p, '.')) {
         if (l == NULL) {
             // ERROR
         }
-        int k, r = l->idx;
+        int k, r = l->idx, base = p->emptyreg;
+        int outer = -1, ok = 0; // Where the last link of the chain came from
     AnothaOne:
         expect(p, TK_ID);
-        k = addkey(p, lex_gettext(p->lx));
+        Key* key = getname(p);
+        k = addkey(p, key);
         if (accept(p, '.')) {
             addop(p, OP_GETSTRUCT | arga(p->emptyreg) | argb(r) | argc(k));
+            outer = r;
+            ok = k;
             r = p->emptyreg;
+            pushreg(p); // Kept safe from the rest of the statement
             goto AnothaOne;
         }
+        if (accept(p, '[')) {
+            addop(p, OP_GETSTRUCT | arga(p->emptyreg) | argb(r) | argc(k));
+            setindex(p, p->emptyreg);
+            p->emptyreg = base;
+            return;
+        }
         expect(p, '=');
         expression(p, &e);
         addop(p, OP_SETSTRUCT | arga(r) | argb(k) | argkc(p, &e));
+        // Vectors are values, so one changed inside a struct has to be put back
+        int idx[4];
+        if (outer != -1 && vec_swizzle(key, idx) != 0) {
+            addop(p, OP_SETSTRUCT | arga(outer) | argb(ok) | argc(r));
+        }
+        p->emptyreg = base;
+        return;
+    }
+    if (accept(p, '[')) {
+        if (l == NULL) {
+            // ERROR
+        }
+        setindex(p, l->idx);
         return;
     }
     int dest = l == NULL ? newlocal(p, name) : l->idx; // Local undeclared?
@@ -511,7 +1477,7 @@ static void varstmt(Parser* p)
     expression(p, &e);
     route(p, &e, dest);
     if (l == NULL) {
-        ++p->emptyreg; // Empty register now in use by new local
+        pushreg(p); // Empty register now in use by new local
     }
 }
 
@@ -542,18 +1508,112 @@ static void ifstmt(Parser* p)
     }
 }
 
+/*
+** while loop.
+** The condition is compiled after the body, so each iteration ends
+** with a single compare and jump back to the top:
+**     JUMP cond
+** body:
+**     ...
+** cond:
+**     compare, JUMP body
+** The lexer is rewound to compile the condition once the body is done.
+*/
 static void whileloop(Parser* p)
 {
     ExpData e;
-    int start = p->ps;
-    expression(p, &e);
-    checklogic(p, &e);
+    LexState cond, end;
     int ins = reserve(p);
-    patchhere(p, &e.t);
+    LineState lines = p->ln;
+
+    // Parse the condition once just to skip over it, then throw the code away.
+    // Its constants and keys stay, they'll be found again the second time.
+    lex_save(p->lx, &cond);
+    expression(p, &e);
+    discard(p, ins + 1, &lines);
+
+    int body = p->ps;
     block(p);
-    addop(p, OP_JUMP | argb(start));
     setreserved(p, ins, OP_JUMP | argb(p->ps));
+
+    lex_save(p->lx, &end);
+    lex_restore(p->lx, &cond);
+    expression(p, &e);
+    checklogic(p, &e);
+    invert(p);
+    addop(p, OP_JUMP | argb(body));
+    patchto(p, &e.t, body);
     patchhere(p, &e.f);
+    lex_restore(p->lx, &end);
+}
+
+/*
+** Function declaration.
+** The name is bound before the body is compiled, so it can call itself.
+*/
+static void funcstmt(Parser* p)
+{
+    expect(p, TK_ID);
+    Parser np;
+    initparser(&np, p->ctx, p->lx);
+    np.outer = p;
+    bt_Closure* cl = malloc(sizeof(bt_Closure));
+    cl->function = np.fn;
+    FuncDecl* f = malloc(sizeof(FuncDecl));
+    f->name = getname(p);
+    np.fn->name = f->name;
+    f->closure = cl;
+    f->prev = p->funcs;
+    p->funcs = f;
+
+    // Parameters are the first locals, the caller puts them in place
+    expect(p, '(');
+    if (!accept(p, ')')) {
+        do {
+            expect(p, TK_ID);
+            newlocal(&np, getname(p));
+            pushreg(&np);
+            ++np.fn->params;
+        } while (accept(p, ','));
+        expect(p, ')');
+    }
+    block(&np);
+    addop(&np, OP_RETURN);
+    finalize(&np);
+}
+
+/*
+** Return statement, with a value unless it ends the block.
+** Returning the result of a call makes it a tail call, which still
+** returns normally if the callee turns out to be a generator.
+*/
+static void retstmt(Parser* p)
+{
+    int tk = lex_peek(p->lx);
+    if (tk == '}' || tk == TK_EOF) {
+        addop(p, OP_RETURN);
+        return;
+    }
+    ExpData e;
+    int start = p->ps;
+    expression(p, &e);
+    // The expression ended with a call that left its result where the expression's is
+    if (e.type == EX_REG && p->ps > start) {
+        Instruction* last = &p->fn->program[p->ps - 1];
+        if (insop(*last) == OP_CALL && insa(*last) == e.reg) {
+            *last = (*last & ~0x3F) | OP_TAILCALL;
+        }
+    }
+    addop(p, OP_RETURN | arga(1) | argkc(p, &e));
+}
+
+/* Yield statement, makes the function a generator */
+static void yieldstmt(Parser* p)
+{
+    ExpData e;
+    expression(p, &e);
+    addop(p, OP_YIELD | argkc(p, &e));
+    p->fn->type = FT_GEN;
 }
 
 static void statement(Parser* p)
@@ -563,6 +1623,9 @@ static void statement(Parser* p)
         case TK_ID: varstmt(p); break;
         case TK_IF: ifstmt(p); break;
         case TK_WHILE: whileloop(p); break;
+        case TK_FUNC: funcstmt(p); break;
+        case TK_RET: retstmt(p); break;
+        case TK_YIELD: yieldstmt(p); break;
         case TK_PRINT: {
             ExpData e;
             expression(p, &e);
@@ -590,11 +1653,15 @@ static void block(Parser* p)
 ** ============================================================
 */
 
-/* Compiles a string to a bt_Function */
-BT_API bt_Function* bt_compile(bt_Context* bt, const char* src)
+/*
+** Compiles [length] bytes of source, which doesn't need a null terminator.
+** Returns NULL if a function has more jump targets or constants than
+** arg BX can address, or more than 256 registers or keys.
+*/
+static bt_Function* compile(bt_Context* bt, const char* src, size_t length)
 {
     Parser p;
-    Lexer* lx = lex_new(src);
+    Lexer* lx = lex_new(src, length);
     initparser(&p, bt, lx);
     while (lex_peek(lx) != TK_EOF) {
         statement(&p);
@@ -602,22 +1669,45 @@ BT_API bt_Function* bt_compile(bt_Context* bt, const char* src)
     addop(&p, OP_RETURN);
     lex_free(lx);
     bt_Function* fn = finalize(&p);
+    return p.failed ? NULL : fn;
+}
+
+/* Compiles a string to a bt_Function, NULL if it's too big to encode */
+BT_API bt_Function* bt_compile(bt_Context* bt, const char* src)
+{
+    return compile(bt, src, strlen(src));
+}
+
 /*
-    for (int i = 0; i != p.ps; ++i) {
-        int op = fn->program[i];
-        printf("|%i| %i %i %i %i\n", i, op & 0x3f, (op >> 8) & 0xff, (op >> 16) & 0xff, (op >> 24));
-    }
-    printf("registers: %i\n", fn->registers);
+** Loads a file and compiles it.
+** The file is mapped and scanned in place rather than read into a buffer.
+** Returns NULL if the file can't be opened or is too big to encode.
 */
+BT_API bt_Function* bt_fcompile(bt_Context* bt, const char* path)
+{
+    size_t size;
+    char* src = map_open(path, &size);
+    if (src == NULL) {
+        return NULL;
+    }
+    bt_Function* fn = compile(bt, src, size);
+    map_close(src, size);
     return fn;
 }
 
-/* Loads a file and compiles it */
-BT_API bt_Function* bt_fcompile(bt_Context* bt, const char* path)
+/*
+** Turns the peephole optimizer on or off for functions compiled from now on.
+** It's on by default.
+*/
+BT_API void bt_peephole(bt_Context* bt, int enabled)
 {
-    char buffer[512 + 1]; // BAD, FIX IT YOU FUCK
-    FILE* file = fopen(path, "r");
-    size_t size = fread(buffer, 1, 512, file);
-    buffer[size] = 0;
-    return bt_compile(bt, buffer);
-}
\ No newline at end of file
+    ctx_compileinfo(bt)->peephole = enabled;
+}
+
+/* Retrieves how many instructions were compiled and how many of them the optimizer removed */
+BT_API void bt_optstats(bt_Context* bt, unsigned long* emitted, unsigned long* removed)
+{
+    CompileInfo* info = ctx_compileinfo(bt);
+    *emitted = info->emitted;
+    *removed = info->removed;
+}
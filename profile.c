@@ -0,0 +1,633 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#if defined(BT_SAMPLE) && !defined(_WIN32)
+#include <signal.h>
+#include <sys/time.h>
+#define BT_SIGPROF
+#endif
+
+#include "bullet_train.h"
+#include "function.h"
+#include "context.h"
+#include "profile.h"
+#include "thread.h"
+
+/*
+** Instruction profiles, listings and samples.
+** With BT_PROFILE every function counts how many times each of its
+** instructions ran and the cycles spent in them, and the context does the
+** same for each opcode. Listings work in any build, they just leave the
+** counts out without it.
+** With BT_SAMPLE the running script's stack is sampled on SIGPROF instead,
+** which only costs the interpreter a store on every instruction.
+*/
+
+/* How an opcode's arguments are listed */
+enum {
+    ARGS_NONE,
+    ARGS_A, // A
+    ARGS_LOAD, // A, constant BX
+    ARGS_MOVE, // A, register BX
+    ARGS_BOOL, // A, value B, skip C
+    ARGS_GET, // A, struct B, key C
+    ARGS_SET, // Struct A, key B, value C
+    ARGS_ABC, // A, B, C
+    ARGS_IMM, // A, B, immediate C
+    ARGS_AC, // A, C
+    ARGS_COMPARE, // Expected result A, B, C
+    ARGS_TEST, // Expected result A, C
+    ARGS_C, // C
+    ARGS_CALL, // A, B arguments
+    ARGS_ARRAY, // A, B elements, length C
+    ARGS_VEC, // A, C components from B
+    ARGS_JUMP, // Target BX
+    ARGS_RET // C if A is set
+};
+
+typedef struct OpInfo {
+    const char* name;
+    int args;
+} OpInfo;
+
+static const OpInfo opinfo[] = {
+    [OP_LOAD] = { "LOAD", ARGS_LOAD },
+    [OP_LOADBOOL] = { "LOADBOOL", ARGS_BOOL },
+    [OP_NEWSTRUCT] = { "NEWSTRUCT", ARGS_A },
+    [OP_GETSTRUCT] = { "GETSTRUCT", ARGS_GET },
+    [OP_SETSTRUCT] = { "SETSTRUCT", ARGS_SET },
+    [OP_MOVE] = { "MOVE", ARGS_MOVE },
+    [OP_ADD] = { "ADD", ARGS_ABC },
+    [OP_SUB] = { "SUB", ARGS_ABC },
+    [OP_MUL] = { "MUL", ARGS_ABC },
+    [OP_DIV] = { "DIV", ARGS_ABC },
+    [OP_ADDI] = { "ADDI", ARGS_IMM },
+    [OP_SUBI] = { "SUBI", ARGS_IMM },
+    [OP_MULI] = { "MULI", ARGS_IMM },
+    [OP_NEG] = { "NEG", ARGS_AC },
+    [OP_NOT] = { "NOT", ARGS_AC },
+    [OP_EQUAL] = { "EQUAL", ARGS_COMPARE },
+    [OP_LEQUAL] = { "LEQUAL", ARGS_COMPARE },
+    [OP_LESS] = { "LESS", ARGS_COMPARE },
+    [OP_TEST] = { "TEST", ARGS_TEST },
+    [OP_JEQUAL] = { "JEQUAL", ARGS_COMPARE },
+    [OP_JLEQUAL] = { "JLEQUAL", ARGS_COMPARE },
+    [OP_JLESS] = { "JLESS", ARGS_COMPARE },
+    [OP_JTEST] = { "JTEST", ARGS_TEST },
+    [OP_JUMP] = { "JUMP", ARGS_JUMP },
+    [OP_CALL] = { "CALL", ARGS_CALL },
+    [OP_TAILCALL] = { "TAILCALL", ARGS_CALL },
+    [OP_YIELD] = { "YIELD", ARGS_C },
+    [OP_PRINT] = { "PRINT", ARGS_C },
+    [OP_RETURN] = { "RETURN", ARGS_RET },
+    [OP_NEWARRAY] = { "NEWARRAY", ARGS_ARRAY },
+    [OP_GETINDEX] = { "GETINDEX", ARGS_ABC },
+    [OP_SETINDEX] = { "SETINDEX", ARGS_ABC },
+    [OP_LEN] = { "LEN", ARGS_AC },
+    [OP_SUM] = { "SUM", ARGS_AC },
+    [OP_DOT] = { "DOT", ARGS_ABC },
+    [OP_SCALE] = { "SCALE", ARGS_ABC },
+    [OP_ADDARRAY] = { "ADDARRAY", ARGS_ABC },
+    [OP_VEC] = { "VEC", ARGS_VEC },
+    [OP_ADDNN] = { "ADDNN", ARGS_ABC },
+    [OP_ADDNK] = { "ADDNK", ARGS_ABC },
+    [OP_SUBNN] = { "SUBNN", ARGS_ABC },
+    [OP_SUBNK] = { "SUBNK", ARGS_ABC },
+    [OP_MULNN] = { "MULNN", ARGS_ABC },
+    [OP_MULNK] = { "MULNK", ARGS_ABC },
+    [OP_DIVNN] = { "DIVNN", ARGS_ABC },
+    [OP_DIVNK] = { "DIVNK", ARGS_ABC },
+    [OP_ADDIN] = { "ADDIN", ARGS_IMM },
+    [OP_SUBIN] = { "SUBIN", ARGS_IMM },
+    [OP_MULIN] = { "MULIN", ARGS_IMM },
+    [OP_EQUALNN] = { "EQUALNN", ARGS_COMPARE },
+    [OP_EQUALNK] = { "EQUALNK", ARGS_COMPARE },
+    [OP_LEQUALNN] = { "LEQUALNN", ARGS_COMPARE },
+    [OP_LEQUALNK] = { "LEQUALNK", ARGS_COMPARE },
+    [OP_LESSNN] = { "LESSNN", ARGS_COMPARE },
+    [OP_LESSNK] = { "LESSNK", ARGS_COMPARE },
+    [OP_JEQUALNN] = { "JEQUALNN", ARGS_COMPARE },
+    [OP_JEQUALNK] = { "JEQUALNK", ARGS_COMPARE },
+    [OP_JLEQUALNN] = { "JLEQUALNN", ARGS_COMPARE },
+    [OP_JLEQUALNK] = { "JLEQUALNK", ARGS_COMPARE },
+    [OP_JLESSNN] = { "JLESSNN", ARGS_COMPARE },
+    [OP_JLESSNK] = { "JLESSNK", ARGS_COMPARE }
+};
+
+#define OPCODES ((int)(sizeof(opinfo) / sizeof(opinfo[0])))
+
+/*
+** ============================================================
+** Counters
+** ============================================================
+*/
+
+#ifdef BT_PROFILE
+/* Gives a new function its counters, all 0 */
+void profile_init(bt_Function* fn)
+{
+    fn->counts = malloc(sizeof(*fn->counts) * fn->progcount);
+    fn->cycles = malloc(sizeof(*fn->cycles) * fn->progcount);
+    for (int i = 0; i != fn->progcount; ++i) {
+        atomic_init(&fn->counts[i], 0);
+        atomic_init(&fn->cycles[i], 0);
+    }
+}
+
+void profile_free(bt_Function* fn)
+{
+    free(fn->counts);
+    free(fn->cycles);
+}
+#endif
+
+/*
+** Gets how many times opcode [op] was dispatched and the cycles spent in it.
+** Both are 0 in builds without BT_PROFILE.
+** Returns the opcode's name, or NULL once [op] is past the last opcode, so
+** the table can be read by counting up from 0.
+*/
+BT_API const char* bt_profile_opcode(bt_Context* bt, int op, unsigned long* count, unsigned long long* cycles)
+{
+    if (op < 0 || op >= OPCODES) {
+        return NULL;
+    }
+#ifdef BT_PROFILE
+    ProfileInfo* info = ctx_profileinfo(bt);
+    *count = info->counts[op];
+    *cycles = info->cycles[op];
+#else
+    *count = 0;
+    *cycles = 0;
+#endif
+    return opinfo[op].name;
+}
+
+/*
+** Gets how many times the instruction at offset [at] of the function's
+** program ran and the cycles spent in it. Both are 0 without BT_PROFILE.
+** Returns 0 once [at] is past the end of the program.
+*/
+BT_API int bt_profile_instruction(bt_Function* fn, int at, unsigned long* count, unsigned long long* cycles)
+{
+    if (at < 0 || at >= fn->progcount) {
+        return 0;
+    }
+#ifdef BT_PROFILE
+    *count = fn->counts[at];
+    *cycles = fn->cycles[at];
+#else
+    *count = 0;
+    *cycles = 0;
+#endif
+    return 1;
+}
+
+/* Every function a listing covers, in the order they're listed */
+typedef struct FuncList {
+    bt_Function** functions;
+    int count, size;
+} FuncList;
+
+/* Finds a function's position in the list, -1 if it isn't there */
+static int listindex(FuncList* l, bt_Function* fn)
+{
+    for (int i = 0; i != l->count; ++i) {
+        if (l->functions[i] == fn) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Adds a function to the list, then every function its closures refer to */
+static void listcollect(FuncList* l, bt_Function* fn)
+{
+    if (listindex(l, fn) != -1) {
+        return;
+    }
+    if (l->count == l->size) {
+        l->size = l->size == 0 ? 4 : l->size * 2;
+        l->functions = realloc(l->functions, sizeof(bt_Function*) * l->size);
+    }
+    l->functions[l->count++] = fn;
+    for (int i = 0; i != fn->constcount; ++i) {
+        if (vtype(fn->constants[i]) == VT_CLOSURE) {
+            listcollect(l, toclosure(fn->constants[i])->function);
+        }
+    }
+}
+
+/*
+** Zeroes the opcode counters, and the counters of [fn] and every function
+** its closures refer to if it isn't NULL.
+** Nothing should be running while they're reset.
+*/
+BT_API void bt_profile_reset(bt_Context* bt, bt_Function* fn)
+{
+#ifdef BT_PROFILE
+    ProfileInfo* info = ctx_profileinfo(bt);
+    for (int i = 0; i != OPCODES; ++i) {
+        info->counts[i] = 0;
+        info->cycles[i] = 0;
+    }
+    if (fn == NULL) {
+        return;
+    }
+    FuncList l = { NULL, 0, 0 };
+    listcollect(&l, fn);
+    for (int i = 0; i != l.count; ++i) {
+        for (int j = 0; j != l.functions[i]->progcount; ++j) {
+            l.functions[i]->counts[j] = 0;
+            l.functions[i]->cycles[j] = 0;
+        }
+    }
+    free(l.functions);
+#endif
+}
+
+/*
+** ============================================================
+** Listings
+** ============================================================
+*/
+
+/* Adds formatted text to the end of [out], cutting it short if it doesn't fit */
+static void append(char* out, size_t size, const char* format, ...)
+{
+    size_t length = strlen(out);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(out + length, size - length, format, args);
+    va_end(args);
+}
+
+/* Adds register or constant [idx], depending on [k] */
+static void listrk(FuncList* l, bt_Function* fn, int k, int idx, char* out, size_t size)
+{
+    if (!k) {
+        append(out, size, " r%d", idx);
+        return;
+    }
+    bt_Value v = fn->constants[idx];
+    switch (vtype(v))
+    {
+        case VT_NUMBER: append(out, size, " %g", (double)tonumber(v)); break;
+        case VT_BOOL: append(out, size, " %s", toboolean(v) ? "true" : "false"); break;
+        case VT_CLOSURE: append(out, size, " <function %d>", listindex(l, toclosure(v)->function)); break;
+        default: append(out, size, " nil"); break;
+    }
+}
+
+/* Writes the arguments of instruction [i] */
+static void listargs(FuncList* l, bt_Function* fn, Instruction i, char* out, size_t size)
+{
+    int a = (i >> 8) & 0xFF, b = (i >> 16) & 0xFF, c = (int)(i >> 24), bx = (int)(i >> 16);
+    out[0] = '\0';
+    switch (opinfo[i & 0x3F].args)
+    {
+        case ARGS_A: append(out, size, " r%d", a); break;
+        case ARGS_LOAD:
+            append(out, size, " r%d", a);
+            listrk(l, fn, 1, bx, out, size);
+            break;
+        case ARGS_MOVE: append(out, size, " r%d r%d", a, bx); break;
+        case ARGS_BOOL:
+            append(out, size, " r%d %s", a, b ? "true" : "false");
+            if (c != 0) {
+                append(out, size, " skip %d", c);
+            }
+            break;
+        case ARGS_GET: append(out, size, " r%d r%d.%s", a, b, fn->keys[c]->text); break;
+        case ARGS_SET:
+            append(out, size, " r%d.%s", a, fn->keys[b]->text);
+            listrk(l, fn, i & 0x80, c, out, size);
+            break;
+        case ARGS_ABC:
+            append(out, size, " r%d", a);
+            listrk(l, fn, i & 0x40, b, out, size);
+            listrk(l, fn, i & 0x80, c, out, size);
+            break;
+        case ARGS_IMM:
+            append(out, size, " r%d", a);
+            listrk(l, fn, i & 0x40, b, out, size);
+            append(out, size, " %d", (signed char)c);
+            break;
+        case ARGS_AC:
+            append(out, size, " r%d", a);
+            listrk(l, fn, i & 0x80, c, out, size);
+            break;
+        case ARGS_COMPARE:
+            append(out, size, " %s", a ? "true" : "false");
+            listrk(l, fn, i & 0x40, b, out, size);
+            listrk(l, fn, i & 0x80, c, out, size);
+            break;
+        case ARGS_TEST:
+            append(out, size, " %s", a ? "true" : "false");
+            listrk(l, fn, i & 0x80, c, out, size);
+            break;
+        case ARGS_C: listrk(l, fn, i & 0x80, c, out, size); break;
+        case ARGS_CALL: append(out, size, " r%d %d", a, b); break;
+        case ARGS_ARRAY:
+            append(out, size, " r%d %d", a, b);
+            listrk(l, fn, i & 0x80, c, out, size);
+            break;
+        case ARGS_VEC: append(out, size, " r%d r%d %d", a, b, c); break;
+        case ARGS_JUMP: append(out, size, " -> %d", bx); break;
+        case ARGS_RET:
+            if (a) {
+                listrk(l, fn, i & 0x80, c, out, size);
+            }
+            break;
+        default: break;
+    }
+}
+
+/*
+** Lists one function, with how many times each instruction ran, the
+** cycles it took and its share of the function's cycles in profiling builds.
+*/
+static void listfunction(FuncList* l, bt_Function* fn, FILE* file)
+{
+    static const char* types[] = { "func", "task", "gen" };
+    fprintf(file, "function %d (%s): %d params, %d registers, %d instructions\n",
+        listindex(l, fn), types[fn->type], fn->params, fn->registers, fn->progcount);
+#ifdef BT_PROFILE
+    unsigned long long total = 0;
+    for (int i = 0; i != fn->progcount; ++i) {
+        total += fn->cycles[i];
+    }
+    fprintf(file, "%12s %14s %9s %6s %6s  %s\n", "count", "cycles", "cycles/op", "%", "at", "instruction");
+#endif
+    for (int i = 0; i != fn->progcount; ++i) {
+        Instruction ins = fn->program[i];
+        char args[128];
+        listargs(l, fn, ins, args, sizeof(args));
+#ifdef BT_PROFILE
+        unsigned long count = fn->counts[i];
+        unsigned long long cycles = fn->cycles[i];
+        fprintf(file, "%12lu %14llu %9.1f %6.2f ", count, cycles,
+            count ? (double)cycles / count : 0.0, total ? 100.0 * cycles / total : 0.0);
+#endif
+        fprintf(file, "%6d  %-10s%s\n", i, opinfo[ins & 0x3F].name, args);
+    }
+    fprintf(file, "\n");
+}
+
+/*
+** Writes a listing of [fn] and every function its closures refer to,
+** annotated with the instruction counters in profiling builds, to the file
+** at [path], or to stdout if it's NULL. Instructions are listed as they are
+** now, so ones that quickened themselves show their quickened opcode.
+** Returns 0 if the file can't be written.
+*/
+BT_API int bt_profile_dump(bt_Function* fn, const char* path)
+{
+    FILE* file = path != NULL ? fopen(path, "w") : stdout;
+    if (file == NULL) {
+        return 0;
+    }
+    FuncList l = { NULL, 0, 0 };
+    listcollect(&l, fn);
+    for (int i = 0; i != l.count; ++i) {
+        listfunction(&l, l.functions[i], file);
+    }
+    free(l.functions);
+    if (file != stdout) {
+        fclose(file);
+    }
+    return 1;
+}
+
+/*
+** ============================================================
+** Lines
+** ============================================================
+*/
+
+/* Reads a variable length integer from the line table, 0 past its end */
+static unsigned int getvarint(const unsigned char* table, int size, int* at)
+{
+    unsigned int v = 0;
+    for (int shift = 0; *at < size && shift < 35; shift += 7) {
+        unsigned char b = table[(*at)++];
+        v |= (unsigned int)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    return v;
+}
+
+/*
+** Gets the source line of the instruction at offset [at] of the function's
+** program, or 0 if it's out of range.
+** The line table has a run for each stretch of instructions on the same
+** line: how many instructions there are, then the line minus the last
+** run's, zigzag encoded so going back up a few lines stays small. Both
+** are stored 7 bits a byte, with the top bit set on all but the last.
+*/
+BT_API int bt_getline(bt_Function* fn, int at)
+{
+    int pos = 0, pc = 0, line = 0;
+    while (pos < fn->linesize) {
+        unsigned int count = getvarint(fn->lines, fn->linesize, &pos);
+        unsigned int delta = getvarint(fn->lines, fn->linesize, &pos);
+        line += delta & 1 ? -(int)((delta + 1) >> 1) : (int)(delta >> 1);
+        pc += count;
+        if (at < pc) {
+            return at >= 0 ? line : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+** ============================================================
+** Sampling
+** SIGPROF goes off every so often of CPU time, and its handler copies the
+** stack of the script it interrupted into a buffer. Samples are only
+** turned into names and lines when they're dumped.
+** ============================================================
+*/
+
+#define SAMPLE_DEPTH 64 // Deeper stacks lose their outermost frames
+#define SAMPLE_FRAMES (1 << 18) // Frames the buffer holds, samples that don't fit are dropped
+
+/*
+** Samples taken since bt_sample_start.
+** Each sample is a header with a NULL function and the depth as its pc,
+** followed by its frames, innermost first.
+*/
+typedef struct Sampler {
+    ProfileFrame* frames;
+    _Atomic int used;
+    _Atomic unsigned long dropped;
+    int running;
+#ifdef BT_SIGPROF
+    struct sigaction saved; // Handler to put back when sampling stops
+#endif
+} Sampler;
+
+static Sampler sampler;
+
+#ifdef BT_SIGPROF
+/* Takes a sample, only doing what's safe in a signal handler */
+static void onsample(int sig)
+{
+    (void)sig;
+    ProfileFrame stack[SAMPLE_DEPTH];
+    int depth = thread_backtrace(stack, SAMPLE_DEPTH);
+    if (depth == 0) {
+        return; // No script running on this OS thread
+    }
+    int at = atomic_load_explicit(&sampler.used, memory_order_relaxed);
+    do {
+        if (at + depth + 1 > SAMPLE_FRAMES) {
+            atomic_fetch_add_explicit(&sampler.dropped, 1, memory_order_relaxed);
+            return;
+        }
+    } while (!atomic_compare_exchange_weak(&sampler.used, &at, at + depth + 1));
+    sampler.frames[at].fn = NULL;
+    sampler.frames[at].pc = depth;
+    memcpy(&sampler.frames[at + 1], stack, sizeof(ProfileFrame) * depth);
+}
+#endif
+
+/*
+** Starts sampling whatever scripts are running, [frequency] times a second
+** of CPU time, throwing away any samples from before.
+** Sampling is process wide, since it's driven by SIGPROF, and replaces any
+** SIGPROF handler until bt_sample_stop. Samples land on the instruction
+** native code was entered at for functions the JIT compiled.
+** Returns 0 if sampling can't start, always in builds without BT_SAMPLE.
+*/
+BT_API int bt_sample_start(int frequency)
+{
+#ifdef BT_SIGPROF
+    if (sampler.running || frequency <= 0) {
+        return 0;
+    }
+    if (sampler.frames == NULL) {
+        sampler.frames = malloc(sizeof(ProfileFrame) * SAMPLE_FRAMES);
+    }
+    memset(sampler.frames, 0, sizeof(ProfileFrame) * SAMPLE_FRAMES);
+    atomic_store(&sampler.used, 0);
+    atomic_store(&sampler.dropped, 0);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onsample;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &sa, &sampler.saved) != 0) {
+        return 0;
+    }
+    long interval = frequency < 1000000 ? 1000000 / frequency : 1; // Microseconds
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval / 1000000;
+    timer.it_interval.tv_usec = interval % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &sampler.saved, NULL);
+        return 0;
+    }
+    sampler.running = 1;
+    return 1;
+#else
+    (void)frequency;
+    return 0;
+#endif
+}
+
+/* Stops sampling, keeping the samples for bt_sample_dump */
+BT_API void bt_sample_stop()
+{
+#ifdef BT_SIGPROF
+    if (!sampler.running) {
+        return;
+    }
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &sampler.saved, NULL);
+    sampler.running = 0;
+#endif
+}
+
+static int comparestacks(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Joins a sample's frames into "name:line;name:line", outermost first */
+static char* foldsample(const ProfileFrame* frames, int depth)
+{
+    size_t size = 1;
+    for (int i = 0; i != depth; ++i) {
+        Key* name = frames[i].fn->name;
+        size += (name != NULL ? name->length : 4) + 13;
+    }
+    char* stack = malloc(size);
+    stack[0] = '\0';
+    for (int i = depth - 1; i >= 0; --i) {
+        bt_Function* fn = frames[i].fn;
+        append(stack, size, "%s%s:%d", i == depth - 1 ? "" : ";",
+            fn->name != NULL ? fn->name->text : "main", bt_getline(fn, frames[i].pc));
+    }
+    return stack;
+}
+
+/*
+** Writes the samples taken as folded stacks, one line per distinct stack
+** with how many samples had it, to the file at [path], or to stdout if
+** it's NULL. That's the input flame graph tools take. Frames are named
+** after their function and line, and the script itself is "main".
+** Samples that didn't fit are counted under "[dropped]".
+** Sampling should be stopped first. Returns 0 if the file can't be written.
+*/
+BT_API int bt_sample_dump(const char* path)
+{
+    FILE* file = path != NULL ? fopen(path, "w") : stdout;
+    if (file == NULL) {
+        return 0;
+    }
+    int used = atomic_load(&sampler.used);
+    int count = 0;
+    char** stacks = malloc(sizeof(char*) * (used / 2 + 1));
+    for (int at = 0; at < used; ) {
+        int depth = sampler.frames[at].pc;
+        if (sampler.frames[at].fn != NULL || depth <= 0 || at + depth >= used) {
+            break; // Never filled in
+        }
+        stacks[count++] = foldsample(&sampler.frames[at + 1], depth);
+        at += depth + 1;
+    }
+    qsort(stacks, count, sizeof(char*), comparestacks);
+    for (int i = 0; i != count; ) {
+        int same = i + 1;
+        while (same != count && strcmp(stacks[same], stacks[i]) == 0) {
+            ++same;
+        }
+        fprintf(file, "%s %d\n", stacks[i], same - i);
+        i = same;
+    }
+    for (int i = 0; i != count; ++i) {
+        free(stacks[i]);
+    }
+    free(stacks);
+    unsigned long dropped = atomic_load(&sampler.dropped);
+    if (dropped != 0) {
+        fprintf(file, "[dropped] %lu\n", dropped);
+    }
+    if (file != stdout) {
+        fclose(file);
+    }
+    return 1;
+}
\ No newline at end of file
@@ -0,0 +1,72 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include "bullet_train.h"
+#include "function.h"
+
+/* Frame of a sample, the function and the offset of the instruction it was on */
+typedef struct ProfileFrame {
+    bt_Function* fn;
+    int pc;
+} ProfileFrame;
+
+#ifdef BT_PROFILE
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define profile_clock() __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define profile_clock() __rdtsc()
+#else
+#include <time.h>
+
+/* Nanoseconds stand in for cycles where there's no time stamp counter */
+static inline unsigned long long profile_clock()
+{
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+#endif
+
+/* Instruction being timed by the interpreter loop */
+typedef struct ProfileMark {
+    bt_Function* fn; // NULL when nothing is being timed
+    int at; // Offset in fn->program
+    int op; // Opcode as it was fetched, since the instruction can quicken itself
+    unsigned long long start;
+} ProfileMark;
+
+/*
+** Charges the cycles since the last mark to the instruction it was timing,
+** then starts timing instruction [at] of [fn], or nothing if [fn] is NULL.
+** The clock is read again at the end, so the counting isn't charged.
+*/
+static inline void profile_mark(bt_Context* bt, ProfileMark* m, bt_Function* fn, int at, int op)
+{
+    if (m->fn != NULL) {
+        unsigned long long spent = profile_clock() - m->start;
+        ProfileInfo* info = ctx_profileinfo(bt);
+        atomic_fetch_add_explicit(&m->fn->counts[m->at], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&m->fn->cycles[m->at], spent, memory_order_relaxed);
+        atomic_fetch_add_explicit(&info->counts[m->op], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&info->cycles[m->op], spent, memory_order_relaxed);
+    }
+    m->fn = fn;
+    m->at = at;
+    m->op = op;
+    m->start = profile_clock();
+}
+
+void profile_init(bt_Function* fn);
+void profile_free(bt_Function* fn);
+
+#else
+
+#define profile_init(fn) ((void)0)
+#define profile_free(fn) ((void)0)
+
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,301 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#include "runtime.h"
+#include "context.h"
+#include "thread.h"
+#include "sync.h"
+
+/*
+** Multi-core runtime.
+** Runs the context's tasks on a pool of OS threads. Each worker has a deque
+** of runnable threads: it takes from the front, runs one time slice, and puts
+** the thread back at the end, so its own tasks go round-robin. A worker that
+** runs dry steals from the back of the others' deques.
+**
+** Workers allocate from heaps of their own, so tasks that don't share
+** anything don't contend on anything either. They can't run the collector
+** though. A worker that has allocated its share asks for the world to be
+** stopped; every worker parks between slices, and the last one to arrive
+** collects for everyone. Threads are only ever touched by one worker at a
+** time, and they're all sitting in deques while the world is stopped.
+*/
+
+/* Start size of each worker's deque, must be a power of two */
+#define DEQUE_BUF 16
+
+typedef struct Worker {
+    Mutex lock; // Guards the deque, since other workers steal from it
+    bt_Thread** ring; // Circular buffer of runnable threads
+    int head; // Index of the front
+    int count;
+    int mask; // Buffer size - 1
+    Runtime* rt;
+    Heap* heap;
+    OSThread os;
+} Worker;
+
+struct Runtime {
+    bt_Context* bt;
+    Worker* workers;
+    int count; // Number of workers
+    BT_TIMER budget; // Time slice given to each thread
+    atomic_int live; // Tasks that haven't finished
+    // Stopping the world
+    Mutex lock;
+    Cond resume;
+    int running; // Workers that haven't exited
+    int parked; // Workers waiting for a collection
+    unsigned long stops; // Collections so far, so parked workers know when to go
+};
+
+/*
+** ============================================================
+** Deques
+** ============================================================
+*/
+
+/* Adds a thread to the end of a worker's deque, doubling it if it's full */
+static void pushback(Worker* w, bt_Thread* t)
+{
+    mutex_lock(&w->lock);
+    if (w->count == w->mask + 1) {
+        int size = (w->mask + 1) * 2;
+        bt_Thread** ring = malloc(sizeof(bt_Thread*) * size);
+        for (int i = 0; i != w->count; ++i) {
+            ring[i] = w->ring[(w->head + i) & w->mask];
+        }
+        free(w->ring);
+        w->ring = ring;
+        w->head = 0;
+        w->mask = size - 1;
+    }
+    w->ring[(w->head + w->count) & w->mask] = t;
+    ++w->count;
+    mutex_unlock(&w->lock);
+}
+
+/* Takes the thread at the front of a worker's deque, NULL if it's empty */
+static bt_Thread* popfront(Worker* w)
+{
+    bt_Thread* t = NULL;
+    mutex_lock(&w->lock);
+    if (w->count != 0) {
+        t = w->ring[w->head];
+        w->head = (w->head + 1) & w->mask;
+        --w->count;
+    }
+    mutex_unlock(&w->lock);
+    return t;
+}
+
+/* Takes the thread at the back of a worker's deque, NULL if it's empty */
+static bt_Thread* popback(Worker* w)
+{
+    bt_Thread* t = NULL;
+    mutex_lock(&w->lock);
+    if (w->count != 0) {
+        --w->count;
+        t = w->ring[(w->head + w->count) & w->mask];
+    }
+    mutex_unlock(&w->lock);
+    return t;
+}
+
+/* Steals a thread from another worker, trying each in turn after [self] */
+static bt_Thread* steal(Runtime* rt, Worker* self)
+{
+    int idx = (int)(self - rt->workers);
+    for (int i = 1; i != rt->count; ++i) {
+        bt_Thread* t = popback(&rt->workers[(idx + i) % rt->count]);
+        if (t != NULL) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+/*
+** ============================================================
+** Stopping the world
+** ============================================================
+*/
+
+/* Collects garbage for every parked worker, then lets them go. rt->lock must be held. */
+static void collect(Runtime* rt)
+{
+    bt_gccollect(rt->bt);
+    rt->parked = 0;
+    ++rt->stops;
+    cond_broadcast(&rt->resume);
+}
+
+/*
+** Parks a worker until the collection that was asked for is done.
+** The last worker to park runs it.
+*/
+static void park(Runtime* rt)
+{
+    mutex_lock(&rt->lock);
+    if (!ctx_gcwanted(rt->bt)) {
+        mutex_unlock(&rt->lock); // Someone else already collected
+        return;
+    }
+    if (++rt->parked == rt->running) {
+        collect(rt);
+    } else {
+        unsigned long stop = rt->stops;
+        while (rt->stops == stop) {
+            cond_wait(&rt->resume, &rt->lock);
+        }
+    }
+    mutex_unlock(&rt->lock);
+}
+
+/* Takes a worker out of the count, which may leave everyone else parked */
+static void leave(Runtime* rt)
+{
+    mutex_lock(&rt->lock);
+    --rt->running;
+    if (rt->parked != 0 && rt->parked == rt->running) {
+        collect(rt);
+    }
+    mutex_unlock(&rt->lock);
+}
+
+/*
+** ============================================================
+** Workers
+** ============================================================
+*/
+
+/* Runs slices until every task has finished */
+static void work(Worker* w)
+{
+    Runtime* rt = w->rt;
+    bt_Context* bt = rt->bt;
+    ctx_useheap(bt, w->heap, rt->count);
+    for (;;) {
+        if (ctx_gcwanted(bt)) {
+            park(rt);
+        }
+        bt_Thread* t = popfront(w);
+        if (t == NULL) {
+            t = steal(rt, w);
+        }
+        if (t == NULL) {
+            if (atomic_load(&rt->live) == 0) {
+                break;
+            }
+            osthread_yield(); // The rest are running elsewhere
+            continue;
+        }
+        t->timer = rt->budget;
+        int result = thread_execute(bt, t);
+        if (result == THREAD_YIELD || result == THREAD_VALUE) {
+            pushback(w, t);
+        } else {
+            thread_finish(t);
+            ctx_retirethread(bt, t);
+            atomic_fetch_sub(&rt->live, 1);
+        }
+    }
+    ctx_useheap(bt, NULL, 1);
+    leave(rt);
+}
+
+static THREAD_MAIN(workermain, arg)
+{
+    work(arg);
+    return 0;
+}
+
+/* Marks every thread waiting in a deque, for the collector */
+void runtime_mark(bt_Context* bt, Runtime* rt)
+{
+    for (int i = 0; i != rt->count; ++i) {
+        Worker* w = &rt->workers[i];
+        for (int j = 0; j != w->count; ++j) {
+            thread_mark(bt, w->ring[(w->head + j) & w->mask]);
+        }
+    }
+}
+
+/*
+** Runs every task spawned with bt_spawn to completion on [workers] OS
+** threads, the calling thread being one of them. Each thread gets
+** [budget] instructions at a time, as with bt_step.
+** Scripts can't be compiled or called from other OS threads until this returns.
+** Returns the number of workers that ran, which is less than asked for
+** if the OS wouldn't start more threads.
+*/
+BT_API int bt_run(bt_Context* bt, int workers, BT_TIMER budget)
+{
+    int count;
+    bt_Thread* tasks = ctx_taketasks(bt, &count);
+    if (count == 0) {
+        return 0;
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+    // Workers can only collect with the world stopped, not incrementally
+    ctx_gcfinish(bt);
+
+    Runtime rt;
+    rt.bt = bt;
+    rt.count = workers;
+    rt.budget = budget;
+    atomic_init(&rt.live, count);
+    mutex_init(&rt.lock);
+    cond_init(&rt.resume);
+    rt.running = workers;
+    rt.parked = 0;
+    rt.stops = 0;
+    rt.workers = malloc(sizeof(Worker) * workers);
+    for (int i = 0; i != workers; ++i) {
+        Worker* w = &rt.workers[i];
+        mutex_init(&w->lock);
+        w->ring = malloc(sizeof(bt_Thread*) * DEQUE_BUF);
+        w->head = 0;
+        w->count = 0;
+        w->mask = DEQUE_BUF - 1;
+        w->rt = &rt;
+        w->heap = ctx_getheap(bt, i);
+    }
+    // Deal the tasks out evenly to start with
+    for (int i = 0; tasks != NULL; ++i) {
+        bt_Thread* next = tasks->next;
+        pushback(&rt.workers[i % workers], tasks);
+        tasks = next;
+    }
+    ctx_setruntime(bt, &rt);
+
+    int started = 1;
+    for (; started != workers; ++started) {
+        if (!osthread_start(&rt.workers[started].os, workermain, &rt.workers[started])) {
+            break;
+        }
+    }
+    if (started != workers) {
+        // Their deques are still there to steal from
+        mutex_lock(&rt.lock);
+        rt.running -= workers - started;
+        mutex_unlock(&rt.lock);
+    }
+    work(&rt.workers[0]);
+    for (int i = 1; i != started; ++i) {
+        osthread_join(rt.workers[i].os);
+    }
+
+    ctx_setruntime(bt, NULL);
+    ctx_mergeheaps(bt);
+    for (int i = 0; i != workers; ++i) {
+        mutex_destroy(&rt.workers[i].lock);
+        free(rt.workers[i].ring);
+    }
+    free(rt.workers);
+    mutex_destroy(&rt.lock);
+    cond_destroy(&rt.resume);
+    return started;
+}
\ No newline at end of file
@@ -0,0 +1,10 @@
+#ifndef _RUNTIME_H_
+#define _RUNTIME_H_
+
+#include "bullet_train.h"
+
+typedef struct Runtime Runtime;
+
+void runtime_mark(bt_Context* bt, Runtime* rt);
+
+#endif
\ No newline at end of file
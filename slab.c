@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+/* Bytes per slab */
+#define SLAB_SIZE (64 * 1024)
+
+struct Slab {
+    Slab* next;
+    char data[]; // 8 byte aligned, enough for anything stored here
+};
+
+/* Header of a block allocated straight from the system */
+struct LargeBlock {
+    SlabAllocator* owner; // Allocator whose list it's on
+    LargeBlock* next;
+    LargeBlock* prev;
+    char data[];
+};
+
+#define sizeclass(size) (((size) + SLAB_GRAIN - 1) / SLAB_GRAIN - 1)
+#define largeblock(p) ((LargeBlock*)(p) - 1)
+
+void slab_init(SlabAllocator* a)
+{
+    for (int i = 0; i != SLAB_CLASSES; ++i) {
+        a->free[i] = NULL;
+    }
+    a->slabs = NULL;
+    a->top = NULL;
+    a->end = NULL;
+    a->large = NULL;
+    mutex_init(&a->largelock);
+}
+
+/* Unlinks large block [l] from its owner's list */
+static void unlinklarge(LargeBlock* l)
+{
+    if (l->prev != NULL) {
+        l->prev->next = l->next;
+    } else {
+        l->owner->large = l->next;
+    }
+    if (l->next != NULL) {
+        l->next->prev = l->prev;
+    }
+}
+
+/* Links large block [l] into [a]'s list */
+static void linklarge(SlabAllocator* a, LargeBlock* l)
+{
+    l->owner = a;
+    l->prev = NULL;
+    l->next = a->large;
+    if (a->large != NULL) {
+        a->large->prev = l;
+    }
+    a->large = l;
+}
+
+/* Releases every slab and large block at once */
+void slab_destroy(SlabAllocator* a)
+{
+    Slab* s = a->slabs;
+    while (s != NULL) {
+        Slab* temp = s->next;
+        free(s);
+        s = temp;
+    }
+    LargeBlock* l = a->large;
+    while (l != NULL) {
+        LargeBlock* temp = l->next;
+        free(l);
+        l = temp;
+    }
+    mutex_destroy(&a->largelock);
+    slab_init(a);
+}
+
+/*
+** Allocates [size] bytes.
+** Small sizes are taken from the class free list, or carved from the current slab.
+*/
+void* slab_alloc(SlabAllocator* a, size_t size)
+{
+    if (size > SLAB_MAX) {
+        LargeBlock* l = malloc(sizeof(LargeBlock) + size);
+        mutex_lock(&a->largelock);
+        linklarge(a, l);
+        mutex_unlock(&a->largelock);
+        return l->data;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    int c = sizeclass(size);
+    void* p = a->free[c];
+    if (p != NULL) {
+        a->free[c] = *(void**)p;
+        return p;
+    }
+    size = (c + 1) * SLAB_GRAIN;
+    if (a->top + size > a->end) {
+        // Current slab is used up, the tail end is wasted
+        Slab* s = malloc(sizeof(Slab) + SLAB_SIZE);
+        s->next = a->slabs;
+        a->slabs = s;
+        a->top = s->data;
+        a->end = s->data + SLAB_SIZE;
+    }
+    p = a->top;
+    a->top += size;
+    return p;
+}
+
+/*
+** Returns a block to its free list. [size] must match the allocation.
+** Large blocks go back to the system, off the list of the allocator that made them.
+*/
+void slab_free(SlabAllocator* a, void* p, size_t size)
+{
+    if (p == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX) {
+        LargeBlock* l = largeblock(p);
+        SlabAllocator* owner = l->owner;
+        mutex_lock(&owner->largelock);
+        unlinklarge(l);
+        mutex_unlock(&owner->largelock);
+        free(l);
+        return;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    int c = sizeclass(size);
+    *(void**)p = a->free[c];
+    a->free[c] = p;
+}
+
+/* Resizes a block, moving it if its size class changes */
+void* slab_realloc(SlabAllocator* a, void* p, size_t old, size_t size)
+{
+    if (old > SLAB_MAX && size > SLAB_MAX) {
+        LargeBlock* l = largeblock(p);
+        SlabAllocator* owner = l->owner;
+        mutex_lock(&owner->largelock);
+        unlinklarge(l);
+        LargeBlock* n = realloc(l, sizeof(LargeBlock) + size);
+        linklarge(owner, n);
+        mutex_unlock(&owner->largelock);
+        return n->data;
+    }
+    if (old <= SLAB_MAX && size <= SLAB_MAX && old != 0 && size != 0 && sizeclass(old) == sizeclass(size)) {
+        return p;
+    }
+    void* n = slab_alloc(a, size);
+    memcpy(n, p, old < size ? old : size);
+    slab_free(a, p, old);
+    return n;
+}
@@ -0,0 +1,42 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+
+#include "sync.h"
+
+/* Size classes are multiples of SLAB_GRAIN, up to SLAB_MAX bytes */
+#define SLAB_GRAIN 16
+#define SLAB_MAX 256
+#define SLAB_CLASSES (SLAB_MAX / SLAB_GRAIN)
+
+typedef struct Slab Slab;
+typedef struct LargeBlock LargeBlock;
+
+/*
+** Per-context allocator.
+** Small blocks are carved out of large slabs and recycled through
+** a free list per size class. Nothing is returned to the system
+** until the whole allocator is destroyed, which just frees the slabs.
+** Blocks too big for a size class come from the system. Each remembers
+** the allocator whose list it's on, so it's unlinked from there whichever
+** allocator frees it, and the lists are locked since that can be another
+** worker's.
+*/
+typedef struct SlabAllocator {
+    void* free[SLAB_CLASSES]; // Free lists, one per size class
+    Slab* slabs; // Every slab, for teardown
+    char* top; // Next unused byte in the current slab
+    char* end; // End of the current slab
+    LargeBlock* large; // Blocks too big for a size class
+    Mutex largelock; // Guards [large]
+} SlabAllocator;
+
+void slab_init(SlabAllocator* a);
+void slab_destroy(SlabAllocator* a);
+
+void* slab_alloc(SlabAllocator* a, size_t size);
+void slab_free(SlabAllocator* a, void* p, size_t size);
+void* slab_realloc(SlabAllocator* a, void* p, size_t old, size_t size);
+
+#endif
@@ -3,138 +3,364 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
-/* Start size for table */
-#define META_BUF 7
+/* Start size for property tables, must be a power of two */
+#define PROP_BUF 8
+
+/* Start size for transition maps, must be a power of two */
+#define TRANS_BUF 2
 
 /*
 ** LARGE EXPLANATION INCOMING:
 ** Bullet Train's structs use an approach similar to JavaScript V8's hidden classes.
 **
+** Every struct points to a Metatable describing its shape: which keys it has
+** and which slot of the data array each one lives in. Adding a key moves the
+** struct along a transition to a child Metatable, so structs built up with the
+** same keys in the same order end up sharing one Metatable.
+**
+** Keys are looked up in a PropTable, mapping keys to slots. A chain of
+** Metatables shares one PropTable: a child appends its key to its parent's
+** table, and each Metatable only sees the entries with a slot below its own
+** field count. Entries are never changed once added, so the table is safe to
+** share. When a second child branches off a parent whose table has already
+** been extended, it copies the parent's entries into a new table instead.
+**
+** Transitions to children are kept in a separate, usually tiny, map per node.
+**
+** With the multi-core runtime, workers share the tree. Finding a field never
+** takes a lock: entries are published by storing their key last. Adding a
+** transition, and so extending a PropTable, happens under the shape lock.
 */
+
+typedef struct Prop {
+    _Atomic(Key*) key; // Written last, once [idx] is in place
+    int idx;
+} Prop;
+
+/* Open addressing table from keys to slots, shared down a chain of Metatables */
+typedef struct PropTable {
+    int count; // Entries in use
+    int mask; // Table size - 1
+    Prop entries[];
+} PropTable;
+
 struct Metatable {
     Metatable* parent;
-    Key* key;
-    int idx;
-    Metatable** children;
-    int count;
-    int size;
+    Key* key; // Key added by the transition from the parent
+    int idx; // Slot of [key], which is also the number of fields - 1
+    PropTable* props; // May be shared with ancestors and descendants
+    Metatable** transitions; // Open addressing map of children, NULL if there are none
+    int transcount;
+    int transmask;
 };
 
-/* Creates a new root metatable */
-Metatable* newrootmeta()
+/* Creates an empty property table with [size] entries */
+static PropTable* newprops(bt_Context* bt, int size)
+{
+    PropTable* t = ctx_alloc(bt, sizeof(PropTable) + size * sizeof(Prop));
+    for (int i = 0; i != size; ++i) {
+        atomic_init(&t->entries[i].key, NULL);
+    }
+    t->count = 0;
+    t->mask = size - 1;
+    return t;
+}
+
+/* Adds an entry to a property table without checking its size */
+static void addprop(PropTable* t, Key* k, int idx)
 {
-    Metatable* meta = malloc(sizeof(Metatable));
-    meta->children = malloc(sizeof(Metatable*) * META_BUF);
-    for (int i = 0; i != META_BUF; ++i) {
-        meta->children[i] = NULL;
+    int i = k->hash & t->mask;
+    while (t->entries[i].key != NULL) {
+        i = (i + 1) & t->mask;
     }
-    meta->size = META_BUF;
+    t->entries[i].idx = idx;
+    atomic_store_explicit(&t->entries[i].key, k, memory_order_release);
+    ++t->count;
+}
+
+/* Creates a new root metatable */
+Metatable* newrootmeta(bt_Context* bt)
+{
+    Metatable* meta = ctx_alloc(bt, sizeof(Metatable));
+    meta->props = newprops(bt, PROP_BUF);
+    meta->transitions = NULL;
+    meta->transcount = 0;
+    meta->transmask = -1;
     meta->key = NULL;
     meta->idx = -1;
     meta->parent = NULL;
-    meta->count = 0;
     return meta;
 }
 
-/* GC destructor for structs */
-void destroystruct(void* st)
+/* GC finalizer for structs */
+void finalizestruct(bt_Context* bt, void* st)
 {
-    free(((bt_Struct*)st)->data);
+    bt_Struct* s = st;
+    ctx_free(bt, s->data, (s->size - STRUCT_INLINE) * sizeof(bt_Value));
 }
 
-#include <stdio.h>
+/* GC traverser for structs, marks every field */
+void traversestruct(bt_Context* bt, void* st)
+{
+    bt_Struct* s = st;
+    for (int i = 0; i <= s->meta->idx; ++i) {
+        ctx_markvalue(bt, structslot(s, i));
+    }
+}
+
+/*
+** Finds the slot of key [k] in a metatable.
+** Returns -1 if the key isn't a field.
+*/
+static int findslot(Metatable* meta, Key* k)
+{
+    PropTable* t = meta->props;
+    int i = k->hash & t->mask;
+    Key* e;
+    while ((e = atomic_load_explicit(&t->entries[i].key, memory_order_acquire)) != NULL) {
+        if (e == k) {
+            // Entries past this metatable's fields belong to descendants
+            return t->entries[i].idx <= meta->idx ? t->entries[i].idx : -1;
+        }
+        i = (i + 1) & t->mask;
+    }
+    return -1;
+}
 
 /* Gets an element of a struct */
 bt_Value getstruct(bt_Struct* s, Key* k)
 {
-    Metatable* meta = s->meta;
-    int i = k->hash % meta->size;
-    Metatable* c = meta->children[i];
+    int idx = findslot(s->meta, k);
+    if (idx != -1) {
+        return *structslot(s, idx);
+    }
+    // Not found, error
+    return nil();
+}
+
+/* Finds the child reached by adding key [k], or NULL if there isn't one yet */
+static Metatable* findchild(Metatable* meta, Key* k)
+{
+    if (meta->transitions == NULL) {
+        return NULL;
+    }
+    int i = k->hash & meta->transmask;
+    Metatable* c = meta->transitions[i];
     while (c != NULL) {
         if (c->key == k) {
-            return s->data[c->idx];
+            return c;
         }
-        i = (i + 1) % meta->size;
-        c = meta->children[i];
+        i = (i + 1) & meta->transmask;
+        c = meta->transitions[i];
     }
-    // Not found, error
-    return (bt_Value) { .type = VT_NIL };
+    return NULL;
 }
 
-/* Resizes a metatable to size [s] */
-static void resize(Metatable* m, int s)
+/* Adds a child to a metatable's transition map, growing it if it's half full */
+static void addchild(bt_Context* bt, Metatable* meta, Metatable* c)
 {
-    Metatable** c = malloc(s * sizeof(Metatable*));
-    for (int i = 0; i != m->size; ++i) {
-        if (m->children[i] != NULL) {
-            int j = m->children[i]->key->hash % s;
-            while (c[j] != NULL) {
-                j = (j + 1) % s;
+    int size = meta->transmask + 1;
+    if ((meta->transcount + 1) * 2 > size) {
+        int nsize = size == 0 ? TRANS_BUF : size * 2;
+        Metatable** map = ctx_alloc(bt, nsize * sizeof(Metatable*));
+        for (int i = 0; i != nsize; ++i) {
+            map[i] = NULL;
+        }
+        for (int i = 0; i != size; ++i) {
+            Metatable* m = meta->transitions[i];
+            if (m != NULL) {
+                int j = m->key->hash & (nsize - 1);
+                while (map[j] != NULL) {
+                    j = (j + 1) & (nsize - 1);
+                }
+                map[j] = m;
             }
-            c[j] = m->children[i];
         }
+        ctx_free(bt, meta->transitions, size * sizeof(Metatable*));
+        meta->transitions = map;
+        meta->transmask = nsize - 1;
+    }
+    int i = c->key->hash & meta->transmask;
+    while (meta->transitions[i] != NULL) {
+        i = (i + 1) & meta->transmask;
     }
-    free(m->children);
-    m->children = c;
-    m->size = s;
+    meta->transitions[i] = c;
+    ++meta->transcount;
 }
 
 /*
-** Sets an element of a struct.
-** Checks the struct's metatable for an entry with the specified key.
-** If that entry is a child, sets it as the struct's metatable.
-** Creates a new child if the entry doesn't exist.
+** Creates the child of [meta] that adds key [k].
+** The child extends its parent's property table in place when the parent
+** is the last metatable to have added to it. Otherwise the parent's fields
+** are copied into a fresh table, since the old one already has entries
+** from another branch.
 */
-void setstruct(bt_Struct* s, Key* k, bt_Value* vl)
+static Metatable* newchild(bt_Context* bt, Metatable* meta, Key* k)
 {
-    Metatable* meta = s->meta;
-    int i = k->hash % meta->size;
-    Metatable* c = meta->children[i];
+    Metatable* c = ctx_alloc(bt, sizeof(Metatable));
+    c->parent = meta;
+    c->key = k;
+    c->idx = meta->idx + 1;
+    c->transitions = NULL;
+    c->transcount = 0;
+    c->transmask = -1;
 
-    while (c != NULL) {
-        if (c->key == k) {
-            if (c->parent == s->meta) {
-                s->meta = c;
-                // Grow struct's array if it isn't big enough
-                if (c->idx == s->size) {
-                    s->size *= 2;
-                    s->data = realloc(s->data, s->size * sizeof(bt_Value));
-                }
+    PropTable* t = meta->props;
+    int count = meta->idx + 1;
+    if (t->count != count || (count + 1) * 2 > t->mask + 1) {
+        // Branching off or full, needs a new table
+        int size = t->mask + 1;
+        while ((count + 1) * 2 > size) {
+            size *= 2;
+        }
+        PropTable* n = newprops(bt, size);
+        for (int i = 0; i <= t->mask; ++i) {
+            if (t->entries[i].key != NULL && t->entries[i].idx < count) {
+                addprop(n, t->entries[i].key, t->entries[i].idx);
             }
-            s->data[c->idx] = *vl;
-            return;
         }
-        i = (i + 1) % meta->size;
-        c = meta->children[i];
-    }
-
-    // Resize if table is going to be full
-    if (meta->count == meta->size - 1) {
-        resize(meta, meta->size * 2);
+        t = n;
     }
+    addprop(t, k, c->idx);
+    c->props = t;
 
-    // No entry, create a new child metatable and try again
-    c = malloc(sizeof(Metatable));
-    meta->children[i] = c;
-    ++meta->count;
+    addchild(bt, meta, c);
+    return c;
+}
 
-    // Copy metatable's children to new child
-    c->children = malloc(meta->size * sizeof(Metatable*));
-    for (int i = 0; i != meta->size; ++i) {
-        c->children[i] = meta->children[i];
+/*
+** Adds up the metatables below and including [meta], and the bytes they
+** use with their transition maps and property tables. A property table
+** is counted by the metatable that made it, not the ones sharing it.
+*/
+void metastats(Metatable* meta, unsigned long* count, unsigned long* bytes)
+{
+    *count += 1;
+    *bytes += sizeof(Metatable) + (meta->transmask + 1) * sizeof(Metatable*);
+    if (meta->parent == NULL || meta->parent->props != meta->props) {
+        *bytes += sizeof(PropTable) + (meta->props->mask + 1) * sizeof(Prop);
+    }
+    for (int i = 0; i <= meta->transmask; ++i) {
+        if (meta->transitions[i] != NULL) {
+            metastats(meta->transitions[i], count, bytes);
+        }
     }
+}
 
-    c->idx = meta->idx + 1;
-    c->key = k;
-    c->parent = meta;
-    c->size = meta->size;
-    c->count = meta->count;
+/* Doubles the number of fields a struct can hold, spilling into its overflow array */
+void growstruct(bt_Context* bt, bt_Struct* s)
+{
+    int old = s->size - STRUCT_INLINE;
+    int size = s->size * 2 - STRUCT_INLINE;
+    if (s->data == NULL) {
+        s->data = ctx_alloc(bt, size * sizeof(bt_Value));
+    } else {
+        s->data = ctx_realloc(bt, s->data, old * sizeof(bt_Value), size * sizeof(bt_Value));
+    }
+    s->size *= 2;
+}
 
+/*
+** Finds the slot for key [k] in a struct.
+** If the key isn't a field yet, transitions the struct to the child
+** metatable that adds it, creating that child if it doesn't exist.
+** Returns the slot to write to. The struct itself belongs to one task,
+** only the shared metatables need the lock.
+*/
+static int transition(bt_Context* bt, bt_Struct* s, Key* k)
+{
+    Metatable* meta = s->meta;
+    int idx = findslot(meta, k);
+    if (idx != -1) {
+        return idx;
+    }
+    ctx_lockshapes(bt);
+    Metatable* c = findchild(meta, k);
+    if (c == NULL) {
+        c = newchild(bt, meta, k);
+    }
+    ctx_unlockshapes(bt);
     s->meta = c;
+    // Grow struct's array if it isn't big enough
     if (c->idx == s->size) {
-        s->size *= 2;
-        s->data = realloc(s->data, s->size * sizeof(bt_Value));
+        growstruct(bt, s);
+    }
+    return c->idx;
+}
+
+/* Sets an element of a struct */
+void setstruct(bt_Context* bt, bt_Struct* s, Key* k, bt_Value* vl)
+{
+    int idx = transition(bt, s, k);
+    *structslot(s, idx) = *vl;
+}
+
+/*
+** ============================================================
+** Inline caches
+** ============================================================
+*/
+
+/*
+** Adds an entry to an inline cache, evicting the least recently added one.
+** While the runtime's workers are sharing the cache, a way that's in use
+** could be read at any moment, so entries only go into empty ways.
+*/
+static void cacheadd(bt_Context* bt, StructCache* ic, Metatable* meta, Metatable* target, int idx)
+{
+    if (ctx_runtime(bt) != NULL) {
+        ctx_lockshapes(bt);
+        for (int w = 0; w != CACHE_WAYS; ++w) {
+            Metatable* m = atomic_load_explicit(&ic->meta[w], memory_order_relaxed);
+            if (m == meta) {
+                break; // Another worker got here first
+            }
+            if (m == NULL) {
+                ic->target[w] = target;
+                ic->idx[w] = idx;
+                atomic_store_explicit(&ic->meta[w], meta, memory_order_release);
+                break;
+            }
+        }
+        ctx_unlockshapes(bt);
+        return;
+    }
+    for (int w = CACHE_WAYS - 1; w != 0; --w) {
+        atomic_store_explicit(&ic->meta[w], atomic_load_explicit(&ic->meta[w - 1], memory_order_relaxed), memory_order_relaxed);
+        ic->target[w] = ic->target[w - 1];
+        ic->idx[w] = ic->idx[w - 1];
     }
-    s->data[c->idx] = *vl;
+    atomic_store_explicit(&ic->meta[0], meta, memory_order_relaxed);
+    ic->target[0] = target;
+    ic->idx[0] = idx;
+}
+
+/*
+** Slow path of a cached get.
+** Looks the key up normally, then remembers where it was found.
+** Missing keys aren't cached, since they produce nil anyway.
+*/
+bt_Value cachegetstruct(bt_Context* bt, bt_Struct* s, Key* k, StructCache* ic)
+{
+    int idx = findslot(s->meta, k);
+    if (idx != -1) {
+        cacheadd(bt, ic, s->meta, s->meta, idx);
+        return *structslot(s, idx);
+    }
+    return nil();
+}
+
+/*
+** Slow path of a cached set.
+** Remembers both the metatable the struct had and the one it ended up with,
+** so later structs of the same shape can take the transition directly.
+*/
+void cachesetstruct(bt_Context* bt, bt_Struct* s, Key* k, bt_Value* vl, StructCache* ic)
+{
+    Metatable* meta = s->meta;
+    int idx = transition(bt, s, k);
+    cacheadd(bt, ic, meta, s->meta, idx);
+    *structslot(s, idx) = *vl;
 }
\ No newline at end of file
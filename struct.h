@@ -1,22 +1,77 @@
 #ifndef _STRUCT_H_
 #define _STRUCT_H_
 
+#include <stdatomic.h>
+
 #include "bullet_train.h"
 #include "value.h"
 
 typedef struct Metatable Metatable;
 typedef struct Key Key;
 
+/* Number of metatables remembered by each inline cache */
+#define CACHE_WAYS 2
+
+/*
+** Inline cache for a single OP_GETSTRUCT or OP_SETSTRUCT.
+** Remembers the last few metatables seen by the instruction and the slot
+** the key resolved to, so a hit skips probing the metatable entirely.
+** For sets, [target] is the metatable the struct transitions to
+** (the same as [meta] when the field already exists).
+** A way is published by storing its [meta] last.
+*/
+typedef struct StructCache {
+    _Atomic(Metatable*) meta[CACHE_WAYS];
+    Metatable* target[CACHE_WAYS];
+    int idx[CACHE_WAYS];
+} StructCache;
+
+/* Number of fields stored inside the struct itself */
+#define STRUCT_INLINE 4
+
+/*
+** Fields are numbered by the slots handed out by the metatable chain.
+** The first STRUCT_INLINE live in [fields], so small structs are a single
+** allocation. Any after that go in [data], which stays NULL until needed.
+** [size] counts both, so a struct is full when a new slot reaches it.
+*/
 struct bt_Struct {
     Metatable* meta;
     bt_Value* data;
     int size;
+    bt_Value fields[STRUCT_INLINE];
 };
 
-Metatable* newrootmeta();
-void destroystruct(void* st);
+/* Gets the field in slot [idx] of a struct */
+static inline bt_Value* structslot(bt_Struct* s, int idx)
+{
+    return idx < STRUCT_INLINE ? &s->fields[idx] : &s->data[idx - STRUCT_INLINE];
+}
 
-void setstruct(bt_Struct* s, Key* k, bt_Value* vl);
+Metatable* newrootmeta(bt_Context* bt);
+void finalizestruct(bt_Context* bt, void* st);
+void traversestruct(bt_Context* bt, void* st);
+
+void setstruct(bt_Context* bt, bt_Struct* s, Key* k, bt_Value* vl);
 bt_Value getstruct(bt_Struct* s, Key* k);
 
+void growstruct(bt_Context* bt, bt_Struct* s);
+void metastats(Metatable* meta, unsigned long* count, unsigned long* bytes);
+bt_Value cachegetstruct(bt_Context* bt, bt_Struct* s, Key* k, StructCache* ic);
+void cachesetstruct(bt_Context* bt, bt_Struct* s, Key* k, bt_Value* vl, StructCache* ic);
+
+/*
+** Checks an inline cache for metatable [meta].
+** Returns the matching way, or -1 on a miss.
+*/
+static inline int cacheway(StructCache* ic, Metatable* meta)
+{
+    for (int w = 0; w != CACHE_WAYS; ++w) {
+        if (atomic_load_explicit(&ic->meta[w], memory_order_acquire) == meta) {
+            return w;
+        }
+    }
+    return -1;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,93 @@
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+/*
+** Thin wrappers over the platform's threads, locks and condition variables.
+** Only what the multi-core runtime needs, so the rest of the code
+** doesn't have to care which platform it's on.
+*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+#ifdef _WIN32
+
+typedef CRITICAL_SECTION Mutex;
+typedef CONDITION_VARIABLE Cond;
+typedef HANDLE OSThread;
+
+/* Declares an OS thread's entry point, return 0 from it */
+#define THREAD_MAIN(name, arg) DWORD WINAPI name(LPVOID arg)
+
+static inline void mutex_init(Mutex* m) { InitializeCriticalSection(m); }
+static inline void mutex_destroy(Mutex* m) { DeleteCriticalSection(m); }
+static inline void mutex_lock(Mutex* m) { EnterCriticalSection(m); }
+static inline void mutex_unlock(Mutex* m) { LeaveCriticalSection(m); }
+
+static inline void cond_init(Cond* c) { InitializeConditionVariable(c); }
+static inline void cond_destroy(Cond* c) { (void)c; }
+static inline void cond_wait(Cond* c, Mutex* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static inline void cond_broadcast(Cond* c) { WakeAllConditionVariable(c); }
+
+/* Starts a thread running [main]. Returns 0 if it couldn't be created. */
+static inline int osthread_start(OSThread* t, LPTHREAD_START_ROUTINE main, void* arg)
+{
+    *t = CreateThread(NULL, 0, main, arg, 0, NULL);
+    return *t != NULL;
+}
+
+static inline void osthread_join(OSThread t)
+{
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+/* Gives up the rest of the time slice to other threads */
+static inline void osthread_yield(void) { SwitchToThread(); }
+
+#else
+
+typedef pthread_mutex_t Mutex;
+typedef pthread_cond_t Cond;
+typedef pthread_t OSThread;
+
+/* Declares an OS thread's entry point, return 0 from it */
+#define THREAD_MAIN(name, arg) void* name(void* arg)
+
+static inline void mutex_init(Mutex* m) { pthread_mutex_init(m, NULL); }
+static inline void mutex_destroy(Mutex* m) { pthread_mutex_destroy(m); }
+static inline void mutex_lock(Mutex* m) { pthread_mutex_lock(m); }
+static inline void mutex_unlock(Mutex* m) { pthread_mutex_unlock(m); }
+
+static inline void cond_init(Cond* c) { pthread_cond_init(c, NULL); }
+static inline void cond_destroy(Cond* c) { pthread_cond_destroy(c); }
+static inline void cond_wait(Cond* c, Mutex* m) { pthread_cond_wait(c, m); }
+static inline void cond_broadcast(Cond* c) { pthread_cond_broadcast(c); }
+
+/* Starts a thread running [main]. Returns 0 if it couldn't be created. */
+static inline int osthread_start(OSThread* t, void* (*main)(void*), void* arg)
+{
+    return pthread_create(t, NULL, main, arg) == 0;
+}
+
+static inline void osthread_join(OSThread t)
+{
+    pthread_join(t, NULL);
+}
+
+/* Gives up the rest of the time slice to other threads */
+static inline void osthread_yield(void) { sched_yield(); }
+
+#endif
+
+#endif
\ No newline at end of file
@@ -1,50 +1,210 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
 
 #include "thread.h"
 #include "function.h"
 #include "context.h"
 #include "struct.h"
+#include "array.h"
+#include "vector.h"
+#include "jit.h"
+#include "profile.h"
+#ifdef BT_SAMPLE
+#include "sync.h"
+#endif
 
 /*
 ** Function call information.
 ** Basically just acts as a stack frame.
 ** Stored in a linked list so they can be reused, avoiding dynamic allocations.
+** Frames past the current one are left linked in for the next call that deep.
 */
 struct Call {
     Call* next;
     Call* previous;
-    bt_Closure* closure;
+    bt_Function* fn; // NULL when the thread isn't running anything
     Instruction* ip;
     bt_Value* base;
 };
 
+#ifdef BT_SAMPLE
+/* Thread being interpreted on this OS thread, for the sampling profiler */
+static THREAD_LOCAL bt_Thread* volatile running;
+#endif
 
+
+/*
+** Creates a thread with an empty stack.
+** The stack is sized by thread_reserve once there's something to run.
+*/
 bt_Thread* thread_new()
 {
     bt_Thread* t = malloc(sizeof(bt_Thread));
     t->next = NULL;
     t->timer = 0;
-    t->stack = malloc(sizeof(bt_Value) * 32);
-    t->stacksize = 32;
+    t->stack = NULL;
+    t->stacksize = 0;
+    t->resumed = NULL;
+    t->resumer = NULL;
     Call* c = malloc(sizeof(Call));
     c->previous = NULL;
     c->next = NULL;
+    c->fn = NULL;
     c->base = t->stack;
     t->call = c;
     return t;
 }
 
+/*
+** Makes sure a thread's stack holds at least [size] values.
+** The first allocation is exact, later ones at least double to keep
+** regrowth rare. Frames point into the stack, so their bases are moved
+** along with it. Returns 0 if the size can't be allocated.
+*/
+int thread_reserve(bt_Thread* t, int size)
+{
+    if (size <= t->stacksize) {
+        return 1;
+    }
+    if (size < 0 || (size_t)size > SIZE_MAX / sizeof(bt_Value)) {
+        return 0;
+    }
+    int nsize = size;
+    if (t->stacksize != 0 && t->stacksize <= INT_MAX / 2 && t->stacksize * 2 > size
+        && (size_t)t->stacksize * 2 <= SIZE_MAX / sizeof(bt_Value)) {
+        nsize = t->stacksize * 2;
+    }
+    bt_Value* stack = realloc(t->stack, sizeof(bt_Value) * nsize);
+    if (stack == NULL) {
+        return 0;
+    }
+    for (int i = t->stacksize; i != nsize; ++i) {
+        stack[i] = nil();
+    }
+    // Rebase every frame, including reusable ones past the current call
+    Call* c = t->call;
+    while (c->previous != NULL) {
+        c = c->previous;
+    }
+    for (; c != NULL; c = c->next) {
+        c->base = stack + (c->base - t->stack);
+    }
+    t->stack = stack;
+    t->stacksize = nsize;
+    return 1;
+}
+
+void thread_free(bt_Thread* t)
+{
+    Call* c = t->call;
+    while (c->previous != NULL) {
+        c = c->previous;
+    }
+    while (c != NULL) {
+        Call* temp = c->next;
+        free(c);
+        c = temp;
+    }
+    free(t->stack);
+    free(t);
+}
+
+/*
+** Marks a thread's roots for the garbage collector:
+** its whole register stack, and the constants of every function it's running.
+** Generators it's running are marked along with it, since their
+** registers change without going through a write barrier.
+*/
+void thread_mark(bt_Context* bt, bt_Thread* t)
+{
+    for (; t != NULL; t = t->resumed) {
+        for (int i = 0; i != t->stacksize; ++i) {
+            ctx_markvalue(bt, &t->stack[i]);
+        }
+        for (Call* c = t->call; c != NULL; c = c->previous) {
+            if (c->fn != NULL) {
+                bt_Function* fn = c->fn;
+                for (int i = 0; i != fn->constcount; ++i) {
+                    ctx_markvalue(bt, &fn->constants[i]);
+                }
+            }
+        }
+    }
+}
+
+static void traversegen(bt_Context* bt, void* obj)
+{
+    Generator* g = obj;
+    if (g->thread != NULL) {
+        thread_mark(bt, g->thread);
+    }
+}
+
+static void finalizegen(bt_Context* bt, void* obj)
+{
+    Generator* g = obj;
+    if (g->thread != NULL) {
+        thread_finish(g->thread);
+        ctx_retirethread(bt, g->thread);
+    }
+}
+
+static const GCType gentype = { traversegen, finalizegen, 1 };
+
+/*
+** Creates a generator that will run [fn] with the first [count] values of [args].
+** Its thread is set up here, so nothing is allocated when it's resumed.
+** Returns NULL if the thread's stack can't be allocated.
+*/
+static Generator* newgenerator(bt_Context* bt, bt_Function* fn, bt_Value* args, int count)
+{
+    bt_Thread* gt = ctx_takethread(bt);
+    if (!thread_start(gt, fn)) {
+        ctx_retirethread(bt, gt);
+        return NULL;
+    }
+    bt_Value* base = gt->call->base;
+    for (int a = 0; a != fn->params; ++a) {
+        base[a] = a < count ? args[a] : nil();
+    }
+    Generator* g = ctx_gcalloc(bt, sizeof(Generator), &gentype);
+    g->thread = gt;
+    return g;
+}
+
 /*
 ** Prints a bt_Value to stdout
 */
 static void printvalue(bt_Value* vl)
 {
-    switch (vl->type)
+    switch (vtype(*vl))
     {
         case VT_NIL:    printf("nil\n"); break;
-        case VT_NUMBER: printf("%g\n", vl->number); break;
-        case VT_BOOL:   printf(vl->boolean ? "true\n" : "false\n"); break;
+        case VT_NUMBER: printf("%g\n", tonumber(*vl)); break;
+        case VT_BOOL:   printf(toboolean(*vl) ? "true\n" : "false\n"); break;
+        case VT_ARRAY: {
+            Array* a = toarray(*vl);
+            putchar('[');
+            for (int i = 0; i != a->length; ++i) {
+                printf(i == 0 ? "%g" : ", %g", a->data[i]);
+            }
+            printf("]\n");
+            break;
+        }
+#ifdef BT_VECTORS
+        case VT_VEC: case VT_VEC2: case VT_VEC3: case VT_VEC4: {
+            const float* c = veccomponents(*vl);
+            putchar('(');
+            for (int i = 0; i != veccount(*vl); ++i) {
+                printf(i == 0 ? "%g" : ", %g", c[i]);
+            }
+            printf(")\n");
+            break;
+        }
+#endif
         default:        putchar('\n'); break;
     }
 }
@@ -54,13 +214,18 @@ static void printvalue(bt_Value* vl)
 */
 static int equal(bt_Value* l, bt_Value* r)
 {
-    if (l->type == r->type) // Have to be the same type to be equal
+    if (vtype(*l) == vtype(*r)) // Have to be the same type to be equal
     {
-        switch (l->type)
+        switch (vtype(*l))
         {
             case VT_NIL:    return 1;
-            case VT_BOOL:   return l->boolean == r->boolean;
-            case VT_NUMBER: return l->number == r->number;
+            case VT_BOOL:   return toboolean(*l) == toboolean(*r);
+            case VT_NUMBER: return tonumber(*l) == tonumber(*r);
+            case VT_ARRAY:  return toarray(*l) == toarray(*r);
+#ifdef BT_VECTORS
+            case VT_VEC: case VT_VEC2: case VT_VEC3: case VT_VEC4:
+                return vec_equal(l, r);
+#endif
         }
     }
     return 0;
@@ -68,20 +233,20 @@ static int equal(bt_Value* l, bt_Value* r)
 
 /*
 ** Less than comparison
-** Errors if values are incompatible
+** Both values have to be numbers, which the callers check
 */
 static int less(bt_Value* l, bt_Value* r)
 {
-    return l->number < r->number;   
+    return tonumber(*l) < tonumber(*r);   
 }
 
 /*
 ** Less than or equal comparision
-** Also errors for incompatible types
+** Both values have to be numbers too
 */
 static int lequal(bt_Value* l, bt_Value* r)
 {
-    return l->number <= r->number;
+    return tonumber(*l) <= tonumber(*r);
 }
 
 /*
@@ -92,14 +257,53 @@ static int lequal(bt_Value* l, bt_Value* r)
 */
 static int test(bt_Value* vl)
 {
-    switch (vl->type)
+    switch (vtype(*vl))
     {
-        case VT_BOOL:   return vl->boolean;
-        case VT_NUMBER: return vl->number != 0;
+        case VT_BOOL:   return toboolean(*vl);
+        case VT_NUMBER: return tonumber(*vl) != 0;
         default:        return 0;
     }
 }
 
+/*
+** Links a new frame after [c], for the first call that goes this deep.
+** Returns NULL if it can't be allocated.
+*/
+static Call* pushcall(Call* c)
+{
+    Call* next = malloc(sizeof(Call));
+    if (next != NULL) {
+        next->next = NULL;
+        next->previous = c;
+        next->fn = NULL;
+        next->base = c->base;
+        c->next = next;
+    }
+    return next;
+}
+
+/*
+** Gets frame [c] ready to run with [args] arguments already in place:
+** makes sure the stack holds its registers, and sets parameters that
+** weren't passed to nil. The stack may move. Counts any allocation in
+** [allocs], and returns 0 if the stack can't grow.
+*/
+static inline int openframe(bt_Thread* t, Call* c, int args, unsigned long* allocs)
+{
+    bt_Function* fn = c->fn;
+    int top = (int)(c->base - t->stack) + fn->registers;
+    if (top > t->stacksize) {
+        if (!thread_reserve(t, top)) {
+            return 0;
+        }
+        ++*allocs;
+    }
+    for (int r = args; r < fn->params; ++r) {
+        c->base[r] = nil();
+    }
+    return 1;
+}
+
 /*
 ** ============================================================
 ** The interpreter, Bullet Train's heart and soul
@@ -111,153 +315,1291 @@ static int test(bt_Value* vl)
 #define argb(i) ((i >> 16) & 0xFF)
 #define argbx(i) (i >> 16)
 #define argc(i) (i >> 24)
+#define argsc(i) ((signed char)argc(i))
 
 #define dest(i) reg[arga(i)]
 #define rkb(i) (i & 0x40 ? &fn->constants[argb(i)] : &reg[argb(i)])
 #define rkc(i) (i & 0x80 ? &fn->constants[argc(i)] : &reg[argc(i)])
 
-#define number(n) ((bt_Value) { .number = (n), .type = VT_NUMBER })
-#define boolean(b) ((bt_Value) { .boolean = (b), .type = VT_BOOL })
-#define struc(b) ((bt_Value) { .struc = (b), .type = VT_STRUCT })
+#define cache(i) (&fn->caches[fn->cacheidx[ip - fn->program - 1]])
+
+/* Register of thread [r] holding the generator it resumed, where the generator's values go */
+#define resumeslot(r) (&(r)->call->base[arga((r)->call->ip[-1])])
+
+/*
+** Adds the cache statistics counted so far to the running function.
+** They're shared between workers, so they're counted locally and added
+** when the loop leaves the function instead of on every access.
+*/
+#define vmflush() \
+    do { \
+        if ((hits | misses) != 0) { \
+            fn->cachehits += hits; \
+            fn->cachemisses += misses; \
+            hits = misses = 0; \
+        } \
+    } while (0)
+
+/* Writes back what the loop keeps in locals before leaving it */
+#define vmsave() \
+    do { \
+        t->timer = budget; \
+        vmflush(); \
+        vmprofstop(); \
+        vmrunning(outer); \
+        if ((calls | allocs | dispatches) != 0) { \
+            CallInfo* ci = ctx_callinfo(bt); \
+            ci->calls += calls; \
+            ci->allocs += allocs; \
+            ci->dispatches += dispatches; \
+        } \
+    } while (0)
+
+/* Stops the thread on an instruction it can't carry out */
+#define vmerror() \
+    do { \
+        c->ip = ip - 1; \
+        vmsave(); \
+        return THREAD_ERROR; \
+    } while (0)
+
+/*
+** Jumps to [target].
+** Backward jumps close loops, so they're charged the length of the loop
+** against the thread's budget and yield once it runs out. Along with
+** calls, this is the only place the budget is checked, so straight-line
+** code never pays.
+*/
+#define vmjump(target) \
+    do { \
+        Instruction* to = (target); \
+        if (to < ip && (budget -= (BT_TIMER)(ip - to)) <= 0) { \
+            c->ip = to; \
+            vmsave(); \
+            return THREAD_YIELD; \
+        } \
+        ip = to; \
+    } while (0)
+
+/* Switches to the current frame of thread [to] */
+#define vmswitch(to) \
+    do { \
+        t = (to); \
+        vmrunning(t); \
+        c = t->call; \
+        fn = c->fn; \
+        reg = c->base; \
+        ip = c->ip; \
+    } while (0)
+
+/*
+** Enters the frame that was just set up.
+** Recursion can run as long as a loop without ever jumping back, so calls
+** are charged too: the length of the function called, which is as far as
+** it can get before its own jumps or calls are charged.
+*/
+#define vmenter() \
+    do { \
+        fn = c->fn; \
+        reg = c->base; \
+        ip = c->ip; \
+        ++calls; \
+        if ((budget -= (BT_TIMER)fn->progcount) <= 0) { \
+            vmsave(); \
+            return THREAD_YIELD; \
+        } \
+    } while (0)
+
+/*
+** Carries on in native code if the current function has any.
+** Native code hands the frame back for calls, returns and yields,
+** so this follows every instruction that changes frames.
+*/
+#ifdef BT_JIT
+#define vmnative() \
+    do { \
+        if (fn->native != NULL) { \
+            goto native; \
+        } \
+    } while (0)
+#else
+#define vmnative() ((void)0)
+#endif
+
+/*
+** Quickening.
+** Generic instructions call vmquicken with the variant for two numbers
+** in registers, which is followed by the one taking a constant, and
+** variants call vmunquicken when their guard fails to run the generic
+** instruction again. With NaN boxing, arithmetic only checks its result
+** isn't NaN, and one that is goes back through the generic instruction,
+** which quickens it again if it was numbers after all. Workers running
+** the same function race to rewrite an opcode, so instructions are
+** written and fetched atomically.
+** Define BT_NO_QUICKENING to leave it out.
+*/
+#define rewrite(i, op) \
+    atomic_store_explicit((_Atomic Instruction*)(ip - 1), ((i) & ~(Instruction)0x3F) | (op), memory_order_relaxed)
+
+#ifndef BT_NO_QUICKENING
+#define vmquicken(nn, lhs, rhs) \
+    do { \
+        if (!(i & 0x40) && isnumbers(*(lhs), *(rhs))) { \
+            rewrite(i, (nn) + ((i & 0x80) != 0)); \
+        } \
+    } while (0)
+#else
+#define vmquicken(nn, lhs, rhs) ((void)0)
+#endif
+
+#define vmunquicken(op) \
+    { \
+        rewrite(i, op); \
+        --ip; \
+        vmbreak; \
+    }
 
 /*
-** Main loop of the interpreter
+** Dispatch macros.
+** With BT_COMPUTED_GOTO, every instruction ends by fetching the next one
+** and jumping straight to its label, giving each opcode its own indirect
+** branch. Otherwise everything goes through the switch.
+*/
+#define vmfetch(i) (i = atomic_load_explicit((_Atomic Instruction*)ip++, memory_order_relaxed), vmsample(), vmcount(), vmprofile(i))
+
+/*
+** Counts every instruction dispatched, for bt_dispatchstats.
+** It costs a little on each one, so it's only there with BT_COUNT_DISPATCHES.
+*/
+#ifdef BT_COUNT_DISPATCHES
+#define vmcount() (++dispatches)
+#else
+#define vmcount() ((void)0)
+#endif
+
+/*
+** Times every instruction, for the bt_profile functions.
+** Each fetch starts timing the instruction fetched and charges the one
+** before, so what an instruction is charged includes its dispatch.
+** vmprofstop charges the last one when the loop is left.
+*/
+#ifdef BT_PROFILE
+#define vmprofile(i) profile_mark(bt, &mark, fn, (int)(ip - fn->program) - 1, (int)((i) & 0x3F))
+#define vmprofstop() profile_mark(bt, &mark, NULL, 0, 0)
+#else
+#define vmprofile(i) ((void)0)
+#define vmprofstop() ((void)0)
+#endif
+
+/*
+** Keeps what the sampling profiler reads up to date, with BT_SAMPLE.
+** Every fetch stores ip in the frame, since a sample can land anywhere,
+** and vmrunning publishes which thread the loop is running.
+*/
+#ifdef BT_SAMPLE
+#define vmsample() (((volatile Call*)c)->ip = ip)
+#define vmrunning(to) (running = (to))
+#else
+#define vmsample() ((void)0)
+#define vmrunning(to) ((void)0)
+#endif
+
+#ifdef BT_COMPUTED_GOTO
+#define vmdispatch(o) goto *jumptable[o];
+#define vmcase(op) L_##op:
+#define vmbreak vmfetch(i); goto *jumptable[i & 0x3F]
+#else
+#define vmdispatch(o) switch (o)
+#define vmcase(op) case op:
+#define vmbreak break
+#endif
+
+/*
+** Main loop of the interpreter.
+** Runs until the function returns, or until the thread's timer runs out.
+** Returns THREAD_DONE or THREAD_YIELD; a yielded thread continues where
+** it left off the next time it's executed. Generators run in the same loop
+** on threads of their own, hopping between threads on resume and yield,
+** and a thread stopped inside one picks up in the innermost generator.
+** THREAD_VALUE means the thread's own function yielded a value.
+** Functions the JIT compiled run in native code in between.
 */
 int thread_execute(bt_Context* bt, bt_Thread* t)
 {
     Call* c;
     bt_Function* fn;
     bt_Value* reg;
+    Instruction* ip;
+    BT_TIMER budget = t->timer;
+    while (t->resumed != NULL) {
+        t = t->resumed;
+    }
+    unsigned long hits = 0, misses = 0, calls = 0, allocs = 0, dispatches = 0;
+#ifdef BT_PROFILE
+    ProfileMark mark = { NULL, 0, 0, 0 };
+#endif
+#ifdef BT_SAMPLE
+    bt_Thread* outer = running; // Put back on the way out
+    vmrunning(t);
+#endif
+#ifdef BT_COMPUTED_GOTO
+    static const void* const jumptable[] = {
+        [OP_LOAD] = &&L_OP_LOAD,
+        [OP_LOADBOOL] = &&L_OP_LOADBOOL,
+        [OP_NEWSTRUCT] = &&L_OP_NEWSTRUCT,
+        [OP_GETSTRUCT] = &&L_OP_GETSTRUCT,
+        [OP_SETSTRUCT] = &&L_OP_SETSTRUCT,
+        [OP_MOVE] = &&L_OP_MOVE,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL,
+        [OP_DIV] = &&L_OP_DIV,
+        [OP_ADDI] = &&L_OP_ADDI,
+        [OP_SUBI] = &&L_OP_SUBI,
+        [OP_MULI] = &&L_OP_MULI,
+        [OP_NEG] = &&L_OP_NEG,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_LEQUAL] = &&L_OP_LEQUAL,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_TEST] = &&L_OP_TEST,
+        [OP_JEQUAL] = &&L_OP_JEQUAL,
+        [OP_JLEQUAL] = &&L_OP_JLEQUAL,
+        [OP_JLESS] = &&L_OP_JLESS,
+        [OP_JTEST] = &&L_OP_JTEST,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_CALL] = &&L_OP_CALL,
+        [OP_TAILCALL] = &&L_OP_TAILCALL,
+        [OP_YIELD] = &&L_OP_YIELD,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_NEWARRAY] = &&L_OP_NEWARRAY,
+        [OP_GETINDEX] = &&L_OP_GETINDEX,
+        [OP_SETINDEX] = &&L_OP_SETINDEX,
+        [OP_LEN] = &&L_OP_LEN,
+        [OP_SUM] = &&L_OP_SUM,
+        [OP_DOT] = &&L_OP_DOT,
+        [OP_SCALE] = &&L_OP_SCALE,
+        [OP_ADDARRAY] = &&L_OP_ADDARRAY,
+        [OP_VEC] = &&L_OP_VEC,
+        [OP_ADDNN] = &&L_OP_ADDNN,
+        [OP_ADDNK] = &&L_OP_ADDNK,
+        [OP_SUBNN] = &&L_OP_SUBNN,
+        [OP_SUBNK] = &&L_OP_SUBNK,
+        [OP_MULNN] = &&L_OP_MULNN,
+        [OP_MULNK] = &&L_OP_MULNK,
+        [OP_DIVNN] = &&L_OP_DIVNN,
+        [OP_DIVNK] = &&L_OP_DIVNK,
+        [OP_ADDIN] = &&L_OP_ADDIN,
+        [OP_SUBIN] = &&L_OP_SUBIN,
+        [OP_MULIN] = &&L_OP_MULIN,
+        [OP_EQUALNN] = &&L_OP_EQUALNN,
+        [OP_EQUALNK] = &&L_OP_EQUALNK,
+        [OP_LEQUALNN] = &&L_OP_LEQUALNN,
+        [OP_LEQUALNK] = &&L_OP_LEQUALNK,
+        [OP_LESSNN] = &&L_OP_LESSNN,
+        [OP_LESSNK] = &&L_OP_LESSNK,
+        [OP_JEQUALNN] = &&L_OP_JEQUALNN,
+        [OP_JEQUALNK] = &&L_OP_JEQUALNK,
+        [OP_JLEQUALNN] = &&L_OP_JLEQUALNN,
+        [OP_JLEQUALNK] = &&L_OP_JLEQUALNK,
+        [OP_JLESSNN] = &&L_OP_JLESSNN,
+        [OP_JLESSNK] = &&L_OP_JLESSNK,
+    };
+#endif
 
 // Refresh:
     c = t->call;
     reg = c->base;
-    fn = c->closure->function;
+    fn = c->fn;
+    ip = c->ip;
+    vmnative();
 
     for (;;)
     {
-        Instruction i = *c->ip++;
-        switch (i & 0x3F)
+        Instruction i;
+#ifdef BT_JIT
+    dispatch:
+#endif
+        vmfetch(i);
+        vmdispatch(i & 0x3F)
         {
-            case OP_LOAD: {
+            vmcase(OP_LOAD) {
                 dest(i) = fn->constants[argbx(i)];
-                break;
+                vmbreak;
             }
-            case OP_LOADBOOL: {
+            vmcase(OP_LOADBOOL) {
                 dest(i) = boolean(argb(i));
-                c->ip += argc(i);
-                break;
+                ip += argc(i);
+                vmbreak;
             }
 
-            case OP_NEWSTRUCT: {
+            vmcase(OP_NEWSTRUCT) {
                 dest(i) = struc(bt_newstruct(bt));
-                break;
+                ctx_gccheck(bt);
+                vmbreak;
             }
-            case OP_GETSTRUCT: {
-                dest(i) = getstruct(reg[argb(i)].struc, fn->keys[argc(i)]);
-                break;
+            vmcase(OP_GETSTRUCT) {
+                if (vtype(reg[argb(i)]) != VT_STRUCT) {
+                    if (!vec_get(bt, &reg[argb(i)], fn->keys[argc(i)], &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                bt_Struct* s = tostruct(reg[argb(i)]);
+                StructCache* ic = cache(i);
+                int w = cacheway(ic, s->meta);
+                if (w != -1) {
+                    ++hits;
+                    dest(i) = *structslot(s, ic->idx[w]);
+                } else {
+                    ++misses;
+                    dest(i) = cachegetstruct(bt, s, fn->keys[argc(i)], ic);
+                }
+                vmbreak;
             }
-            case OP_SETSTRUCT: {
-                setstruct(reg[arga(i)].struc, fn->keys[argb(i)], rkc(i));
-                break;
+            vmcase(OP_SETSTRUCT) {
+                if (vtype(reg[arga(i)]) != VT_STRUCT) {
+                    if (!vec_set(bt, &reg[arga(i)], fn->keys[argb(i)], rkc(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                bt_Struct* s = tostruct(reg[arga(i)]);
+                StructCache* ic = cache(i);
+                int w = cacheway(ic, s->meta);
+                if (w != -1) {
+                    ++hits;
+                    int idx = ic->idx[w];
+                    if (ic->target[w] != s->meta) {
+                        s->meta = ic->target[w];
+                        if (idx == s->size) {
+                            growstruct(bt, s);
+                        }
+                    }
+                    *structslot(s, idx) = *rkc(i);
+                } else {
+                    ++misses;
+                    cachesetstruct(bt, s, fn->keys[argb(i)], rkc(i), ic);
+                }
+                if (isobject(*rkc(i))) {
+                    ctx_barrier(bt, s, rkc(i));
+                }
+                vmbreak;
             }
 
-            case OP_MOVE: {
+            vmcase(OP_MOVE) {
                 dest(i) = reg[argbx(i)];
-                break;
+                vmbreak;
             }
 
-            case OP_ADD: {
+            vmcase(OP_ADD) {
                 bt_Value* lhs = rkb(i);
                 bt_Value* rhs = rkc(i);
-                dest(i) = number(lhs->number + rhs->number);
-                break;
+                vmquicken(OP_ADDNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    if (!vec_arith(bt, OP_ADD, lhs, rhs, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) + tonumber(*rhs));
+                vmbreak;
             }
-            case OP_SUB: {
+            vmcase(OP_SUB) {
                 bt_Value* lhs = rkb(i);
                 bt_Value* rhs = rkc(i);
-                dest(i) = number(lhs->number - rhs->number);
-                break;
+                vmquicken(OP_SUBNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    if (!vec_arith(bt, OP_SUB, lhs, rhs, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) - tonumber(*rhs));
+                vmbreak;
             }
-            case OP_MUL: {
+            vmcase(OP_MUL) {
                 bt_Value* lhs = rkb(i);
                 bt_Value* rhs = rkc(i);
-                dest(i) = number(lhs->number * rhs->number);
-                break;
+                vmquicken(OP_MULNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    if (!vec_arith(bt, OP_MUL, lhs, rhs, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) * tonumber(*rhs));
+                vmbreak;
             }
-            case OP_DIV: {
+            vmcase(OP_DIV) {
                 bt_Value* lhs = rkb(i);
                 bt_Value* rhs = rkc(i);
-                dest(i) = number(lhs->number / rhs->number);
-                break;
+                vmquicken(OP_DIVNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    if (!vec_arith(bt, OP_DIV, lhs, rhs, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) / tonumber(*rhs));
+                vmbreak;
+            }
+
+            vmcase(OP_ADDI) {
+                bt_Value* lhs = rkb(i);
+#ifndef BT_NO_QUICKENING
+                if (!(i & 0x40) && isnumber(*lhs)) {
+                    rewrite(i, OP_ADDIN);
+                }
+#endif
+                if (!isnumber(*lhs)) {
+                    bt_Value k = number((BT_NUMBER)argsc(i));
+                    if (!vec_arith(bt, OP_ADD, lhs, &k, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) + argsc(i));
+                vmbreak;
+            }
+            vmcase(OP_SUBI) {
+                bt_Value* lhs = rkb(i);
+#ifndef BT_NO_QUICKENING
+                if (!(i & 0x40) && isnumber(*lhs)) {
+                    rewrite(i, OP_SUBIN);
+                }
+#endif
+                if (!isnumber(*lhs)) {
+                    bt_Value k = number((BT_NUMBER)argsc(i));
+                    if (!vec_arith(bt, OP_SUB, lhs, &k, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) - argsc(i));
+                vmbreak;
+            }
+            vmcase(OP_MULI) {
+                bt_Value* lhs = rkb(i);
+#ifndef BT_NO_QUICKENING
+                if (!(i & 0x40) && isnumber(*lhs)) {
+                    rewrite(i, OP_MULIN);
+                }
+#endif
+                if (!isnumber(*lhs)) {
+                    bt_Value k = number((BT_NUMBER)argsc(i));
+                    if (!vec_arith(bt, OP_MUL, lhs, &k, &dest(i))) {
+                        vmerror();
+                    }
+                    vmbreak;
+                }
+                dest(i) = number(tonumber(*lhs) * argsc(i));
+                vmbreak;
             }
 
-            case OP_NEG: {
+            vmcase(OP_NEG) {
                 bt_Value* vl = rkc(i);
-                dest(i) = number(-vl->number);
-                break;
+                if (!isnumber(*vl)) {
+                    vmerror();
+                }
+                dest(i) = number(-tonumber(*vl));
+                vmbreak;
             }
-            case OP_NOT: {
+            vmcase(OP_NOT) {
                 bt_Value* vl = rkc(i);
-                dest(i) = boolean(!vl->boolean);
-                break;
+                dest(i) = boolean(!test(vl));
+                vmbreak;
             }
 
-            case OP_EQUAL: {
-                if (equal(rkb(i), rkc(i)) == arga(i)) {
-                    ++c->ip;
+            /*
+            ** Comparisons dispatch separately on each path, which keeps
+            ** the compiler from turning the skip into a conditional move
+            ** that the next fetch would have to wait on.
+            */
+            vmcase(OP_EQUAL) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                vmquicken(OP_EQUALNN, lhs, rhs);
+                if (equal(lhs, rhs) == arga(i)) {
+                    ++ip;
+                    vmbreak;
                 }
-                break;
+                vmbreak;
             }
-            case OP_LEQUAL: {
-                if (lequal(rkb(i), rkc(i)) == arga(i)) {
-                    ++c->ip;
+            vmcase(OP_LEQUAL) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                vmquicken(OP_LEQUALNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmerror();
+                }
+                if (lequal(lhs, rhs) == arga(i)) {
+                    ++ip;
+                    vmbreak;
                 }
-                break;
+                vmbreak;
             }
-            case OP_LESS: {
-                if (less(rkb(i), rkc(i)) == arga(i)) {
-                    ++c->ip;
+            vmcase(OP_LESS) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                vmquicken(OP_LESSNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmerror();
+                }
+                if (less(lhs, rhs) == arga(i)) {
+                    ++ip;
+                    vmbreak;
                 }
-                break;
+                vmbreak;
             }
-            case OP_TEST: {
+            vmcase(OP_TEST) {
                 if (test(rkc(i)) == arga(i)) {
-                    ++c->ip;
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+
+            /* Fused comparisons take the OP_JUMP after them directly */
+            vmcase(OP_JEQUAL) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                vmquicken(OP_JEQUALNN, lhs, rhs);
+                if (equal(lhs, rhs) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+            vmcase(OP_JLEQUAL) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                vmquicken(OP_JLEQUALNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmerror();
+                }
+                if (lequal(lhs, rhs) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+            vmcase(OP_JLESS) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                vmquicken(OP_JLESSNN, lhs, rhs);
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmerror();
+                }
+                if (less(lhs, rhs) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+            vmcase(OP_JTEST) {
+                if (test(rkc(i)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+
+            vmcase(OP_JUMP) {
+                vmjump(fn->program + argbx(i));
+                vmbreak;
+            }
+
+            vmcase(OP_CALL) {
+            call:
+                if (vtype(dest(i)) != VT_CLOSURE) {
+                    if (vtype(dest(i)) != VT_GEN) {
+                        vmerror();
+                    }
+                    // Resume the generator, it hands its next value back through this register
+                    bt_Thread* gt = togenerator(dest(i))->thread;
+                    if (gt == NULL) {
+                        dest(i) = nil();
+                        vmnative();
+                        vmbreak;
+                    }
+                    if (gt->resumer != NULL) {
+                        vmerror(); // Already running
+                    }
+                    c->ip = ip;
+                    vmflush();
+                    t->resumed = gt;
+                    gt->resumer = t;
+                    vmswitch(gt);
+                    vmnative();
+                    vmbreak;
+                }
+                bt_Function* callee = toclosure(dest(i))->function;
+                if (callee->type == FT_GEN) {
+                    Generator* g = newgenerator(bt, callee, &dest(i) + 1, argb(i));
+                    if (g == NULL) {
+                        vmerror();
+                    }
+                    dest(i) = generator(g);
+                    ctx_gccheck(bt);
+                    vmnative();
+                    vmbreak;
+                }
+                Call* next = c->next;
+                if (next == NULL) {
+                    if ((next = pushcall(c)) == NULL) {
+                        vmerror();
+                    }
+                    ++allocs;
+                }
+                c->ip = ip;
+                next->fn = callee;
+                next->ip = next->fn->program;
+                next->base = &dest(i) + 1;
+                t->call = next;
+                if (!openframe(t, next, argb(i), &allocs)) {
+                    t->call = c;
+                    vmerror();
+                }
+                c = next;
+                vmflush();
+                vmenter();
+                vmnative();
+                vmbreak;
+            }
+            vmcase(OP_TAILCALL) {
+                // Generators don't take over frames, they're called normally and returned after
+                if (vtype(dest(i)) != VT_CLOSURE || toclosure(dest(i))->function->type == FT_GEN) {
+                    goto call;
+                }
+                // The callee takes over this frame, so its arguments move down to the base
+                bt_Function* callee = toclosure(dest(i))->function;
+                bt_Value* args = &dest(i) + 1;
+                for (int a = 0; a != argb(i); ++a) {
+                    reg[a] = args[a];
+                }
+                vmflush();
+                c->fn = callee;
+                c->ip = callee->program;
+                if (!openframe(t, c, argb(i), &allocs)) {
+                    c->fn = fn;
+                    vmerror();
                 }
-                break;
+                vmenter();
+                vmnative();
+                vmbreak;
             }
 
-            case OP_JUMP: {
-                c->ip = fn->program + argbx(i);
-                break;
+            vmcase(OP_YIELD) {
+                c->ip = ip;
+                bt_Thread* r = t->resumer;
+                if (r == NULL) {
+                    vmsave();
+                    return THREAD_VALUE;
+                }
+                // The generator's thread changed without barriers, so it's traversed again
+                bt_Value* slot = resumeslot(r);
+                ctx_barrierback(bt, togenerator(*slot));
+                *slot = *rkc(i);
+                vmflush();
+                r->resumed = NULL;
+                t->resumer = NULL;
+                vmswitch(r);
+                vmnative();
+                vmbreak;
             }
 
-            case OP_RETURN: {
-                return 1;
+            vmcase(OP_RETURN) {
+                if (c->previous == NULL) {
+                    bt_Thread* r = t->resumer;
+                    if (r == NULL) {
+                        c->ip = ip;
+                        vmsave();
+                        return THREAD_DONE;
+                    }
+                    // A generator returning hands its result back as a last value, and its thread back
+                    bt_Value* slot = resumeslot(r);
+                    togenerator(*slot)->thread = NULL;
+                    *slot = arga(i) ? *rkc(i) : nil();
+                    vmflush();
+                    r->resumed = NULL;
+                    t->resumer = NULL;
+                    thread_finish(t);
+                    ctx_retirethread(bt, t);
+                    vmswitch(r);
+                    vmnative();
+                    vmbreak;
+                }
+                // The callee was in the register just below the frame
+                reg[-1] = arga(i) ? *rkc(i) : nil();
+                vmflush();
+                t->call = c = c->previous;
+                fn = c->fn;
+                reg = c->base;
+                ip = c->ip;
+                vmnative();
+                vmbreak;
             }
 
-            case OP_PRINT: {
+            vmcase(OP_PRINT) {
                 printvalue(rkc(i));
-                break;
+                vmbreak;
+            }
+
+            /*
+            ** Arrays.
+            ** Anything but an array where one's expected, or anything but a
+            ** number as an index, length or element, is an error, as are arrays
+            ** of different lengths. Reading an index that's out of range gives
+            ** nil, but writing past the end, other than appending, is an
+            ** error. Bulk operations are charged their length against the
+            ** budget.
+            */
+            vmcase(OP_NEWARRAY) {
+                Array* a = array_new(bt, rkc(i), &reg[arga(i) + 1], argb(i));
+                if (a == NULL) {
+                    vmerror();
+                }
+                budget -= (BT_TIMER)a->length;
+                dest(i) = array(a);
+                ctx_gccheck(bt);
+                vmbreak;
+            }
+            vmcase(OP_GETINDEX) {
+                bt_Value* arr = rkb(i);
+                bt_Value* idx = rkc(i);
+                if (vtype(*arr) != VT_ARRAY || !isnumber(*idx)) {
+                    vmerror();
+                }
+                dest(i) = array_get(toarray(*arr), tonumber(*idx));
+                vmbreak;
+            }
+            vmcase(OP_SETINDEX) {
+                bt_Value* arr = &reg[arga(i)];
+                if (vtype(*arr) != VT_ARRAY || !array_set(bt, toarray(*arr), rkb(i), rkc(i))) {
+                    vmerror();
+                }
+                vmbreak;
+            }
+            vmcase(OP_LEN) {
+                bt_Value* arr = rkc(i);
+                if (vtype(*arr) != VT_ARRAY) {
+                    vmerror();
+                }
+                dest(i) = number(toarray(*arr)->length);
+                vmbreak;
+            }
+            vmcase(OP_SUM) {
+                bt_Value* arr = rkc(i);
+                if (vtype(*arr) != VT_ARRAY) {
+                    vmerror();
+                }
+                Array* a = toarray(*arr);
+                budget -= (BT_TIMER)a->length;
+                dest(i) = number(array_sum(a->data, a->length));
+                vmbreak;
+            }
+            vmcase(OP_DOT) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                if (vtype(*lhs) != VT_ARRAY || vtype(*rhs) != VT_ARRAY
+                    || toarray(*lhs)->length != toarray(*rhs)->length) {
+                    vmerror();
+                }
+                Array* a = toarray(*lhs);
+                budget -= (BT_TIMER)a->length;
+                dest(i) = number(array_dot(a->data, toarray(*rhs)->data, a->length));
+                vmbreak;
+            }
+            vmcase(OP_SCALE) {
+                bt_Value* arr = rkb(i);
+                bt_Value* k = rkc(i);
+                if (vtype(*arr) != VT_ARRAY || !isnumber(*k)) {
+                    vmerror();
+                }
+                Array* a = toarray(*arr);
+                budget -= (BT_TIMER)a->length;
+                array_scale(a->data, tonumber(*k), a->length);
+                dest(i) = *arr;
+                vmbreak;
+            }
+            vmcase(OP_ADDARRAY) {
+                bt_Value* lhs = rkb(i);
+                bt_Value* rhs = rkc(i);
+                if (vtype(*lhs) != VT_ARRAY || vtype(*rhs) != VT_ARRAY
+                    || toarray(*lhs)->length != toarray(*rhs)->length) {
+                    vmerror();
+                }
+                Array* a = toarray(*lhs);
+                budget -= (BT_TIMER)a->length;
+                array_add(a->data, toarray(*rhs)->data, a->length);
+                dest(i) = *lhs;
+                vmbreak;
+            }
+            vmcase(OP_VEC) {
+                if (!vec_new(bt, &reg[argb(i)], argc(i), &dest(i))) {
+                    vmerror();
+                }
+                vmbreak;
+            }
+
+            /*
+            ** Quickened instructions.
+            ** Constants never change, so NK variants only check arg B.
+            */
+            vmcase(OP_ADDNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                BT_NUMBER n = tonumber(*lhs) + tonumber(*rhs);
+                if (!checknumbers(n, *lhs, *rhs)) {
+                    vmunquicken(OP_ADD);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+            vmcase(OP_ADDNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) + tonumber(fn->constants[argc(i)]);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_ADD);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+
+            vmcase(OP_SUBNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                BT_NUMBER n = tonumber(*lhs) - tonumber(*rhs);
+                if (!checknumbers(n, *lhs, *rhs)) {
+                    vmunquicken(OP_SUB);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+            vmcase(OP_SUBNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) - tonumber(fn->constants[argc(i)]);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_SUB);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+
+            vmcase(OP_MULNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                BT_NUMBER n = tonumber(*lhs) * tonumber(*rhs);
+                if (!checknumbers(n, *lhs, *rhs)) {
+                    vmunquicken(OP_MUL);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+            vmcase(OP_MULNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) * tonumber(fn->constants[argc(i)]);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_MUL);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+
+            vmcase(OP_DIVNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                BT_NUMBER n = tonumber(*lhs) / tonumber(*rhs);
+                if (!checknumbers(n, *lhs, *rhs)) {
+                    vmunquicken(OP_DIV);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+            vmcase(OP_DIVNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) / tonumber(fn->constants[argc(i)]);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_DIV);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+
+            vmcase(OP_ADDIN) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) + argsc(i);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_ADDI);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+            vmcase(OP_SUBIN) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) - argsc(i);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_SUBI);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+            vmcase(OP_MULIN) {
+                bt_Value* lhs = &reg[argb(i)];
+                BT_NUMBER n = tonumber(*lhs) * argsc(i);
+                if (!checknumber(n, *lhs)) {
+                    vmunquicken(OP_MULI);
+                }
+                dest(i) = number(n);
+                vmbreak;
+            }
+
+            vmcase(OP_EQUALNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmunquicken(OP_EQUAL);
+                }
+                if ((tonumber(*lhs) == tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+            vmcase(OP_EQUALNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &fn->constants[argc(i)];
+                if (!isnumber(*lhs)) {
+                    vmunquicken(OP_EQUAL);
+                }
+                if ((tonumber(*lhs) == tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+
+            vmcase(OP_LEQUALNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmunquicken(OP_LEQUAL);
+                }
+                if ((tonumber(*lhs) <= tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+            vmcase(OP_LEQUALNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &fn->constants[argc(i)];
+                if (!isnumber(*lhs)) {
+                    vmunquicken(OP_LEQUAL);
+                }
+                if ((tonumber(*lhs) <= tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+
+            vmcase(OP_LESSNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmunquicken(OP_LESS);
+                }
+                if ((tonumber(*lhs) < tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+            vmcase(OP_LESSNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &fn->constants[argc(i)];
+                if (!isnumber(*lhs)) {
+                    vmunquicken(OP_LESS);
+                }
+                if ((tonumber(*lhs) < tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmbreak;
+            }
+
+            vmcase(OP_JEQUALNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmunquicken(OP_JEQUAL);
+                }
+                if ((tonumber(*lhs) == tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+            vmcase(OP_JEQUALNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &fn->constants[argc(i)];
+                if (!isnumber(*lhs)) {
+                    vmunquicken(OP_JEQUAL);
+                }
+                if ((tonumber(*lhs) == tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+
+            vmcase(OP_JLEQUALNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmunquicken(OP_JLEQUAL);
+                }
+                if ((tonumber(*lhs) <= tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+            vmcase(OP_JLEQUALNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &fn->constants[argc(i)];
+                if (!isnumber(*lhs)) {
+                    vmunquicken(OP_JLEQUAL);
+                }
+                if ((tonumber(*lhs) <= tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+
+            vmcase(OP_JLESSNN) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &reg[argc(i)];
+                if (!isnumbers(*lhs, *rhs)) {
+                    vmunquicken(OP_JLESS);
+                }
+                if ((tonumber(*lhs) < tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
+            }
+            vmcase(OP_JLESSNK) {
+                bt_Value* lhs = &reg[argb(i)];
+                bt_Value* rhs = &fn->constants[argc(i)];
+                if (!isnumber(*lhs)) {
+                    vmunquicken(OP_JLESS);
+                }
+                if ((tonumber(*lhs) < tonumber(*rhs)) == arga(i)) {
+                    ++ip;
+                    vmbreak;
+                }
+                vmjump(fn->program + argbx(*ip));
+                vmbreak;
             }
         }
     }
 
-    return 0;
+#ifdef BT_JIT
+native:
+    {
+        JitExit e = jit_run(bt, fn, reg, ip, budget);
+        budget = e.budget;
+        if (e.pc < 0) {
+            c->ip = fn->program + (-e.pc - 1);
+            vmsave();
+            return THREAD_YIELD;
+        }
+        // Native code stopped on an instruction for the interpreter
+        ip = fn->program + e.pc;
+        goto dispatch;
+    }
+#endif
 }
 
+#ifdef BT_SAMPLE
+/*
+** Fills [frames] with where the thread running on this OS thread is,
+** innermost frame first, carrying on through the threads that resumed
+** generators. It's called from a signal handler, possibly in the middle
+** of a call, so it only reads and skips anything that doesn't add up.
+** Returns how many frames were filled, 0 if no script is running.
+*/
+int thread_backtrace(ProfileFrame* frames, int max)
+{
+    int n = 0;
+    for (bt_Thread* t = running; t != NULL && n != max; t = t->resumer) {
+        for (Call* c = t->call; c != NULL && c->fn != NULL && n != max; c = c->previous) {
+            bt_Function* fn = c->fn;
+            // The frame's ip is past the instruction it's on
+            long pc = (long)(((volatile Call*)c)->ip - fn->program) - 1;
+            frames[n].fn = fn;
+            frames[n].pc = pc >= 0 && pc < fn->progcount ? (int)pc : 0;
+            ++n;
+        }
+    }
+    return n;
+}
+#endif
 
-// Temp?
-BT_API void bt_call(bt_Context* bt, bt_Function* fn)
+/* The JIT calls out to these for what its templates don't do inline */
+void thread_print(bt_Value* vl)
+{
+    printvalue(vl);
+}
+
+int thread_equal(bt_Value* l, bt_Value* r)
+{
+    return equal(l, r);
+}
+
+int thread_test(bt_Value* vl)
+{
+    return test(vl);
+}
+
+/*
+** Sets a thread up to run [fn] from the start.
+** Returns 0 if the stack it needs can't be allocated.
+*/
+int thread_start(bt_Thread* t, bt_Function* fn)
 {
-    // return;
-    bt_Thread* t = ctx_getthread(bt);
     Call* c = t->call;
-    bt_Closure* cl = malloc(sizeof(bt_Closure));
-    cl->function = fn;
-    c->closure = cl;
+    if (!thread_reserve(t, (int)(c->base - t->stack) + fn->registers)) {
+        return 0;
+    }
+    c->fn = fn;
     c->ip = fn->program;
-    thread_execute(bt, t);
-    free(cl);
+    return 1;
+}
+
+/*
+** Takes a thread back to its bottom frame, wherever it stopped, so it can be started again.
+** Generators it was running are let go of, to stop wherever they were.
+*/
+void thread_finish(bt_Thread* t)
+{
+    for (bt_Thread* r = t; r->resumed != NULL; ) {
+        bt_Thread* gt = r->resumed;
+        r->resumed = NULL;
+        gt->resumer = NULL;
+        r = gt;
+    }
+    while (t->call->previous != NULL) {
+        t->call = t->call->previous;
+    }
+    t->call->fn = NULL;
+}
+
+/*
+** Calls a function on a thread of its own and waits for it to return.
+** Runs in long slices, since nothing else is waiting for the thread.
+*/
+BT_API void bt_call(bt_Context* bt, bt_Function* fn)
+{
+    bt_Thread* t = ctx_getthread(bt);
+    if (thread_start(t, fn)) {
+        int result;
+        do {
+            t->timer = CALL_SLICE;
+            result = thread_execute(bt, t);
+        } while (result == THREAD_YIELD || result == THREAD_VALUE);
+        thread_finish(t);
+    }
+    ctx_releasethread(bt, t);
+}
+
+/*
+** Sets [fn] up to be run a value at a time by bt_next.
+** Returns NULL if its stack can't be allocated.
+*/
+BT_API bt_Thread* bt_newgenerator(bt_Context* bt, bt_Function* fn)
+{
+    bt_Thread* t = ctx_getthread(bt);
+    if (!thread_start(t, fn)) {
+        ctx_releasethread(bt, t);
+        return NULL;
+    }
+    return t;
+}
+
+/*
+** Runs a generator from bt_newgenerator until it yields, and stores the value in [out].
+** Values that aren't numbers come out as 0. Returns 0 once the function
+** has returned or stopped on an error, and 1 while it has values to give.
+** Nothing is allocated between values.
+*/
+BT_API int bt_next(bt_Context* bt, bt_Thread* gen, BT_NUMBER* out)
+{
+    if (gen->call->fn == NULL) {
+        return 0;
+    }
+    int result;
+    do {
+        gen->timer = CALL_SLICE;
+        result = thread_execute(bt, gen);
+    } while (result == THREAD_YIELD);
+    if (result != THREAD_VALUE) {
+        thread_finish(gen);
+        return 0;
+    }
+    Call* c = gen->call;
+    Instruction i = c->ip[-1];
+    bt_Value* vl = i & 0x80 ? &c->fn->constants[argc(i)] : &c->base[argc(i)];
+    *out = vtype(*vl) == VT_NUMBER ? tonumber(*vl) : 0;
+    return 1;
+}
+
+/* Frees a generator from bt_newgenerator, whether or not it has run out */
+BT_API void bt_freegenerator(bt_Context* bt, bt_Thread* gen)
+{
+    thread_finish(gen);
+    ctx_releasethread(bt, gen);
+}
+
+/* Retrieves the inline cache statistics of a function */
+BT_API void bt_cachestats(bt_Function* fn, unsigned long* hits, unsigned long* misses)
+{
+    *hits = fn->cachehits;
+    *misses = fn->cachemisses;
+}
+
+/*
+** Retrieves how many calls scripts have made, and how many times those
+** calls had to allocate a frame or grow a stack. Frames are reused, so
+** once a thread has been as deep as it goes, calls stop allocating.
+*/
+BT_API void bt_callstats(bt_Context* bt, unsigned long* calls, unsigned long* allocs)
+{
+    CallInfo* ci = ctx_callinfo(bt);
+    *calls = ci->calls;
+    *allocs = ci->allocs;
+}
+
+/*
+** Retrieves how many instructions the interpreter has dispatched.
+** Only counted in builds with BT_COUNT_DISPATCHES, and always 0 otherwise.
+** Instructions run as native code by the JIT aren't dispatched.
+*/
+BT_API void bt_dispatchstats(bt_Context* bt, unsigned long* dispatches)
+{
+    *dispatches = ctx_callinfo(bt)->dispatches;
 }
\ No newline at end of file
@@ -5,16 +5,52 @@
 #include "value.h"
 
 typedef struct Call Call;
+typedef struct ProfileFrame ProfileFrame;
+
+/* Results of thread_execute */
+enum {
+    THREAD_YIELD, // Ran out of time, can be resumed
+    THREAD_VALUE, // Yielded a value to the host, can be resumed
+    THREAD_DONE, // Returned from its function
+    THREAD_ERROR // Called something that isn't a function, or ran out of stack
+};
+
+/* Timer given to threads run by bt_call, which don't share their time */
+#define CALL_SLICE (1 << 30)
 
 struct bt_Thread {
     bt_Thread* next;
-    BT_TIMER timer;
+    BT_TIMER timer; // Budget left in the current time slice
     bt_Value* stack;
     int stacksize;
     Call* call;
+    bt_Thread* resumed; // Generator this thread is running, until it yields
+    bt_Thread* resumer; // Thread that resumed this generator, while it runs
+};
+
+/*
+** Generator object, made by calling a FT_GEN function from a script.
+** It runs on a thread of its own, which keeps its frames and registers
+** in place between values, so resuming it doesn't allocate anything.
+*/
+struct Generator {
+    bt_Thread* thread; // NULL once the function has returned
 };
 
 bt_Thread* thread_new();
+int thread_reserve(bt_Thread* t, int size);
+void thread_free(bt_Thread* t);
+void thread_mark(bt_Context* bt, bt_Thread* t);
+int thread_start(bt_Thread* t, bt_Function* fn);
+void thread_finish(bt_Thread* t);
 int thread_execute(bt_Context* bt, bt_Thread* t);
 
+void thread_print(bt_Value* vl);
+int thread_equal(bt_Value* l, bt_Value* r);
+int thread_test(bt_Value* vl);
+
+#ifdef BT_SAMPLE
+int thread_backtrace(ProfileFrame* frames, int max);
+#endif
+
 #endif
\ No newline at end of file
@@ -3,24 +3,130 @@
 
 #include "bullet_train.h"
 
+typedef struct Generator Generator;
+typedef struct Array Array;
+typedef struct Vector Vector;
+
+/* Value types */
 enum {
     VT_NIL,
-    VT_NUMBER,
     VT_BOOL,
     VT_CLOSURE,
-    VT_STRUCT
+    VT_STRUCT,
+    VT_GEN,
+    VT_ARRAY,
+    VT_VEC, // Boxed vector, with NaN boxing
+    VT_NUMBER, // Last of the types NaN boxing tags, since it doesn't tag numbers
+    VT_VEC2, VT_VEC3, VT_VEC4 // Vectors kept in the value, without NaN boxing
 };
 
+#ifdef BT_NAN_BOXING
+
+#include <stdint.h>
+
+/*
+** NaN boxed value, 8 bytes.
+** Numbers are stored as plain doubles. Everything else hides in negative
+** quiet NaNs the hardware never produces: the top 16 bits are 0xFFF9 + type,
+** and the low 48 bits hold a boolean or a pointer. That has room for seven
+** types besides numbers, which VT_VEC fills. Vectors don't fit in the
+** payload, so they're boxed, see vector.h.
+*/
+struct bt_Value {
+    uint64_t bits;
+};
+
+#define NB_PAYLOAD 0x0000FFFFFFFFFFFFull
+#define nbtag(t) ((uint64_t)(0xFFF9 + (t)) << 48)
+
+static inline BT_NUMBER nbtonumber(uint64_t bits)
+{
+    union { uint64_t u; BT_NUMBER n; } pun = { .u = bits };
+    return pun.n;
+}
+
+static inline uint64_t nbfromnumber(BT_NUMBER n)
+{
+    union { BT_NUMBER n; uint64_t u; } pun = { .n = n };
+    return pun.u;
+}
+
+#define vtype(v) ((v).bits >> 48 > 0xFFF8 ? (int)((v).bits >> 48) - 0xFFF9 : VT_NUMBER)
+#define isnumber(v) ((v).bits < nbtag(VT_NIL))
+#define isnumbers(a, b) (isnumber(a) && isnumber(b))
+#define tonumber(v) nbtonumber((v).bits)
+#define toboolean(v) ((int)((v).bits & 1))
+#define toclosure(v) ((bt_Closure*)(uintptr_t)((v).bits & NB_PAYLOAD))
+#define tostruct(v) ((bt_Struct*)(uintptr_t)((v).bits & NB_PAYLOAD))
+#define togenerator(v) ((Generator*)(uintptr_t)((v).bits & NB_PAYLOAD))
+#define toarray(v) ((Array*)(uintptr_t)((v).bits & NB_PAYLOAD))
+#define tovector(v) ((Vector*)(uintptr_t)((v).bits & NB_PAYLOAD))
+
+#define nil() ((bt_Value) { .bits = nbtag(VT_NIL) })
+#define number(n) ((bt_Value) { .bits = nbfromnumber(n) })
+#define boolean(b) ((bt_Value) { .bits = nbtag(VT_BOOL) | ((b) != 0) })
+#define closure(c) ((bt_Value) { .bits = nbtag(VT_CLOSURE) | (uintptr_t)(c) })
+#define struc(s) ((bt_Value) { .bits = nbtag(VT_STRUCT) | (uintptr_t)(s) })
+#define generator(g) ((bt_Value) { .bits = nbtag(VT_GEN) | (uintptr_t)(g) })
+#define array(a) ((bt_Value) { .bits = nbtag(VT_ARRAY) | (uintptr_t)(a) })
+#define vector(v) ((bt_Value) { .bits = nbtag(VT_VEC) | (uintptr_t)(v) })
+
+/* Checks if a value refers to a GC object, which stores into another need a barrier for */
+#define isobject(v) ((unsigned)(vtype(v) - VT_STRUCT) <= VT_VEC - VT_STRUCT)
+
+/*
+** Checks arithmetic on [a] and [b] that came to [n] was done on numbers.
+** Every other type is a NaN, and NaNs carry through arithmetic, so this
+** only fails on NaN results. Those might still be numbers, like 0 / 0,
+** which is up to the caller to sort out.
+*/
+#define checknumber(n, a) ((n) == (n))
+#define checknumbers(n, a, b) ((n) == (n))
+
+#else
+
 struct bt_Value {
     union {
         BT_NUMBER number;
         int boolean;
         bt_Closure* closure;
         bt_Struct* struc;
+        Generator* gen;
+        Array* array;
+#ifdef BT_VECTORS
+        float vec[4]; // Components of a vector, see vector.h
+#endif
     };
     int type;
 };
 
+#define vtype(v) ((v).type)
+#define isnumber(v) ((v).type == VT_NUMBER)
+#define isnumbers(a, b) (isnumber(a) && isnumber(b))
+#define tonumber(v) ((v).number)
+#define toboolean(v) ((v).boolean)
+#define toclosure(v) ((v).closure)
+#define tostruct(v) ((v).struc)
+#define togenerator(v) ((v).gen)
+#define toarray(v) ((v).array)
+
+#define nil() ((bt_Value) { .type = VT_NIL })
+#define number(n) ((bt_Value) { .number = (n), .type = VT_NUMBER })
+#define boolean(b) ((bt_Value) { .boolean = (b), .type = VT_BOOL })
+#define closure(c) ((bt_Value) { .closure = (c), .type = VT_CLOSURE })
+#define struc(s) ((bt_Value) { .struc = (s), .type = VT_STRUCT })
+#define generator(g) ((bt_Value) { .gen = (g), .type = VT_GEN })
+#define array(a) ((bt_Value) { .array = (a), .type = VT_ARRAY })
+
+/* Checks if a value refers to a GC object, which stores into another need a barrier for */
+#define isobject(v) ((unsigned)(vtype(v) - VT_STRUCT) <= VT_ARRAY - VT_STRUCT)
+
+/* Types are kept apart from numbers here, so checks look at them */
+#define checknumber(n, a) isnumber(a)
+#define checknumbers(n, a, b) isnumbers(a, b)
+
+#endif
+
 struct bt_Closure {
     bt_Function* function;
     bt_Value* upvalues[];
@@ -0,0 +1,201 @@
+#include <string.h>
+
+#include "vector.h"
+#include "function.h"
+
+#ifdef BT_VECTORS
+
+/* Arithmetic works on all four components at once with SSE on x86-64 */
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define VECTOR_SSE
+#endif
+
+#ifdef BT_NAN_BOXING
+/* Boxes hold nothing but floats, so there's nothing to traverse or free */
+static const GCType vectortype = { NULL, NULL, 0 };
+#endif
+
+/* Writes a vector of [count] components from [v] to [dst] */
+static void storevec(bt_Context* bt, bt_Value* dst, const float* v, int count)
+{
+#ifdef BT_NAN_BOXING
+    Vector* box = ctx_gcalloc(bt, sizeof(Vector), &vectortype);
+    memcpy(box->v, v, sizeof(box->v));
+    box->count = count;
+    *dst = vector(box);
+    ctx_gccheck(bt);
+#else
+    (void)bt;
+    bt_Value vl = { .type = VT_VEC2 + count - 2 };
+    memcpy(vl.vec, v, sizeof(vl.vec));
+    *dst = vl;
+#endif
+}
+
+/* Spreads a vector's components, or a number over all four, into [v] */
+static void spread(bt_Value* vl, float* v)
+{
+    if (isnumber(*vl)) {
+        v[0] = v[1] = v[2] = v[3] = (float)tonumber(*vl);
+    } else {
+        memcpy(v, veccomponents(*vl), sizeof(float) * 4);
+    }
+}
+
+/*
+** Finds the components a swizzle like "x" or "zyx" picks, putting their
+** indices in [idx]. Returns how many there are, or 0 if [k] isn't a swizzle.
+*/
+int vec_swizzle(Key* k, int* idx)
+{
+    if (k->length > 4) {
+        return 0;
+    }
+    for (int i = 0; i != k->length; ++i) {
+        switch (k->text[i])
+        {
+            case 'x': idx[i] = 0; break;
+            case 'y': idx[i] = 1; break;
+            case 'z': idx[i] = 2; break;
+            case 'w': idx[i] = 3; break;
+            default: return 0;
+        }
+    }
+    return k->length;
+}
+
+/*
+** Makes a vector from [count] numbers in [components], into [dst].
+** Returns 0 if there aren't 2 to 4 of them or one isn't a number.
+*/
+int vec_new(bt_Context* bt, bt_Value* components, int count, bt_Value* dst)
+{
+    float v[4] = { 0 };
+    if (count < 2 || count > 4) {
+        return 0;
+    }
+    for (int i = 0; i != count; ++i) {
+        if (!isnumber(components[i])) {
+            return 0;
+        }
+        v[i] = (float)tonumber(components[i]);
+    }
+    storevec(bt, dst, v, count);
+    return 1;
+}
+
+/*
+** Carries out OP_ADD, OP_SUB, OP_MUL or OP_DIV component by component.
+** Either side can be a number, which goes with every component. Returns 0
+** unless it's two vectors of the same size or a vector and a number.
+*/
+int vec_arith(bt_Context* bt, int op, bt_Value* lhs, bt_Value* rhs, bt_Value* dst)
+{
+    if (!isvector(*lhs) && !isvector(*rhs)) {
+        return 0;
+    }
+    int count = isvector(*lhs) ? veccount(*lhs) : veccount(*rhs);
+    if (!(isnumber(*lhs) || (isvector(*lhs) && veccount(*lhs) == count))
+        || !(isnumber(*rhs) || (isvector(*rhs) && veccount(*rhs) == count))) {
+        return 0;
+    }
+    float l[4], r[4], v[4];
+    spread(lhs, l);
+    spread(rhs, r);
+#ifdef VECTOR_SSE
+    __m128 a = _mm_loadu_ps(l), b = _mm_loadu_ps(r);
+    switch (op)
+    {
+        case OP_ADD: _mm_storeu_ps(v, _mm_add_ps(a, b)); break;
+        case OP_SUB: _mm_storeu_ps(v, _mm_sub_ps(a, b)); break;
+        case OP_MUL: _mm_storeu_ps(v, _mm_mul_ps(a, b)); break;
+        default:     _mm_storeu_ps(v, _mm_div_ps(a, b)); break;
+    }
+#else
+    for (int i = 0; i != 4; ++i) {
+        switch (op)
+        {
+            case OP_ADD: v[i] = l[i] + r[i]; break;
+            case OP_SUB: v[i] = l[i] - r[i]; break;
+            case OP_MUL: v[i] = l[i] * r[i]; break;
+            default:     v[i] = l[i] / r[i]; break;
+        }
+    }
+#endif
+    storevec(bt, dst, v, count);
+    return 1;
+}
+
+/*
+** Reads the components of vector [vl] that swizzle [k] picks into [dst]:
+** a number for one, a vector for more. Returns 0 if [vl] isn't a vector,
+** [k] isn't a swizzle or it picks a component the vector doesn't have.
+*/
+int vec_get(bt_Context* bt, bt_Value* vl, Key* k, bt_Value* dst)
+{
+    int idx[4], n;
+    if (!isvector(*vl) || (n = vec_swizzle(k, idx)) == 0) {
+        return 0;
+    }
+    const float* c = veccomponents(*vl);
+    float v[4] = { 0 };
+    for (int i = 0; i != n; ++i) {
+        if (idx[i] >= veccount(*vl)) {
+            return 0;
+        }
+        v[i] = c[idx[i]];
+    }
+    if (n == 1) {
+        *dst = number(v[0]);
+    } else {
+        storevec(bt, dst, v, n);
+    }
+    return 1;
+}
+
+/*
+** Sets the components of vector [vl] that swizzle [k] picks from [src],
+** a number or a vector with as many components. Returns 0, changing
+** nothing, if [vl] isn't a vector or the swizzle or [src] don't fit.
+*/
+int vec_set(bt_Context* bt, bt_Value* vl, Key* k, bt_Value* src)
+{
+    int idx[4], n;
+    if (!isvector(*vl) || (n = vec_swizzle(k, idx)) == 0
+        || !(isnumber(*src) || (isvector(*src) && veccount(*src) == n))) {
+        return 0;
+    }
+    int count = veccount(*vl);
+    float v[4], s[4];
+    for (int i = 0; i != n; ++i) {
+        if (idx[i] >= count) {
+            return 0;
+        }
+    }
+    memcpy(v, veccomponents(*vl), sizeof(v));
+    spread(src, s);
+    for (int i = 0; i != n; ++i) {
+        v[idx[i]] = s[i];
+    }
+    storevec(bt, vl, v, count);
+    return 1;
+}
+
+/* Vectors are equal when they're the same size and every component is */
+int vec_equal(bt_Value* l, bt_Value* r)
+{
+    if (veccount(*l) != veccount(*r)) {
+        return 0;
+    }
+    const float* a = veccomponents(*l);
+    const float* b = veccomponents(*r);
+    for (int i = 0; i != veccount(*l); ++i) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef _VECTOR_H_
+#define _VECTOR_H_
+
+#include "bullet_train.h"
+#include "value.h"
+#include "context.h"
+
+/*
+** Vectors of 2 to 4 components.
+** Components are floats whatever BT_NUMBER is, so a whole vector fits in
+** one SSE register. Vectors are values: they're copied like numbers, and
+** changing a component of one never shows through another. Without NaN
+** boxing they're kept in the bt_Value itself, and the type says how many
+** components there are. NaN boxed values have no room for them, so there
+** they're boxed in a GC object that's never changed, and changing a
+** component makes a new box.
+*/
+#ifdef BT_VECTORS
+
+#ifdef BT_NAN_BOXING
+struct Vector {
+    float v[4];
+    int count;
+};
+
+#define isvector(vl) (vtype(vl) == VT_VEC)
+#define veccomponents(vl) (tovector(vl)->v)
+#define veccount(vl) (tovector(vl)->count)
+#else
+#define isvector(vl) ((unsigned)((vl).type - VT_VEC2) <= VT_VEC4 - VT_VEC2)
+#define veccomponents(vl) ((vl).vec)
+#define veccount(vl) ((vl).type - VT_VEC2 + 2)
+#endif
+
+int vec_swizzle(Key* k, int* idx);
+
+int vec_new(bt_Context* bt, bt_Value* components, int count, bt_Value* dst);
+int vec_arith(bt_Context* bt, int op, bt_Value* lhs, bt_Value* rhs, bt_Value* dst);
+int vec_get(bt_Context* bt, bt_Value* vl, Key* k, bt_Value* dst);
+int vec_set(bt_Context* bt, bt_Value* vl, Key* k, bt_Value* src);
+int vec_equal(bt_Value* l, bt_Value* r);
+
+#else
+
+/* Without vectors nothing is one, so everything that would take one fails */
+#define isvector(vl) 0
+
+static inline int vec_swizzle(Key* k, int* idx) { (void)k; (void)idx; return 0; }
+
+static inline int vec_new(bt_Context* bt, bt_Value* components, int count, bt_Value* dst)
+{
+    (void)bt; (void)components; (void)count; (void)dst;
+    return 0;
+}
+
+static inline int vec_arith(bt_Context* bt, int op, bt_Value* lhs, bt_Value* rhs, bt_Value* dst)
+{
+    (void)bt; (void)op; (void)lhs; (void)rhs; (void)dst;
+    return 0;
+}
+
+static inline int vec_get(bt_Context* bt, bt_Value* vl, Key* k, bt_Value* dst)
+{
+    (void)bt; (void)vl; (void)k; (void)dst;
+    return 0;
+}
+
+static inline int vec_set(bt_Context* bt, bt_Value* vl, Key* k, bt_Value* src)
+{
+    (void)bt; (void)vl; (void)k; (void)src;
+    return 0;
+}
+
+#endif
+
+#endif
\ No newline at end of file